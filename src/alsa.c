@@ -26,9 +26,19 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
 #include <semaphore.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <alsa/asoundlib.h>
 
 #include "canberra.h"
@@ -38,19 +48,52 @@
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
 #include "malloc.h"
+#include "id-table.h"
+#include "player-pool.h"
+#include "realtime.h"
 
 struct private;
+struct mixer;
+struct cached_pcm;
 
 struct outstanding {
         CA_LLIST_FIELDS(struct outstanding);
+        ca_id_link by_id;
         ca_bool_t dead;
         uint32_t id;
         ca_finish_callback_t callback;
         void *userdata;
         ca_sound_file *file;
         snd_pcm_t *pcm;
-        int pipe_fd[2];
+        char *device;
+        /* The format of the sound file, or the guessed one if we open
+         * the device speculatively */
+        snd_pcm_format_t format;
+        unsigned rate;
+        unsigned nchannels;
+        uint32_t latency;
+        ca_bool_t realtime;
+        /* Whether we decode straight into the mmap'ed ring buffer */
+        ca_bool_t mmap;
+        /* In power save mode how much we write at once when starting
+         * and when refilling. 0 otherwise. */
+        snd_pcm_uframes_t prefill, refill;
+        /* The beginning of the sound, decoded while the device was
+         * being opened */
+        void *predecoded;
+        size_t n_predecoded, predecoded_index;
+        /* Fed by a worker of the player pool */
+        ca_playback playback;
+        size_t fs;
+        void *data, *d;
+        size_t data_size, read_size, nbytes;
+        /* Everything has been written, we only wait for the device to
+         * play it */
+        ca_bool_t draining;
         ca_context *context;
+        /* When played by the mixer, the next voice on the mixer's
+         * queue or list */
+        struct outstanding *mix_next;
 };
 
 struct private {
@@ -60,6 +103,30 @@ struct private {
         sem_t semaphore;
         ca_bool_t semaphore_allocated;
         CA_LLIST_HEAD(struct outstanding, outstanding);
+        ca_id_table outstanding_by_id;
+
+        /* Play all sounds through the software mixer */
+        ca_bool_t mix;
+        CA_LLIST_HEAD(struct mixer, mixers);
+
+        /* PCMs of finished sounds, most recently used first. Protected
+         * by the outstanding_mutex */
+        CA_LLIST_HEAD(struct cached_pcm, cached_pcms);
+        unsigned n_cached_pcms;
+        ca_bool_t pcm_cache_thread_running;
+        ca_bool_t pcm_cache_quit;
+        pthread_t pcm_cache_thread;
+        int pcm_cache_pipe[2];
+
+        /* The format of the last sound, so that we can start opening
+         * the device for the next one while it is still being looked
+         * up. Protected by the outstanding_mutex */
+        ca_bool_t have_guess;
+        snd_pcm_format_t guess_format;
+        unsigned guess_rate, guess_nchannels;
+
+        /* Whether we hold a reference to the global ALSA configuration */
+        ca_bool_t config_ref;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -67,21 +134,100 @@ struct private {
 static void outstanding_free(struct outstanding *o) {
         ca_assert(o);
 
-        if (o->pipe_fd[1] >= 0)
-                close(o->pipe_fd[1]);
-
-        if (o->pipe_fd[0] >= 0)
-                close(o->pipe_fd[0]);
-
         if (o->file)
                 ca_sound_file_close(o->file);
 
         if (o->pcm)
                 snd_pcm_close(o->pcm);
 
+        ca_free(o->predecoded);
+        ca_free(o->data);
+        ca_free(o->device);
         ca_free(o);
 }
 
+/* Called by whoever played a sound when it is over */
+static void outstanding_done(struct private *p, struct outstanding *out, int ret) {
+        ca_bool_t dead;
+
+        ca_assert(p);
+        ca_assert(out);
+
+        /* driver_cancel() might be calling back right now, the flag
+         * decides who does it */
+        ca_mutex_lock(p->outstanding_mutex);
+        dead = out->dead;
+        out->dead = TRUE;
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        if (!dead)
+                if (out->callback)
+                        out->callback(out->context, out->id, ret, out->userdata);
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
+
+        if (!p->outstanding && p->signal_semaphore)
+                sem_post(&p->semaphore);
+
+        outstanding_free(out);
+
+        ca_mutex_unlock(p->outstanding_mutex);
+}
+
+static void mixers_stop(struct private *p);
+static void pcm_cache_stop(struct private *p);
+
+/* ALSA parses its configuration files only once per process and keeps
+ * the result around until it is told to free it. Reparsing alsa.conf
+ * and everything it includes is expensive, hence we only free it when
+ * the last context goes away, and not whenever any context does. */
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *config_mutex = NULL;
+static unsigned n_config_refs = 0;
+
+static void allocate_config_mutex_once(void) {
+        config_mutex = ca_mutex_new();
+}
+
+static int config_ref(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        if (pthread_once(&once, allocate_config_mutex_once) != 0)
+                return CA_ERROR_OOM;
+
+        if (!config_mutex)
+                return CA_ERROR_OOM;
+
+        ca_mutex_lock(config_mutex);
+        n_config_refs++;
+        ca_mutex_unlock(config_mutex);
+
+        return CA_SUCCESS;
+}
+
+/* Must only be called once the context doesn't use ALSA anymore, that
+ * is after all its PCMs have been closed */
+static void config_unref(void) {
+        ca_assert(config_mutex);
+
+        ca_mutex_lock(config_mutex);
+
+        ca_assert(n_config_refs > 0);
+
+        /* Taking the mutex here makes sure no other context can be
+         * opened while we free it */
+        if (--n_config_refs <= 0)
+                snd_config_update_free_global();
+
+        ca_mutex_unlock(config_mutex);
+}
+
 int driver_open(ca_context *c) {
         struct private *p;
 
@@ -92,11 +238,25 @@ int driver_open(ca_context *c) {
         if (!(c->private = p = ca_new0(struct private, 1)))
                 return CA_ERROR_OOM;
 
+        p->pcm_cache_pipe[0] = p->pcm_cache_pipe[1] = -1;
+
+        if (config_ref() < 0) {
+                driver_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
+        p->config_ref = TRUE;
+
         if (!(p->outstanding_mutex = ca_mutex_new())) {
                 driver_destroy(c);
                 return CA_ERROR_OOM;
         }
 
+        if (ca_id_table_init(&p->outstanding_by_id) < 0) {
+                driver_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
         if (sem_init(&p->semaphore, 0, 0) < 0) {
                 driver_destroy(c);
                 return CA_ERROR_OOM;
@@ -104,6 +264,8 @@ int driver_open(ca_context *c) {
 
         p->semaphore_allocated = TRUE;
 
+        p->mix = !!getenv("CANBERRA_ALSA_MIXER");
+
         return CA_SUCCESS;
 }
 
@@ -130,11 +292,9 @@ int driver_destroy(ca_context *c) {
                         if (out->callback)
                                 out->callback(c, out->id, CA_ERROR_DESTROYED, out->userdata);
 
-                        /* This will cause the thread to wakeup and terminate */
-                        if (out->pipe_fd[1] >= 0) {
-                                close(out->pipe_fd[1]);
-                                out->pipe_fd[1] = -1;
-                        }
+                        /* This will cause the worker to drop the sound */
+                        if (!p->mix)
+                                ca_player_pool_wakeup(&out->playback);
                 }
 
                 if (p->semaphore_allocated) {
@@ -148,21 +308,31 @@ int driver_destroy(ca_context *c) {
                 }
 
                 ca_mutex_unlock(p->outstanding_mutex);
+
+                /* All voices are gone, hence the mixers are idle now */
+                mixers_stop(p);
+                pcm_cache_stop(p);
+
                 ca_mutex_free(p->outstanding_mutex);
         }
 
+        ca_id_table_done(&p->outstanding_by_id);
+
         if (p->theme)
                 ca_theme_data_free(p->theme);
 
         if (p->semaphore_allocated)
                 sem_destroy(&p->semaphore);
 
+        /* The players, mixers and the PCM cache are all gone, so this
+         * context won't touch the configuration anymore */
+        if (p->config_ref)
+                config_unref();
+
         ca_free(p);
 
         c->private = NULL;
 
-        snd_config_update_free_global();
-
         return CA_SUCCESS;
 }
 
@@ -223,322 +393,1678 @@ static const snd_pcm_format_t sample_type_table[] = {
         [CA_SAMPLE_U8] = SND_PCM_FORMAT_U8
 };
 
-static int open_alsa(ca_context *c, struct outstanding *out) {
+#define POWERSAVE_BUFFER_USEC_MAX (2*1000*1000)
+
+static int set_latency_hw(struct outstanding *out, snd_pcm_hw_params_t *hwparams) {
+        snd_pcm_uframes_t size;
+        unsigned usec;
         int ret;
-        snd_pcm_hw_params_t *hwparams;
-        unsigned rate;
 
-        snd_pcm_hw_params_alloca(&hwparams);
+        if (out->latency == CA_LATENCY_DEFAULT)
+                return 0;
 
-        ca_return_val_if_fail(c, CA_ERROR_INVALID);
-        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
-        ca_return_val_if_fail(out, CA_ERROR_INVALID);
+        if (out->latency == CA_LATENCY_POWERSAVE) {
+                /* As few wakeups as the device allows. Larger buffers
+                 * than this would only cost memory, since we fill
+                 * them in one go. */
+                usec = POWERSAVE_BUFFER_USEC_MAX;
+                if ((ret = snd_pcm_hw_params_set_buffer_time_max(out->pcm, hwparams, &usec, NULL)) < 0)
+                        return ret;
 
-        /* In ALSA we need to open different devices for doing
-         * multichannel audio. This cnnot be done in a backend-independant
-         * wa, hence we limit ourselves to mono/stereo only. */
-        ca_return_val_if_fail(ca_sound_file_get_nchannels(out->file) <= 2, CA_ERROR_NOTSUPPORTED);
+                if ((ret = snd_pcm_hw_params_set_buffer_size_last(out->pcm, hwparams, &size)) < 0)
+                        return ret;
 
-        if ((ret = snd_pcm_open(&out->pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
-                goto finish;
+                return snd_pcm_hw_params_set_period_size_last(out->pcm, hwparams, &size, NULL);
+        }
 
-        if ((ret = snd_pcm_hw_params_any(out->pcm, hwparams)) < 0)
-                goto finish;
+        /* Four periods per buffer, so that we are woken up early
+         * enough to refill it in time */
+        usec = out->latency;
+        if ((ret = snd_pcm_hw_params_set_buffer_time_near(out->pcm, hwparams, &usec, NULL)) < 0)
+                return ret;
 
-        if ((ret = snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
-                goto finish;
+        usec /= 4;
+        return snd_pcm_hw_params_set_period_time_near(out->pcm, hwparams, &usec, NULL);
+}
 
-        if ((ret = snd_pcm_hw_params_set_format(out->pcm, hwparams, sample_type_table[ca_sound_file_get_sample_type(out->file)])) < 0)
-                goto finish;
+static int set_latency_sw(struct outstanding *out, snd_pcm_hw_params_t *hwparams) {
+        snd_pcm_sw_params_t *swparams;
+        snd_pcm_uframes_t period_size, buffer_size;
+        int ret;
 
-        rate = ca_sound_file_get_rate(out->file);
-        if ((ret = snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &rate, 0)) < 0)
-                goto finish;
+        if (out->latency == CA_LATENCY_DEFAULT)
+                return 0;
 
-        if ((ret = snd_pcm_hw_params_set_channels(out->pcm, hwparams, ca_sound_file_get_nchannels(out->file))) < 0)
-                goto finish;
+        snd_pcm_sw_params_alloca(&swparams);
 
-        if ((ret = snd_pcm_hw_params(out->pcm, hwparams)) < 0)
-                goto finish;
+        if ((ret = snd_pcm_hw_params_get_period_size(hwparams, &period_size, NULL)) < 0)
+                return ret;
 
-        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
-                goto finish;
+        if ((ret = snd_pcm_sw_params_current(out->pcm, swparams)) < 0)
+                return ret;
 
-        return CA_SUCCESS;
+        if (out->latency == CA_LATENCY_POWERSAVE) {
 
-finish:
+                if ((ret = snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size)) < 0)
+                        return ret;
 
-        return translate_error(ret);
+                /* Sleep until only a single period is left to play,
+                 * then refill everything that has been played */
+                out->prefill = buffer_size;
+                out->refill = buffer_size > 2*period_size ? buffer_size - period_size : period_size;
+
+                if ((ret = snd_pcm_sw_params_set_avail_min(out->pcm, swparams, out->refill)) < 0)
+                        return ret;
+
+                return snd_pcm_sw_params(out->pcm, swparams);
+        }
+
+        /* Start playback as soon as the first period has been
+         * written instead of waiting for the whole buffer */
+        if ((ret = snd_pcm_sw_params_set_start_threshold(out->pcm, swparams, period_size)) < 0)
+                return ret;
+
+        if ((ret = snd_pcm_sw_params_set_avail_min(out->pcm, swparams, period_size)) < 0)
+                return ret;
+
+        return snd_pcm_sw_params(out->pcm, swparams);
 }
 
-#define BUFSIZE (16*1024)
+/* Recently used PCMs are kept open for a while, so that the next
+ * sound in the same format doesn't have to set up the device again */
+#define PCM_CACHE_MAX 4
+#define PCM_CACHE_IDLE_USEC (2*1000*1000)
 
-static void* thread_func(void *userdata) {
-        struct outstanding *out = userdata;
-        int ret;
-        void *data, *d = NULL;
-        size_t fs, data_size;
-        size_t nbytes = 0;
-        struct pollfd *pfd = NULL;
-        nfds_t n_pfd;
-        struct private *p;
+struct cached_pcm {
+        CA_LLIST_FIELDS(struct cached_pcm);
+        snd_pcm_t *pcm;
+        char *device;
+        snd_pcm_format_t format;
+        unsigned rate;
+        unsigned nchannels;
+        uint32_t latency;
+        ca_bool_t mmap;
+        snd_pcm_uframes_t prefill, refill;
+        uint64_t last_used;
+};
 
-        p = PRIVATE(out->context);
+static uint64_t now_usec(void) {
+        struct timespec ts;
 
-        pthread_detach(pthread_self());
+        ca_assert_se(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
 
-        fs = ca_sound_file_frame_size(out->file);
-        data_size = (BUFSIZE/fs)*fs;
+        return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
 
-        if (!(data = ca_malloc(data_size))) {
-                ret = CA_ERROR_OOM;
-                goto finish;
-        }
+static void cached_pcm_free(struct cached_pcm *e) {
+        ca_assert(e);
 
-        if ((ret = snd_pcm_poll_descriptors_count(out->pcm)) < 0) {
-                ret = translate_error(ret);
-                goto finish;
-        }
+        if (e->pcm)
+                snd_pcm_close(e->pcm);
 
-        n_pfd = (nfds_t) ret + 1;
-        if (!(pfd = ca_new(struct pollfd, n_pfd))) {
-                ret = CA_ERROR_OOM;
-                goto finish;
-        }
+        ca_free(e->device);
+        ca_free(e);
+}
 
-        if ((ret = snd_pcm_poll_descriptors(out->pcm, pfd+1, (unsigned) n_pfd-1)) < 0) {
-                ret = translate_error(ret);
-                goto finish;
-        }
+static ca_bool_t cached_pcm_matches(struct cached_pcm *e, struct outstanding *out) {
+        return
+                ca_streq(e->device, out->device) &&
+                e->format == out->format &&
+                e->rate == out->rate &&
+                e->nchannels == out->nchannels &&
+                e->latency == out->latency;
+}
 
-        pfd[0].fd = out->pipe_fd[0];
-        pfd[0].events = POLLIN;
-        pfd[0].revents = 0;
+/* Closes everything that has been idle for too long, and returns how
+ * long to wait for the next one, in msec. Needs the outstanding
+ * mutex. */
+static int pcm_cache_expire(struct private *p, struct cached_pcm **expired) {
+        struct cached_pcm *e, *n;
+        uint64_t now, wait = 0;
 
-        for (;;) {
-                unsigned short revents;
-                snd_pcm_sframes_t sframes;
+        now = now_usec();
 
-                if (out->dead)
-                        break;
+        for (e = p->cached_pcms; e; e = n) {
+                n = e->next;
 
-                if (poll(pfd, n_pfd, -1) < 0) {
-                        ret = CA_ERROR_SYSTEM;
-                        goto finish;
-                }
+                if (e->last_used + PCM_CACHE_IDLE_USEC > now) {
+                        uint64_t w = e->last_used + PCM_CACHE_IDLE_USEC - now;
 
-                /* We have been asked to shut down */
-                if (pfd[0].revents)
-                        break;
+                        if (wait == 0 || w < wait)
+                                wait = w;
 
-                if ((ret = snd_pcm_poll_descriptors_revents(out->pcm, pfd+1, (unsigned) n_pfd-1, &revents)) < 0) {
-                        ret = translate_error(ret);
-                        goto finish;
+                        continue;
                 }
 
-                if (revents != POLLOUT) {
+                CA_LLIST_REMOVE(struct cached_pcm, p->cached_pcms, e);
+                p->n_cached_pcms--;
+                CA_LLIST_PREPEND(struct cached_pcm, *expired, e);
+        }
 
-                        switch (snd_pcm_state(out->pcm)) {
+        return wait > 0 ? (int) (wait / 1000) + 1 : -1;
+}
 
-                        case SND_PCM_STATE_XRUN:
+static void* pcm_cache_thread_func(void *userdata) {
+        struct private *p = userdata;
 
-                                if ((ret = snd_pcm_recover(out->pcm, -EPIPE, 1)) != 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
+        ca_mutex_lock(p->outstanding_mutex);
 
-                        case SND_PCM_STATE_SUSPENDED:
+        while (!p->pcm_cache_quit) {
+                struct cached_pcm *expired = NULL, *e;
+                struct pollfd pfd;
+                char buf[64];
+                int timeout;
 
-                                if ((ret = snd_pcm_recover(out->pcm, -ESTRPIPE, 1)) != 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
+                timeout = pcm_cache_expire(p, &expired);
 
-                        default:
+                ca_mutex_unlock(p->outstanding_mutex);
 
-                                snd_pcm_drop(out->pcm);
+                /* Closing might take a while, don't do it with the lock
+                 * taken */
+                while ((e = expired)) {
+                        CA_LLIST_REMOVE(struct cached_pcm, expired, e);
+                        cached_pcm_free(e);
+                }
 
-                                if ((ret = snd_pcm_prepare(out->pcm)) < 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
-                        }
+                pfd.fd = p->pcm_cache_pipe[0];
+                pfd.events = POLLIN;
+                pfd.revents = 0;
 
-                        continue;
-                }
+                if (poll(&pfd, 1, timeout) > 0)
+                        while (read(p->pcm_cache_pipe[0], buf, sizeof(buf)) > 0)
+                                ;
 
-                if (nbytes <= 0) {
+                ca_mutex_lock(p->outstanding_mutex);
+        }
 
-                        nbytes = data_size;
+        ca_mutex_unlock(p->outstanding_mutex);
 
-                        if ((ret = ca_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
-                                goto finish;
+        return NULL;
+}
 
-                        d = data;
-                }
+static void pcm_cache_wakeup(struct private *p) {
+        char x = 'x';
 
-                if (nbytes <= 0) {
-                        snd_pcm_drain(out->pcm);
-                        break;
-                }
+        (void) write(p->pcm_cache_pipe[1], &x, 1);
+}
 
-                if ((sframes = snd_pcm_writei(out->pcm, d, nbytes/fs)) < 0) {
+/* Needs the outstanding mutex */
+static int pcm_cache_start(struct private *p) {
 
-                        if ((ret = snd_pcm_recover(out->pcm, (int) sframes, 1)) < 0) {
-                                ret = translate_error(ret);
-                                goto finish;
-                        }
+        if (p->pcm_cache_thread_running)
+                return CA_SUCCESS;
 
-                        continue;
-                }
+        if (p->pcm_cache_pipe[0] < 0) {
+                if (pipe(p->pcm_cache_pipe) < 0)
+                        return CA_ERROR_SYSTEM;
 
-                nbytes -= (size_t) sframes*fs;
-                d = (uint8_t*) d + (size_t) sframes*fs;
+                if (fcntl(p->pcm_cache_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+                    fcntl(p->pcm_cache_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+                        return CA_ERROR_SYSTEM;
         }
 
-        ret = CA_SUCCESS;
-
-finish:
+        if (ca_player_pool_spawn(&p->pcm_cache_thread, pcm_cache_thread_func, p) < 0)
+                return CA_ERROR_OOM;
 
-        ca_free(data);
-        ca_free(pfd);
+        p->pcm_cache_thread_running = TRUE;
+        return CA_SUCCESS;
+}
 
-        if (!out->dead)
-                if (out->callback)
-                        out->callback(out->context, out->id, ret, out->userdata);
+static void pcm_cache_stop(struct private *p) {
+        struct cached_pcm *e;
 
         ca_mutex_lock(p->outstanding_mutex);
+        p->pcm_cache_quit = TRUE;
+        ca_mutex_unlock(p->outstanding_mutex);
 
-        CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        if (p->pcm_cache_thread_running) {
+                pcm_cache_wakeup(p);
+                pthread_join(p->pcm_cache_thread, NULL);
+                p->pcm_cache_thread_running = FALSE;
+        }
 
-        if (!p->outstanding && p->signal_semaphore)
-                sem_post(&p->semaphore);
+        while ((e = p->cached_pcms)) {
+                CA_LLIST_REMOVE(struct cached_pcm, p->cached_pcms, e);
+                cached_pcm_free(e);
+        }
 
-        outstanding_free(out);
+        p->n_cached_pcms = 0;
 
-        ca_mutex_unlock(p->outstanding_mutex);
+        if (p->pcm_cache_pipe[0] >= 0)
+                close(p->pcm_cache_pipe[0]);
 
-        return NULL;
+        if (p->pcm_cache_pipe[1] >= 0)
+                close(p->pcm_cache_pipe[1]);
 }
 
-int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
-        struct private *p;
-        struct outstanding *out = NULL;
-        int ret;
-        pthread_t thread;
+/* Hands the PCM of a finished sound over to the cache */
+static void pcm_cache_put(struct private *p, struct outstanding *out) {
+        struct cached_pcm *e, *evicted = NULL;
+        ca_bool_t was_empty;
 
-        ca_return_val_if_fail(c, CA_ERROR_INVALID);
-        ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
-        ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
-        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+        if (!out->pcm || !out->device)
+                return;
 
-        p = PRIVATE(c);
+        /* Stop the device so that it can be prepared again when it
+         * is reused */
+        snd_pcm_drop(out->pcm);
 
-        if (!(out = ca_new0(struct outstanding, 1))) {
-                ret = CA_ERROR_OOM;
-                goto finish;
-        }
+        if (!(e = ca_new0(struct cached_pcm, 1)))
+                return;
 
-        out->context = c;
-        out->id = id;
-        out->callback = cb;
-        out->userdata = userdata;
-        out->pipe_fd[0] = out->pipe_fd[1] = -1;
+        e->format = out->format;
+        e->rate = out->rate;
+        e->nchannels = out->nchannels;
+        e->latency = out->latency;
+        e->mmap = out->mmap;
+        e->prefill = out->prefill;
+        e->refill = out->refill;
+        e->last_used = now_usec();
 
-        if (pipe(out->pipe_fd) < 0) {
-                ret = CA_ERROR_SYSTEM;
-                goto finish;
+        ca_mutex_lock(p->outstanding_mutex);
+
+        if (p->pcm_cache_quit || pcm_cache_start(p) < 0) {
+                ca_mutex_unlock(p->outstanding_mutex);
+                ca_free(e);
+                return;
         }
 
-        if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
-                goto finish;
+        e->pcm = out->pcm;
+        out->pcm = NULL;
+        e->device = out->device;
+        out->device = NULL;
 
-        if ((ret = open_alsa(c, out)) < 0)
-                goto finish;
+        was_empty = !p->cached_pcms;
+        CA_LLIST_PREPEND(struct cached_pcm, p->cached_pcms, e);
 
-        /* OK, we're ready to go, so let's add this to our list */
-        ca_mutex_lock(p->outstanding_mutex);
-        CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
-        ca_mutex_unlock(p->outstanding_mutex);
+        /* Make room by dropping the one used longest ago */
+        if (++p->n_cached_pcms > PCM_CACHE_MAX) {
+                for (evicted = p->cached_pcms; evicted->next; evicted = evicted->next)
+                        ;
 
-        if (pthread_create(&thread, NULL, thread_func, out) < 0) {
-                ret = CA_ERROR_OOM;
+                CA_LLIST_REMOVE(struct cached_pcm, p->cached_pcms, evicted);
+                p->n_cached_pcms--;
+        }
 
-                ca_mutex_lock(p->outstanding_mutex);
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
-                ca_mutex_unlock(p->outstanding_mutex);
+        ca_mutex_unlock(p->outstanding_mutex);
 
-                goto finish;
-        }
+        /* The cache thread sleeps forever while the cache is empty */
+        if (was_empty)
+                pcm_cache_wakeup(p);
 
-        ret = CA_SUCCESS;
+        if (evicted)
+                cached_pcm_free(evicted);
+}
 
-finish:
+/* Needs the outstanding mutex */
+static struct cached_pcm* pcm_cache_find(struct private *p, struct outstanding *out) {
+        struct cached_pcm *e;
 
-        /* We keep the outstanding struct around if we need clean up later to */
-        if (ret != CA_SUCCESS)
-                outstanding_free(out);
+        for (e = p->cached_pcms; e; e = e->next)
+                if (cached_pcm_matches(e, out))
+                        return e;
 
-        return ret;
+        return NULL;
 }
 
-int driver_cancel(ca_context *c, uint32_t id) {
-        struct private *p;
-        struct outstanding *out;
+/* Needs the outstanding mutex */
+static ca_bool_t pcm_cache_has_device(struct private *p, const char *device) {
+        struct cached_pcm *e;
 
-        ca_return_val_if_fail(c, CA_ERROR_INVALID);
-        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+        for (e = p->cached_pcms; e; e = e->next)
+                if (ca_streq(e->device, device))
+                        return TRUE;
 
-        p = PRIVATE(c);
+        return FALSE;
+}
+
+static ca_bool_t pcm_cache_has(struct private *p, struct outstanding *out) {
+        ca_bool_t b;
 
         ca_mutex_lock(p->outstanding_mutex);
+        b = !!pcm_cache_find(p, out);
+        ca_mutex_unlock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        return b;
+}
 
-                if (out->id != id)
-                        continue;
+/* Closes all cached PCMs of a device, returns TRUE if there were any */
+static ca_bool_t pcm_cache_flush(struct private *p, const char *device) {
+        struct cached_pcm *e, *n, *flushed = NULL;
 
-                if (out->dead)
-                        continue;
+        ca_mutex_lock(p->outstanding_mutex);
 
-                out->dead = TRUE;
+        for (e = p->cached_pcms; e; e = n) {
+                n = e->next;
 
-                if (out->callback)
-                        out->callback(c, out->id, CA_ERROR_CANCELED, out->userdata);
+                if (!ca_streq(e->device, device))
+                        continue;
 
-                /* This will cause the thread to wakeup and terminate */
-                if (out->pipe_fd[1] >= 0) {
-                        close(out->pipe_fd[1]);
-                        out->pipe_fd[1] = -1;
-                }
+                CA_LLIST_REMOVE(struct cached_pcm, p->cached_pcms, e);
+                p->n_cached_pcms--;
+                CA_LLIST_PREPEND(struct cached_pcm, flushed, e);
         }
 
         ca_mutex_unlock(p->outstanding_mutex);
 
-        return CA_SUCCESS;
+        if (!flushed)
+                return FALSE;
+
+        while ((e = flushed)) {
+                CA_LLIST_REMOVE(struct cached_pcm, flushed, e);
+                cached_pcm_free(e);
+        }
+
+        return TRUE;
 }
 
-int driver_playing(ca_context *c, uint32_t id, int *playing) {
-        struct private *p;
-        struct outstanding *out;
+/* Takes a matching PCM from the cache, if there is one */
+static snd_pcm_t* pcm_cache_get(struct private *p, struct outstanding *out) {
+        struct cached_pcm *e;
+        snd_pcm_t *pcm = NULL;
 
-        ca_return_val_if_fail(c, CA_ERROR_INVALID);
-        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
-        ca_return_val_if_fail(playing, CA_ERROR_INVALID);
+        ca_mutex_lock(p->outstanding_mutex);
 
-        p = PRIVATE(c);
+        if ((e = pcm_cache_find(p, out))) {
+                CA_LLIST_REMOVE(struct cached_pcm, p->cached_pcms, e);
+                p->n_cached_pcms--;
+        }
 
-        *playing = 0;
+        ca_mutex_unlock(p->outstanding_mutex);
 
-        ca_mutex_lock(p->outstanding_mutex);
+        if (!e)
+                return NULL;
 
-        for (out = p->outstanding; out; out = out->next) {
+        pcm = e->pcm;
+        e->pcm = NULL;
+        out->mmap = e->mmap;
+        out->prefill = e->prefill;
+        out->refill = e->refill;
+
+        cached_pcm_free(e);
+
+        return pcm;
+}
+
+static int open_alsa(ca_context *c, struct outstanding *out) {
+        int ret;
+        snd_pcm_hw_params_t *hwparams;
+        unsigned rate;
 
-                if (out->dead ||
-                    out->id != id)
+        snd_pcm_hw_params_alloca(&hwparams);
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+        ca_return_val_if_fail(out, CA_ERROR_INVALID);
+
+        /* In ALSA we need to open different devices for doing
+         * multichannel audio. This cnnot be done in a backend-independant
+         * wa, hence we limit ourselves to mono/stereo only. */
+        ca_return_val_if_fail(out->nchannels <= 2, CA_ERROR_NOTSUPPORTED);
+        ca_return_val_if_fail(out->device, CA_ERROR_STATE);
+
+        /* Reuse a PCM a previous sound left behind */
+        if ((out->pcm = pcm_cache_get(PRIVATE(c), out))) {
+
+                if (snd_pcm_prepare(out->pcm) >= 0)
+                        return CA_SUCCESS;
+
+                snd_pcm_close(out->pcm);
+                out->pcm = NULL;
+                out->mmap = FALSE;
+                out->prefill = out->refill = 0;
+        }
+
+        /* Devices that can be opened only once might be kept busy by
+         * our own cache, in a different format */
+        if ((ret = snd_pcm_open(&out->pcm, out->device, SND_PCM_STREAM_PLAYBACK, 0)) == -EBUSY)
+                if (pcm_cache_flush(PRIVATE(c), out->device))
+                        ret = snd_pcm_open(&out->pcm, out->device, SND_PCM_STREAM_PLAYBACK, 0);
+
+        if (ret < 0)
+                goto finish;
+
+        /* The worker feeding the device must never block on it */
+        if ((ret = snd_pcm_nonblock(out->pcm, 1)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_any(out->pcm, hwparams)) < 0)
+                goto finish;
+
+        /* If the device supports it we decode directly into its
+         * buffer, which saves us a copy */
+        if (snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0)
+                out->mmap = TRUE;
+        else if ((ret = snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_format(out->pcm, hwparams, out->format)) < 0)
+                goto finish;
+
+        rate = out->rate;
+        if ((ret = snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &rate, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_channels(out->pcm, hwparams, out->nchannels)) < 0)
+                goto finish;
+
+        if ((ret = set_latency_hw(out, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params(out->pcm, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = set_latency_sw(out, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
+                goto finish;
+
+        return CA_SUCCESS;
+
+finish:
+
+        return translate_error(ret);
+}
+
+#define BUFSIZE (16*1024)
+
+/* How much of a sound we decode while the device is being opened */
+#define PREDECODE_USEC (20*1000)
+
+static int predecode(struct outstanding *out) {
+        size_t nbytes;
+        int ret;
+
+        nbytes = CA_MAX((size_t) ((uint64_t) out->rate * PREDECODE_USEC / 1000000ULL), 1U) * ca_sound_file_frame_size(out->file);
+
+        if (!(out->predecoded = ca_malloc(nbytes)))
+                return CA_ERROR_OOM;
+
+        if ((ret = ca_sound_file_read_arbitrary(out->file, out->predecoded, &nbytes)) < 0)
+                return ret;
+
+        out->n_predecoded = nbytes;
+        return CA_SUCCESS;
+}
+
+/* Like ca_sound_file_read_arbitrary(), but hands out what has been
+ * decoded in advance first */
+static int read_sound(struct outstanding *out, void *d, size_t *nbytes) {
+
+        if (out->predecoded_index < out->n_predecoded) {
+                size_t n;
+
+                n = CA_MIN(*nbytes, out->n_predecoded - out->predecoded_index);
+                memcpy(d, (uint8_t*) out->predecoded + out->predecoded_index, n);
+                out->predecoded_index += n;
+
+                *nbytes = n;
+                return CA_SUCCESS;
+        }
+
+        return ca_sound_file_read_arbitrary(out->file, d, nbytes);
+}
+
+/* Fills all space that is free in the ring buffer directly from the
+ * sound file. Returns 1 on EOF. */
+static int write_mmap(struct outstanding *out) {
+        snd_pcm_sframes_t sframes;
+        ca_bool_t eof = FALSE;
+        int ret;
+
+        for (;;) {
+                const snd_pcm_channel_area_t *areas;
+                snd_pcm_uframes_t offset, frames;
+                size_t nbytes;
+                void *d;
+
+                if ((sframes = snd_pcm_avail_update(out->pcm)) < 0) {
+
+                        if ((ret = snd_pcm_recover(out->pcm, (int) sframes, 1)) < 0)
+                                return translate_error(ret);
+
+                        continue;
+                }
+
+                if (sframes == 0)
+                        break;
+
+                frames = (snd_pcm_uframes_t) sframes;
+                if ((ret = snd_pcm_mmap_begin(out->pcm, &areas, &offset, &frames)) < 0) {
+
+                        if ((ret = snd_pcm_recover(out->pcm, ret, 1)) < 0)
+                                return translate_error(ret);
+
+                        continue;
+                }
+
+                /* Interleaved, hence all channels share the first area */
+                d = (uint8_t*) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+                nbytes = (size_t) frames * out->fs;
+
+                if ((ret = read_sound(out, d, &nbytes)) < 0) {
+                        snd_pcm_mmap_commit(out->pcm, offset, 0);
+                        return ret;
+                }
+
+                frames = (snd_pcm_uframes_t) (nbytes / out->fs);
+                sframes = snd_pcm_mmap_commit(out->pcm, offset, frames);
+
+                if (sframes < 0 || (snd_pcm_uframes_t) sframes != frames) {
+
+                        if ((ret = snd_pcm_recover(out->pcm, sframes >= 0 ? -EPIPE : (int) sframes, 1)) < 0)
+                                return translate_error(ret);
+
+                        continue;
+                }
+
+                if (frames == 0) {
+                        eof = TRUE;
+                        break;
+                }
+        }
+
+        /* Unlike snd_pcm_writei() committing doesn't start the
+         * device, so do that once the buffer is filled */
+        if (snd_pcm_state(out->pcm) == SND_PCM_STATE_PREPARED)
+                if ((ret = snd_pcm_start(out->pcm)) < 0)
+                        return translate_error(ret);
+
+        return eof ? 1 : 0;
+}
+
+/* Once everything has been written we wait for the device to play
+ * it, instead of blocking the worker in snd_pcm_drain() */
+static int start_drain(struct outstanding *out) {
+        int ret;
+
+        /* Sounds shorter than the start threshold haven't been started
+         * yet */
+        if (snd_pcm_state(out->pcm) == SND_PCM_STATE_PREPARED)
+                if ((ret = snd_pcm_start(out->pcm)) < 0)
+                        return translate_error(ret);
+
+        out->draining = TRUE;
+        return 0;
+}
+
+static int playback_prepare(ca_playback *pb, struct pollfd *pfd, int *timeout) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+        int ret;
+
+        if (out->draining) {
+                snd_pcm_sframes_t delay;
+                int t;
+
+                /* Wake up when the device should be done */
+                if (snd_pcm_delay(out->pcm, &delay) < 0 || delay <= 0)
+                        t = 0;
+                else
+                        t = (int) ((uint64_t) delay * 1000 / out->rate) + 1;
+
+                if (*timeout < 0 || t < *timeout)
+                        *timeout = t;
+
+                return 0;
+        }
+
+        if ((ret = snd_pcm_poll_descriptors(out->pcm, pfd, pb->n_pollfd)) < 0)
+                return translate_error(ret);
+
+        return ret;
+}
+
+static int playback_dispatch(ca_playback *pb, struct pollfd *pfd, unsigned n) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+        unsigned short revents;
+        snd_pcm_sframes_t sframes;
+        int ret;
+
+        /* We have been asked to shut down */
+        if (out->dead)
+                return 1;
+
+        if (out->draining) {
+                snd_pcm_sframes_t delay;
+
+                /* When the buffer runs empty the device stops by
+                 * itself */
+                if (snd_pcm_state(out->pcm) != SND_PCM_STATE_RUNNING)
+                        return 1;
+
+                if (snd_pcm_delay(out->pcm, &delay) < 0 || delay <= 0)
+                        return 1;
+
+                return 0;
+        }
+
+        if ((ret = snd_pcm_poll_descriptors_revents(out->pcm, pfd, n, &revents)) < 0)
+                return translate_error(ret);
+
+        /* The wakeup was for somebody else */
+        if (!revents)
+                return 0;
+
+        if (revents != POLLOUT) {
+
+                switch (snd_pcm_state(out->pcm)) {
+
+                case SND_PCM_STATE_XRUN:
+
+                        if ((ret = snd_pcm_recover(out->pcm, -EPIPE, 1)) != 0)
+                                return translate_error(ret);
+                        break;
+
+                case SND_PCM_STATE_SUSPENDED:
+
+                        if ((ret = snd_pcm_recover(out->pcm, -ESTRPIPE, 1)) != 0)
+                                return translate_error(ret);
+                        break;
+
+                default:
+
+                        snd_pcm_drop(out->pcm);
+
+                        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
+                                return translate_error(ret);
+                        break;
+                }
+
+                return 0;
+        }
+
+        if (out->mmap) {
+
+                if ((ret = write_mmap(out)) <= 0)
+                        return ret;
+
+                return start_drain(out);
+        }
+
+        /* Write until the buffer is full */
+        for (;;) {
+
+                if (out->nbytes <= 0) {
+
+                        out->nbytes = out->read_size;
+
+                        if ((ret = read_sound(out, out->data, &out->nbytes)) < 0)
+                                return ret;
+
+                        out->d = out->data;
+
+                        /* After that only refill what has been played
+                         * since, so that the write never blocks */
+                        if (out->refill)
+                                out->read_size = CA_MIN(out->data_size, (size_t) out->refill * out->fs);
+                }
+
+                if (out->nbytes <= 0)
+                        return start_drain(out);
+
+                if ((sframes = snd_pcm_writei(out->pcm, out->d, out->nbytes/out->fs)) < 0) {
+
+                        if (sframes == -EAGAIN)
+                                return 0;
+
+                        if ((ret = snd_pcm_recover(out->pcm, (int) sframes, 1)) < 0)
+                                return translate_error(ret);
+
+                        return 0;
+                }
+
+                out->nbytes -= (size_t) sframes*out->fs;
+                out->d = (uint8_t*) out->d + (size_t) sframes*out->fs;
+
+                if (out->nbytes > 0)
+                        return 0;
+        }
+}
+
+static void playback_finish(ca_playback *pb, int ret) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+        struct private *p;
+
+        p = PRIVATE(out->context);
+
+        /* Keep the device around for the next sound */
+        if (ret == CA_SUCCESS)
+                pcm_cache_put(p, out);
+
+        outstanding_done(p, out, ret);
+}
+
+/* The software mixer: instead of opening the device for every sound
+ * we keep one PCM per device and format open and mix all sounds into
+ * it from a single thread. This allows sounds to overlap on devices
+ * that can be opened only once, and saves the device setup for every
+ * sound. Enabled with $CANBERRA_ALSA_MIXER.
+ *
+ * Note that the mixers belong to a context and we don't convert
+ * between rates or channel maps. Sounds played from other contexts,
+ * or in another format, need a PCM of their own, which fails with
+ * CA_ERROR_NOTAVAILABLE on such devices while the mixer has it open. */
+
+#define MIXER_BUFFER_USEC (40*1000)
+#define MIXER_PERIOD_USEC (10*1000)
+
+/* How long to keep the device open after the last sound */
+#define MIXER_IDLE_MSEC (2*1000)
+
+struct mixer {
+        CA_LLIST_FIELDS(struct mixer);
+        struct private *private;
+        char *device;
+        unsigned rate;
+        unsigned nchannels;
+
+        pthread_t thread;
+        int pipe_fd[2];
+
+        /* The device doesn't do our rate. Such a mixer has no thread,
+         * it only remembers that its sounds are to be played
+         * directly. */
+        ca_bool_t unusable;
+
+        /* Set from another thread, hence only accessed atomically */
+        ca_bool_t quit;
+
+        /* New voices are pushed here without taking a lock and taken
+         * all at once by the mixer thread */
+        struct outstanding *incoming;
+
+        /* Everything below is only accessed by the mixer thread */
+        struct outstanding *voices;
+        snd_pcm_t *pcm;
+        snd_pcm_uframes_t period_size;
+        int16_t *mix_buf, *voice_buf;
+        ca_bool_t realtime;
+};
+
+static void mixer_free(struct mixer *m) {
+        ca_assert(m);
+
+        if (m->pipe_fd[1] >= 0)
+                close(m->pipe_fd[1]);
+
+        if (m->pipe_fd[0] >= 0)
+                close(m->pipe_fd[0]);
+
+        if (m->pcm)
+                snd_pcm_close(m->pcm);
+
+        ca_free(m->device);
+        ca_free(m->mix_buf);
+        ca_free(m->voice_buf);
+        ca_free(m);
+}
+
+static void mixer_wakeup(struct mixer *m) {
+        char x = 'x';
+
+        /* If the pipe is full the mixer has enough to wake up for */
+        (void) write(m->pipe_fd[1], &x, 1);
+}
+
+static void mixer_push(struct mixer *m, struct outstanding *out) {
+        struct outstanding *head = NULL, *prev;
+
+        for (;;) {
+                out->mix_next = head;
+
+                if ((prev = __sync_val_compare_and_swap(&m->incoming, head, out)) == head)
+                        break;
+
+                head = prev;
+        }
+
+        mixer_wakeup(m);
+}
+
+static void mixer_take_incoming(struct mixer *m) {
+        struct outstanding *l;
+
+        l = __sync_lock_test_and_set(&m->incoming, NULL);
+
+        while (l) {
+                struct outstanding *n = l->mix_next;
+
+                l->mix_next = m->voices;
+                m->voices = l;
+                l = n;
+        }
+}
+
+/* Runs the mixer with real-time scheduling for as long as one of its
+ * voices asks for it */
+static void mixer_update_realtime(struct mixer *m) {
+        struct outstanding *out;
+        ca_bool_t realtime = FALSE;
+
+        for (out = m->voices; out; out = out->mix_next)
+                if (out->realtime) {
+                        realtime = TRUE;
+                        break;
+                }
+
+        if (realtime == m->realtime)
+                return;
+
+        if (realtime)
+                ca_realtime_request();
+        else
+                ca_realtime_drop();
+
+        m->realtime = realtime;
+}
+
+static void mixer_fail(struct mixer *m, int ret) {
+        struct outstanding *out;
+
+        while ((out = m->voices)) {
+                m->voices = out->mix_next;
+                outstanding_done(m->private, out, ret);
+        }
+}
+
+static int mixer_open_pcm(struct mixer *m) {
+        snd_pcm_hw_params_t *hwparams;
+        unsigned rate, usec;
+        size_t n;
+        int ret;
+
+        snd_pcm_hw_params_alloca(&hwparams);
+
+        ca_assert(!m->pcm);
+
+        if ((ret = snd_pcm_open(&m->pcm, m->device, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_any(m->pcm, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_access(m->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_format(m->pcm, hwparams, sample_type_table[CA_SAMPLE_S16NE])) < 0)
+                goto finish;
+
+        rate = m->rate;
+        if ((ret = snd_pcm_hw_params_set_rate_near(m->pcm, hwparams, &rate, 0)) < 0)
+                goto finish;
+
+        /* We don't resample, so every voice would play at the wrong
+         * speed */
+        if (rate != m->rate) {
+                snd_pcm_close(m->pcm);
+                m->pcm = NULL;
+                return CA_ERROR_NOTSUPPORTED;
+        }
+
+        if ((ret = snd_pcm_hw_params_set_channels(m->pcm, hwparams, m->nchannels)) < 0)
+                goto finish;
+
+        usec = MIXER_BUFFER_USEC;
+        if ((ret = snd_pcm_hw_params_set_buffer_time_near(m->pcm, hwparams, &usec, NULL)) < 0)
+                goto finish;
+
+        usec = MIXER_PERIOD_USEC;
+        if ((ret = snd_pcm_hw_params_set_period_time_near(m->pcm, hwparams, &usec, NULL)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params(m->pcm, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_get_period_size(hwparams, &m->period_size, NULL)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_prepare(m->pcm)) < 0)
+                goto finish;
+
+        ca_free(m->mix_buf);
+        ca_free(m->voice_buf);
+
+        n = (size_t) m->period_size * m->nchannels;
+        m->mix_buf = ca_new(int16_t, n);
+        m->voice_buf = ca_new(int16_t, n);
+
+        if (!m->mix_buf || !m->voice_buf) {
+                snd_pcm_close(m->pcm);
+                m->pcm = NULL;
+                return CA_ERROR_OOM;
+        }
+
+        return CA_SUCCESS;
+
+finish:
+
+        if (m->pcm) {
+                snd_pcm_close(m->pcm);
+                m->pcm = NULL;
+        }
+
+        return translate_error(ret);
+}
+
+/* Reads up to n frames of a voice, converted to S16NE. Fewer frames
+ * are returned only at the end of the sound. */
+static int voice_read(struct outstanding *out, int16_t *d, size_t n, size_t *frames) {
+        uint8_t *b = (uint8_t*) d;
+        size_t fs, want, got = 0, i, k;
+        int ret;
+
+        fs = ca_sound_file_frame_size(out->file);
+        want = n * fs;
+
+        while (got < want) {
+                k = want - got;
+
+                if ((ret = ca_sound_file_read_arbitrary(out->file, b + got, &k)) < 0)
+                        return ret;
+
+                if (k <= 0)
+                        break;
+
+                got += k;
+        }
+
+        *frames = got / fs;
+        k = *frames * ca_sound_file_get_nchannels(out->file);
+
+        switch (ca_sound_file_get_sample_type(out->file)) {
+
+        case CA_SAMPLE_U8:
+                /* Backwards, since we convert in place */
+                for (i = k; i > 0; i--)
+                        d[i-1] = (int16_t) (((int) b[i-1] - 128) * 256);
+                break;
+
+        case CA_SAMPLE_S16RE:
+                for (i = 0; i < k; i++)
+                        d[i] = (int16_t) (((uint16_t) d[i] << 8) | ((uint16_t) d[i] >> 8));
+                break;
+
+        default:
+                break;
+        }
+
+        return CA_SUCCESS;
+}
+
+/* d += s, saturating */
+static void mix_s16(int16_t *d, const int16_t *s, size_t n) {
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        for (; i + 8 <= n; i += 8)
+                _mm_storeu_si128((__m128i*) (d + i),
+                                 _mm_adds_epi16(_mm_loadu_si128((const __m128i*) (d + i)),
+                                                _mm_loadu_si128((const __m128i*) (s + i))));
+#elif defined(__ARM_NEON)
+        for (; i + 8 <= n; i += 8)
+                vst1q_s16(d + i, vqaddq_s16(vld1q_s16(d + i), vld1q_s16(s + i)));
+#endif
+
+        for (; i < n; i++) {
+                int32_t v = (int32_t) d[i] + (int32_t) s[i];
+                d[i] = (int16_t) CA_CLAMP(v, INT16_MIN, INT16_MAX);
+        }
+}
+
+/* Mixes one period of all voices into mix_buf, and gets rid of those
+ * that are over */
+static void mixer_mix(struct mixer *m) {
+        struct outstanding **i, *out;
+
+        memset(m->mix_buf, 0, (size_t) m->period_size * m->nchannels * sizeof(int16_t));
+
+        for (i = &m->voices; (out = *i); ) {
+                size_t frames = 0;
+                int ret = CA_SUCCESS;
+
+                if (!out->dead)
+                        ret = voice_read(out, m->voice_buf, m->period_size, &frames);
+
+                if (frames > 0)
+                        mix_s16(m->mix_buf, m->voice_buf, frames * m->nchannels);
+
+                if (!out->dead && ret == CA_SUCCESS && frames >= m->period_size) {
+                        i = &out->mix_next;
+                        continue;
+                }
+
+                *i = out->mix_next;
+                outstanding_done(m->private, out, ret);
+        }
+}
+
+static int mixer_write(struct mixer *m) {
+        int16_t *d = m->mix_buf;
+        snd_pcm_uframes_t left = m->period_size;
+        snd_pcm_sframes_t sframes;
+        int ret;
+
+        while (left > 0) {
+
+                if ((sframes = snd_pcm_writei(m->pcm, d, left)) < 0) {
+
+                        if ((ret = snd_pcm_recover(m->pcm, (int) sframes, 1)) < 0)
+                                return translate_error(ret);
+
+                        continue;
+                }
+
+                left -= (snd_pcm_uframes_t) sframes;
+                d += (size_t) sframes * m->nchannels;
+        }
+
+        return CA_SUCCESS;
+}
+
+static void mixer_wait(struct mixer *m) {
+        struct pollfd pfd;
+        char buf[64];
+        int r;
+
+        pfd.fd = m->pipe_fd[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        /* Keep the device open for a while, more sounds might follow */
+        if ((r = poll(&pfd, 1, m->pcm ? MIXER_IDLE_MSEC : -1)) == 0 && m->pcm) {
+                snd_pcm_close(m->pcm);
+                m->pcm = NULL;
+        }
+
+        if (r > 0)
+                while (read(m->pipe_fd[0], buf, sizeof(buf)) > 0)
+                        ;
+}
+
+static void* mixer_thread_func(void *userdata) {
+        struct mixer *m = userdata;
+        int ret;
+
+        for (;;) {
+                mixer_take_incoming(m);
+                mixer_update_realtime(m);
+
+                if (!m->voices) {
+                        if (__sync_fetch_and_add(&m->quit, 0))
+                                break;
+
+                        mixer_wait(m);
+                        continue;
+                }
+
+                if (!m->pcm)
+                        if ((ret = mixer_open_pcm(m)) < 0) {
+                                mixer_fail(m, ret);
+                                continue;
+                        }
+
+                mixer_mix(m);
+
+                if ((ret = mixer_write(m)) < 0) {
+                        snd_pcm_close(m->pcm);
+                        m->pcm = NULL;
+
+                        mixer_fail(m, ret);
+                        continue;
+                }
+
+                mixer_take_incoming(m);
+
+                if (!m->voices) {
+                        /* Let the rest play out, so that the next sound
+                         * starts on a clean device */
+                        snd_pcm_drain(m->pcm);
+                        snd_pcm_prepare(m->pcm);
+                }
+        }
+
+        return NULL;
+}
+
+/* Needs the outstanding mutex */
+static struct mixer *mixer_find(struct private *p, const char *device, unsigned rate, unsigned nchannels) {
+        struct mixer *m;
+
+        for (m = p->mixers; m; m = m->next)
+                if (ca_streq(m->device, device) && m->rate == rate && m->nchannels == nchannels)
+                        return m;
+
+        return NULL;
+}
+
+static void mixer_stop(struct mixer *m) {
+
+        if (!m->unusable) {
+                __sync_lock_test_and_set(&m->quit, TRUE);
+                mixer_wakeup(m);
+
+                pthread_join(m->thread, NULL);
+        }
+
+        mixer_free(m);
+}
+
+/* Opens the device right away, so that we know whether it does the
+ * rate before we queue any voice for the mixer */
+static int mixer_new(struct private *p, const char *device, unsigned rate, unsigned nchannels, struct mixer **_m) {
+        struct mixer *m;
+        int ret;
+
+        if (!(m = ca_new0(struct mixer, 1)))
+                return CA_ERROR_OOM;
+
+        m->private = p;
+        m->rate = rate;
+        m->nchannels = nchannels;
+        m->pipe_fd[0] = m->pipe_fd[1] = -1;
+
+        if (!(m->device = ca_strdup(device))) {
+                ret = CA_ERROR_OOM;
+                goto fail;
+        }
+
+        if ((ret = mixer_open_pcm(m)) == CA_ERROR_NOTSUPPORTED) {
+                m->unusable = TRUE;
+                *_m = m;
+                return CA_SUCCESS;
+        }
+
+        if (ret < 0)
+                goto fail;
+
+        if (pipe(m->pipe_fd) < 0 ||
+            fcntl(m->pipe_fd[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(m->pipe_fd[1], F_SETFL, O_NONBLOCK) < 0) {
+                ret = CA_ERROR_SYSTEM;
+                goto fail;
+        }
+
+        if (ca_player_pool_spawn(&m->thread, mixer_thread_func, m) < 0) {
+                ret = CA_ERROR_OOM;
+                goto fail;
+        }
+
+        *_m = m;
+        return CA_SUCCESS;
+
+fail:
+        mixer_free(m);
+        return ret;
+}
+
+static void mixers_stop(struct private *p) {
+        struct mixer *m;
+
+        while ((m = p->mixers)) {
+                CA_LLIST_REMOVE(struct mixer, p->mixers, m);
+                mixer_stop(m);
+        }
+}
+
+/* Returns CA_ERROR_NOTSUPPORTED if the sound has to be played
+ * directly */
+static int mixer_play(ca_context *c, struct outstanding *out) {
+        struct private *p;
+        struct mixer *m, *other;
+        const char *device;
+        unsigned rate, nchannels;
+        int ret;
+
+        p = PRIVATE(c);
+
+        device = c->device ? c->device : "default";
+        rate = ca_sound_file_get_rate(out->file);
+        nchannels = ca_sound_file_get_nchannels(out->file);
+
+        if (nchannels > 2)
+                return CA_ERROR_NOTSUPPORTED;
+
+        ca_mutex_lock(p->outstanding_mutex);
+        m = mixer_find(p, device, rate, nchannels);
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        if (!m) {
+                if ((ret = mixer_new(p, device, rate, nchannels, &m)) < 0)
+                        return ret;
+
+                ca_mutex_lock(p->outstanding_mutex);
+
+                /* Somebody else might have been quicker */
+                if ((other = mixer_find(p, device, rate, nchannels))) {
+                        ca_mutex_unlock(p->outstanding_mutex);
+                        mixer_stop(m);
+                        m = other;
+                } else {
+                        CA_LLIST_PREPEND(struct mixer, p->mixers, m);
+                        ca_mutex_unlock(p->outstanding_mutex);
+                }
+        }
+
+        if (m->unusable)
+                return CA_ERROR_NOTSUPPORTED;
+
+        ca_mutex_lock(p->outstanding_mutex);
+        CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        ca_id_table_put(&p->outstanding_by_id, &out->by_id, out->id);
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        mixer_push(m, out);
+
+        return CA_SUCCESS;
+}
+
+static int prepare_play(ca_context *c, struct outstanding **_out, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+        struct outstanding *out;
+        int ret;
+
+        if (!(out = ca_new0(struct outstanding, 1)))
+                return CA_ERROR_OOM;
+
+        out->context = c;
+        out->id = id;
+        out->callback = cb;
+        out->userdata = userdata;
+
+        if ((ret = ca_get_latency(c, proplist, &out->latency)) < 0)
+                goto fail;
+
+        if ((ret = ca_get_realtime(c, proplist, &out->realtime)) < 0)
+                goto fail;
+
+        if (!(out->device = ca_strdup(c->device ? c->device : "default"))) {
+                ret = CA_ERROR_OOM;
+                goto fail;
+        }
+
+        *_out = out;
+        return CA_SUCCESS;
+
+fail:
+        outstanding_free(out);
+        return ret;
+}
+
+static int lookup_play(ca_context *c, struct outstanding *out, ca_proplist *proplist) {
+        struct private *p;
+        int ret;
+
+        p = PRIVATE(c);
+
+        if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
+                return ret;
+
+        out->format = sample_type_table[ca_sound_file_get_sample_type(out->file)];
+        out->rate = ca_sound_file_get_rate(out->file);
+        out->nchannels = ca_sound_file_get_nchannels(out->file);
+
+        ca_mutex_lock(p->outstanding_mutex);
+        p->have_guess = TRUE;
+        p->guess_format = out->format;
+        p->guess_rate = out->rate;
+        p->guess_nchannels = out->nchannels;
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        return CA_SUCCESS;
+}
+
+struct open_job {
+        ca_player_job job;
+        ca_context *context;
+        struct outstanding *out;
+        ca_bool_t queued;
+        int ret;
+};
+
+static void open_job_run(ca_player_job *job) {
+        struct open_job *j = CA_PLAYER_JOB_ENTRY(job, struct open_job, job);
+
+        j->ret = open_alsa(j->context, j->out);
+}
+
+static void speculate_job_run(ca_player_job *job) {
+        struct open_job *j = CA_PLAYER_JOB_ENTRY(job, struct open_job, job);
+
+        if ((j->ret = open_alsa(j->context, j->out)) == CA_SUCCESS)
+                pcm_cache_put(PRIVATE(j->context), j->out);
+}
+
+/* Sounds of a theme usually all come in the same format, hence while
+ * we look up a sound we can already open the device in the format of
+ * the previous one. The PCM ends up in the cache, where open_alsa()
+ * will pick it up if we guessed right. */
+static void speculate_start(ca_context *c, struct outstanding *out, struct open_job *j) {
+        struct private *p;
+        struct outstanding *guess;
+        ca_bool_t needed;
+
+        p = PRIVATE(c);
+
+        if (!(guess = ca_new0(struct outstanding, 1)))
+                return;
+
+        guess->context = c;
+        guess->latency = out->latency;
+
+        if (!(guess->device = ca_strdup(out->device)))
+                goto fail;
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        /* No need to open anything if a PCM is waiting already. If it
+         * is in another format we don't open a second one either, the
+         * device might not allow that. */
+        if ((needed = p->have_guess && !pcm_cache_has_device(p, guess->device))) {
+                guess->format = p->guess_format;
+                guess->rate = p->guess_rate;
+                guess->nchannels = p->guess_nchannels;
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        if (!needed)
+                goto fail;
+
+        j->job.run = speculate_job_run;
+        j->context = c;
+        j->out = guess;
+
+        if (ca_player_pool_run(&j->job) < 0)
+                goto fail;
+
+        return;
+
+fail:
+        j->out = NULL;
+        outstanding_free(guess);
+}
+
+static void speculate_finish(struct open_job *j) {
+
+        if (!j->out)
+                return;
+
+        ca_player_pool_wait(&j->job);
+
+        outstanding_free(j->out);
+        j->out = NULL;
+}
+
+/* Unless we can take a PCM from the cache, opening and configuring
+ * the device takes a while, so we leave that to a helper of the pool
+ * and decode the beginning of the sound in the meantime */
+static int open_play(ca_context *c, struct outstanding *out) {
+        struct open_job j;
+        int ret;
+
+        if (pcm_cache_has(PRIVATE(c), out))
+                return open_alsa(c, out);
+
+        memset(&j, 0, sizeof(j));
+        j.job.run = open_job_run;
+        j.context = c;
+        j.out = out;
+
+        if (ca_player_pool_run(&j.job) < 0)
+                return open_alsa(c, out);
+
+        ret = predecode(out);
+
+        ca_player_pool_wait(&j.job);
+
+        return ret < 0 ? ret : j.ret;
+}
+
+static int start_play(ca_context *c, struct outstanding *out) {
+        struct private *p;
+        int ret;
+
+        p = PRIVATE(c);
+
+        out->fs = ca_sound_file_frame_size(out->file);
+
+        if (out->mmap)
+                out->data_size = 0;
+        else if (out->prefill) {
+                off_t size;
+
+                /* In power save mode the whole buffer is filled with a
+                 * single write, but there's no point in allocating more
+                 * than the sound needs */
+                out->data_size = (size_t) out->prefill * out->fs;
+
+                if ((size = ca_sound_file_get_size(out->file)) > 0 && (size_t) size < out->data_size)
+                        out->data_size = CA_MAX(((size_t) size / out->fs) * out->fs, out->fs);
+        } else
+                out->data_size = (BUFSIZE/out->fs)*out->fs;
+
+        out->read_size = out->data_size;
+
+        if (out->data_size > 0 && !(out->data = ca_malloc(out->data_size)))
+                return CA_ERROR_OOM;
+
+        if ((ret = snd_pcm_poll_descriptors_count(out->pcm)) < 0)
+                return translate_error(ret);
+
+        out->playback.n_pollfd = (unsigned) ret;
+        out->playback.realtime = out->realtime;
+        out->playback.prepare = playback_prepare;
+        out->playback.dispatch = playback_dispatch;
+        out->playback.finish = playback_finish;
+
+        /* OK, we're ready to go, so let's add this to our list */
+        ca_mutex_lock(p->outstanding_mutex);
+        CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        ca_id_table_put(&p->outstanding_by_id, &out->by_id, out->id);
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        if ((ret = ca_player_pool_add(&out->playback)) < 0) {
+                ca_mutex_lock(p->outstanding_mutex);
+                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
+                ca_mutex_unlock(p->outstanding_mutex);
+
+                return ret;
+        }
+
+        return CA_SUCCESS;
+}
+
+int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
+        struct outstanding *out = NULL;
+        struct open_job speculation;
+        int ret;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        memset(&speculation, 0, sizeof(speculation));
+
+        if ((ret = prepare_play(c, &out, id, proplist, cb, userdata)) < 0)
+                return ret;
+
+        if (PRIVATE(c)->mix) {
+                if ((ret = lookup_play(c, out, proplist)) < 0)
+                        goto finish;
+
+                /* Unless the device doesn't do the rate of the sound,
+                 * we are done */
+                if ((ret = mixer_play(c, out)) != CA_ERROR_NOTSUPPORTED)
+                        goto finish;
+
+        } else {
+                speculate_start(c, out, &speculation);
+
+                if ((ret = lookup_play(c, out, proplist)) < 0)
+                        goto finish;
+
+                /* If we guessed right the PCM is in the cache now. If
+                 * not, open_alsa() will close it again should it keep
+                 * the device busy */
+                speculate_finish(&speculation);
+        }
+
+        if ((ret = open_play(c, out)) < 0)
+                goto finish;
+
+        ret = start_play(c, out);
+
+finish:
+
+        speculate_finish(&speculation);
+
+        /* We keep the outstanding struct around if we need clean up later to */
+        if (ret != CA_SUCCESS)
+                outstanding_free(out);
+
+        return ret;
+}
+
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        struct open_job *jobs;
+        unsigned i, first = n;
+        int ret = CA_SUCCESS;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(r || n <= 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        if (n <= 0)
+                return CA_SUCCESS;
+
+        if (!(jobs = ca_new0(struct open_job, n)))
+                return ca_play_many_each(c, r, n, driver_play);
+
+        /* First look up and decode everything */
+        for (i = 0; i < n; i++) {
+                jobs[i].context = c;
+
+                if (r[i].error < 0)
+                        continue;
+
+                if ((r[i].error = prepare_play(c, &jobs[i].out, r[i].id, r[i].proplist, r[i].callback, r[i].userdata)) < 0)
+                        continue;
+
+                if ((r[i].error = lookup_play(c, jobs[i].out, r[i].proplist)) < 0) {
+                        outstanding_free(jobs[i].out);
+                        jobs[i].out = NULL;
+                        continue;
+                }
+
+                if (first >= n)
+                        first = i;
+        }
+
+        /* With the mixer there's no device to open */
+        if (PRIVATE(c)->mix)
+                first = n;
+
+        /* Opening and configuring a PCM can take a while, so let the
+         * helpers of the pool open devices while we open the first one
+         * on this thread. There are only a few helpers, whatever they
+         * didn't get to yet we open here as we wait for them. */
+        for (i = first + 1; i < n; i++) {
+                if (!jobs[i].out)
+                        continue;
+
+                jobs[i].job.run = open_job_run;
+
+                if (!(jobs[i].queued = ca_player_pool_run(&jobs[i].job) == CA_SUCCESS))
+                        jobs[i].ret = open_alsa(c, jobs[i].out);
+        }
+
+        if (first < n)
+                jobs[first].ret = open_alsa(c, jobs[first].out);
+
+        for (i = first + 1; i < n; i++)
+                if (jobs[i].queued)
+                        ca_player_pool_wait(&jobs[i].job);
+
+        for (i = 0; i < n; i++) {
+
+                if (jobs[i].out) {
+                        if (PRIVATE(c)->mix) {
+                                /* Played directly if the device doesn't
+                                 * do its rate */
+                                if ((r[i].error = mixer_play(c, jobs[i].out)) == CA_ERROR_NOTSUPPORTED &&
+                                    (r[i].error = open_alsa(c, jobs[i].out)) == CA_SUCCESS)
+                                        r[i].error = start_play(c, jobs[i].out);
+
+                        } else if ((r[i].error = jobs[i].ret) == CA_SUCCESS)
+                                r[i].error = start_play(c, jobs[i].out);
+
+                        if (r[i].error != CA_SUCCESS)
+                                outstanding_free(jobs[i].out);
+                }
+
+                if (ret == CA_SUCCESS && r[i].error < 0)
+                        ret = r[i].error;
+        }
+
+        ca_free(jobs);
+
+        return ret;
+}
+
+int driver_cancel(ca_context *c, uint32_t id) {
+        struct private *p;
+        struct outstanding *out;
+        ca_id_link *l;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
+
+                if (out->dead)
+                        continue;
+
+                out->dead = TRUE;
+
+                if (out->callback)
+                        out->callback(c, out->id, CA_ERROR_CANCELED, out->userdata);
+
+                /* This will cause the worker to drop the sound */
+                if (!p->mix)
+                        ca_player_pool_wakeup(&out->playback);
+        }
+
+        ca_mutex_unlock(p->outstanding_mutex);
+
+        return CA_SUCCESS;
+}
+
+int driver_playing(ca_context *c, uint32_t id, int *playing) {
+        struct private *p;
+        struct outstanding *out;
+        ca_id_link *l;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+        ca_return_val_if_fail(playing, CA_ERROR_INVALID);
+
+        p = PRIVATE(c);
+
+        *playing = 0;
+
+        ca_mutex_lock(p->outstanding_mutex);
+
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
+
+                if (out->dead)
                         continue;
 
                 *playing = 1;
@@ -0,0 +1,616 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "canberra.h"
+#include "sound-theme-spec.h"
+
+/* Times the hot paths of libcanberra on whatever backend is selected
+ * with $CANBERRA_DRIVER. Sounds are canceled right after they were
+ * started, what is measured is how long it takes to start them. */
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+static int context_new(ca_context **c) {
+        int ret;
+
+        if ((ret = ca_context_create(c)) < 0) {
+                fprintf(stderr, "create: %s\n", ca_strerror(ret));
+                return ret;
+        }
+
+        ca_context_change_props(*c,
+                                CA_PROP_APPLICATION_NAME, "libcanberra benchmark",
+                                CA_PROP_APPLICATION_ID, "org.freedesktop.libcanberra.Benchmark",
+                                NULL);
+
+        if ((ret = ca_context_open(*c)) < 0) {
+                fprintf(stderr, "open: %s\n", ca_strerror(ret));
+                ca_context_destroy(*c);
+                return ret;
+        }
+
+        return ret;
+}
+
+/* Starting the same event sound again and again, once described from
+ * scratch with ca_context_play(), once prepared with ca_event_new() */
+static int bench_event(unsigned n, const char *event_id) {
+        ca_context *c;
+        ca_proplist *p;
+        ca_event *e;
+        uint64_t t, play = 0, event = 0;
+        unsigned i;
+        int ret;
+
+        if ((ret = context_new(&c)) < 0)
+                return ret;
+
+        for (i = 0; i < n; i++) {
+                t = now_usec();
+                ret = ca_context_play(c, 1, CA_PROP_EVENT_ID, event_id, NULL);
+                play += now_usec() - t;
+
+                if (ret < 0) {
+                        fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                        goto finish;
+                }
+
+                ca_context_cancel(c, 1);
+        }
+
+        ca_proplist_create(&p);
+        ca_proplist_sets(p, CA_PROP_EVENT_ID, event_id);
+        ret = ca_event_new(&e, c, p);
+        ca_proplist_destroy(p);
+
+        if (ret < 0) {
+                fprintf(stderr, "event_new: %s\n", ca_strerror(ret));
+                goto finish;
+        }
+
+        for (i = 0; i < n; i++) {
+                t = now_usec();
+                ret = ca_event_play(e, 1, NULL, NULL);
+                event += now_usec() - t;
+
+                if (ret < 0) {
+                        fprintf(stderr, "event_play: %s\n", ca_strerror(ret));
+                        break;
+                }
+
+                ca_context_cancel(c, 1);
+        }
+
+        ca_event_destroy(e);
+
+        if (ret >= 0) {
+                printf("ca_context_play(): %8.1f usec per sound\n", (double) play / n);
+                printf("ca_event_play():   %8.1f usec per sound\n", (double) event / n);
+        }
+
+finish:
+        ca_context_destroy(c);
+
+        return ret;
+}
+
+struct play_thread {
+        pthread_t thread;
+        ca_context *context;
+        uint32_t id;
+        unsigned n;
+        const char *event_id;
+        int ret;
+};
+
+static void* play_thread_func(void *userdata) {
+        struct play_thread *p = userdata;
+        unsigned i;
+
+        p->ret = CA_SUCCESS;
+
+        for (i = 0; i < p->n; i++) {
+                if ((p->ret = ca_context_play(p->context, p->id, CA_PROP_EVENT_ID, p->event_id, NULL)) < 0)
+                        break;
+
+                ca_context_cancel(p->context, p->id);
+        }
+
+        return NULL;
+}
+
+/* Starts the same event sound from more and more threads at once on
+ * a single context, each thread with its own id */
+static int bench_threads(unsigned n, const char *event_id) {
+        struct play_thread p[8];
+        ca_context *c;
+        unsigned i, k;
+        uint64_t t;
+        int ret;
+
+        if ((ret = context_new(&c)) < 0)
+                return ret;
+
+        /* The first one looks the sound up */
+        if ((ret = ca_context_play(c, 0, CA_PROP_EVENT_ID, event_id, NULL)) < 0) {
+                fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                goto finish;
+        }
+
+        ca_context_cancel(c, 0);
+
+        for (k = 1; k <= sizeof(p)/sizeof(p[0]); k *= 2) {
+
+                t = now_usec();
+
+                for (i = 0; i < k; i++) {
+                        p[i].context = c;
+                        p[i].id = i + 1;
+                        p[i].n = n;
+                        p[i].event_id = event_id;
+
+                        if (pthread_create(&p[i].thread, NULL, play_thread_func, &p[i]) != 0) {
+                                fprintf(stderr, "Failed to create thread\n");
+                                k = i;
+                                ret = CA_ERROR_OOM;
+                                break;
+                        }
+                }
+
+                for (i = 0; i < k; i++) {
+                        pthread_join(p[i].thread, NULL);
+
+                        if (ret >= 0 && p[i].ret < 0)
+                                ret = p[i].ret;
+                }
+
+                t = now_usec() - t;
+
+                if (ret < 0) {
+                        fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                        break;
+                }
+
+                printf("%u threads: %10.1f sounds per msec\n", k, (double) n * k * 1000 / (double) t);
+        }
+
+finish:
+        ca_context_destroy(c);
+
+        return ret;
+}
+
+static pthread_mutex_t finish_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
+static int finished = 0, finish_error = 0;
+
+static void finish_cb(ca_context *c, uint32_t id, int error, void *userdata) {
+        pthread_mutex_lock(&finish_mutex);
+        finished = 1;
+        finish_error = error;
+        pthread_cond_signal(&finish_cond);
+        pthread_mutex_unlock(&finish_mutex);
+}
+
+/* Plays the sound and waits until it is over */
+static int play_wait(ca_context *c, ca_proplist *p, uint64_t *usec) {
+        uint64_t t;
+        int ret;
+
+        finished = 0;
+
+        t = now_usec();
+
+        if ((ret = ca_context_play_full(c, 1, p, finish_cb, NULL)) < 0)
+                return ret;
+
+        pthread_mutex_lock(&finish_mutex);
+        while (!finished)
+                pthread_cond_wait(&finish_cond, &finish_mutex);
+        ret = finish_error;
+        pthread_mutex_unlock(&finish_mutex);
+
+        *usec = now_usec() - t;
+
+        return ret;
+}
+
+static const char * const latencies[] = { "low", "default", "powersave" };
+
+static void sound_proplist(ca_proplist **p, const char *sound) {
+        ca_proplist_create(p);
+
+        /* Anything that looks like a path is played as a file */
+        if (strchr(sound, '/'))
+                ca_proplist_sets(*p, CA_PROP_MEDIA_FILENAME, sound);
+        else
+                ca_proplist_sets(*p, CA_PROP_EVENT_ID, sound);
+}
+
+/* Plays the same sound with every latency setting and measures how
+ * long it takes until it is over. The sound is just as long each
+ * time, so the differences are due to buffering. */
+static int bench_latency(unsigned n, const char *sound) {
+        ca_context *c;
+        ca_proplist *p;
+        uint64_t t, sum, min;
+        unsigned i, k;
+        int ret = CA_SUCCESS;
+
+        sound_proplist(&p, sound);
+
+        for (k = 0; k < sizeof(latencies)/sizeof(latencies[0]); k++) {
+
+                if ((ret = context_new(&c)) < 0)
+                        break;
+
+                ca_context_change_props(c, CA_PROP_CANBERRA_LATENCY, latencies[k], NULL);
+
+                /* The first time the sound is looked up and the device
+                 * opened, which is not what we are after */
+                if ((ret = play_wait(c, p, &t)) < 0) {
+                        fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                        ca_context_destroy(c);
+                        break;
+                }
+
+                sum = 0;
+                min = (uint64_t) -1;
+
+                for (i = 0; i < n; i++) {
+                        if ((ret = play_wait(c, p, &t)) < 0) {
+                                fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                                break;
+                        }
+
+                        sum += t;
+
+                        if (t < min)
+                                min = t;
+                }
+
+                ca_context_destroy(c);
+
+                if (ret < 0)
+                        break;
+
+                printf("%-10s %10.1f usec until finished, %10.1f at least\n",
+                       latencies[k], (double) sum / n, (double) min);
+        }
+
+        ca_proplist_destroy(p);
+
+        return ret;
+}
+
+static long context_switches(void) {
+        struct rusage ru;
+
+        if (getrusage(RUSAGE_SELF, &ru) < 0)
+                return 0;
+
+        return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/* Plays the same sound with every latency setting and counts how
+ * often the threads of this process went to sleep and were woken up
+ * again while it played. Waiting for the sound to finish accounts for
+ * one of these per sound. */
+static int bench_wakeups(unsigned n, const char *sound) {
+        ca_context *c;
+        ca_proplist *p;
+        uint64_t t, sum;
+        long switches;
+        unsigned i, k;
+        int ret = CA_SUCCESS;
+
+        sound_proplist(&p, sound);
+
+        for (k = 0; k < sizeof(latencies)/sizeof(latencies[0]); k++) {
+
+                if ((ret = context_new(&c)) < 0)
+                        break;
+
+                ca_context_change_props(c, CA_PROP_CANBERRA_LATENCY, latencies[k], NULL);
+
+                /* Leave the lookup and the device open out */
+                if ((ret = play_wait(c, p, &t)) < 0) {
+                        fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                        ca_context_destroy(c);
+                        break;
+                }
+
+                sum = 0;
+                switches = context_switches();
+
+                for (i = 0; i < n; i++) {
+                        if ((ret = play_wait(c, p, &t)) < 0) {
+                                fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                                break;
+                        }
+
+                        sum += t;
+                }
+
+                switches = context_switches() - switches;
+
+                ca_context_destroy(c);
+
+                if (ret < 0)
+                        break;
+
+                printf("%-10s %10.1f wakeups per sound, %10.1f per second\n",
+                       latencies[k], (double) switches / n, sum > 0 ? (double) switches * 1000000 / (double) sum : 0.0);
+        }
+
+        ca_proplist_destroy(p);
+
+        return ret;
+}
+
+/* Creates, opens and destroys a context again and again, as short
+ * lived users like canberra-boot do. The second context stays open
+ * meanwhile, the way another part of the same program would keep
+ * one. */
+static int bench_open(unsigned n, const char *sound) {
+        ca_context *c, *other = NULL;
+        ca_proplist *p;
+        uint64_t t, sum, min;
+        unsigned i, k;
+        int ret = CA_SUCCESS;
+
+        sound_proplist(&p, sound);
+
+        for (k = 0; k < 2; k++) {
+
+                if (k > 0 && (ret = context_new(&other)) < 0)
+                        break;
+
+                sum = 0;
+                min = (uint64_t) -1;
+
+                for (i = 0; i < n; i++) {
+                        t = now_usec();
+
+                        if ((ret = context_new(&c)) < 0)
+                                break;
+
+                        /* Opening the device is what the backends
+                         * put off as long as possible */
+                        ret = ca_context_play_full(c, 1, p, NULL, NULL);
+                        ca_context_destroy(c);
+
+                        t = now_usec() - t;
+
+                        if (ret < 0) {
+                                fprintf(stderr, "play: %s\n", ca_strerror(ret));
+                                break;
+                        }
+
+                        sum += t;
+
+                        if (t < min)
+                                min = t;
+                }
+
+                if (ret < 0)
+                        break;
+
+                printf("%-10s %10.1f usec per context, %10.1f at least\n",
+                       k > 0 ? "one open" : "alone", (double) sum / n, (double) min);
+        }
+
+        if (other)
+                ca_context_destroy(other);
+
+        ca_proplist_destroy(p);
+
+        return ret;
+}
+
+static int dummy;
+
+/* We only care about the lookup, not about reading the file */
+static int sfopen_exists(ca_sound_file **f, const char *fn) {
+
+        if (access(fn, R_OK) < 0)
+                return CA_ERROR_NOTFOUND;
+
+        *f = (ca_sound_file*) &dummy;
+        return CA_SUCCESS;
+}
+
+struct lookup_thread {
+        pthread_t thread;
+        unsigned n;
+        const char *event_id;
+        int ret;
+};
+
+static void* lookup_thread_func(void *userdata) {
+        struct lookup_thread *l = userdata;
+        ca_proplist *cp, *sp;
+        ca_theme_data *t = NULL;
+        ca_sound_file *f;
+        unsigned i;
+
+        ca_proplist_create(&cp);
+        ca_proplist_create(&sp);
+        ca_proplist_sets(sp, CA_PROP_EVENT_ID, l->event_id);
+
+        l->ret = CA_SUCCESS;
+
+        for (i = 0; i < l->n; i++) {
+                int ret;
+
+                /* A sound that isn't there is cached as well */
+                if ((ret = ca_lookup_sound_with_callback(&f, sfopen_exists, NULL, &t, cp, sp)) < 0 && ret != CA_ERROR_NOTFOUND) {
+                        l->ret = ret;
+                        break;
+                }
+        }
+
+        if (t)
+                ca_theme_data_free(t);
+
+        ca_proplist_destroy(cp);
+        ca_proplist_destroy(sp);
+
+        return NULL;
+}
+
+/* Looks up the same event sound from more and more threads at once,
+ * which is what goes on in the sound cache when several contexts play
+ * sounds at the same time */
+static int bench_cache(unsigned n, const char *event_id) {
+        struct lookup_thread l[8];
+        unsigned i, k;
+        uint64_t t;
+        int ret;
+
+        /* Get it into the cache first */
+        l[0].n = 1;
+        l[0].event_id = event_id;
+        lookup_thread_func(&l[0]);
+
+        if ((ret = l[0].ret) < 0) {
+                fprintf(stderr, "lookup: %s\n", ca_strerror(ret));
+                return ret;
+        }
+
+        for (k = 1; k <= sizeof(l)/sizeof(l[0]); k *= 2) {
+
+                t = now_usec();
+
+                for (i = 0; i < k; i++) {
+                        l[i].n = n;
+                        l[i].event_id = event_id;
+
+                        if (pthread_create(&l[i].thread, NULL, lookup_thread_func, &l[i]) != 0) {
+                                fprintf(stderr, "Failed to create thread\n");
+                                k = i;
+                                ret = CA_ERROR_OOM;
+                                break;
+                        }
+                }
+
+                for (i = 0; i < k; i++) {
+                        pthread_join(l[i].thread, NULL);
+
+                        if (ret >= 0 && l[i].ret < 0)
+                                ret = l[i].ret;
+                }
+
+                t = now_usec() - t;
+
+                if (ret < 0) {
+                        fprintf(stderr, "lookup: %s\n", ca_strerror(ret));
+                        return ret;
+                }
+
+                printf("%u threads: %10.1f lookups per msec\n", k, (double) n * k * 1000 / (double) t);
+        }
+
+        return CA_SUCCESS;
+}
+
+static void usage(const char *name) {
+        fprintf(stderr,
+                "Usage: %s event [N] [EVENT-ID]\n"
+                "       %s latency [N] [EVENT-ID|FILE]\n"
+                "       %s cache [N] [EVENT-ID]\n"
+                "       %s threads [N] [EVENT-ID]\n"
+                "       %s wakeups [N] [EVENT-ID|FILE]\n"
+                "       %s open [N] [EVENT-ID|FILE]\n"
+                "\n"
+                "  event     Start an event sound N times with ca_context_play()\n"
+                "            and as prepared ca_event\n"
+                "  latency   Play a sound N times with every canberra.latency\n"
+                "            setting and wait for each to finish\n"
+                "  cache     Look up an event sound N times from 1, 2, 4 and 8\n"
+                "            threads at once\n"
+                "  threads   Start an event sound N times from 1, 2, 4 and 8\n"
+                "            threads at once on the same context\n"
+                "  wakeups   Play a sound N times with every canberra.latency\n"
+                "            setting and count the context switches meanwhile\n"
+                "  open      Create a context, start a sound on it and\n"
+                "            destroy it again, N times, once alone and once\n"
+                "            while another context is open\n",
+                name, name, name, name, name, name);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 100;
+
+        setlocale(LC_ALL, "");
+
+        if (argc < 2) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (argc >= 3)
+                n = (unsigned) atoi(argv[2]);
+
+        if (n <= 0)
+                n = 1;
+
+        if (strcmp(argv[1], "event") == 0)
+                return bench_event(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        if (strcmp(argv[1], "latency") == 0)
+                return bench_latency(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        if (strcmp(argv[1], "cache") == 0)
+                return bench_cache(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        if (strcmp(argv[1], "threads") == 0)
+                return bench_threads(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        if (strcmp(argv[1], "wakeups") == 0)
+                return bench_wakeups(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        if (strcmp(argv[1], "open") == 0)
+                return bench_open(n, argc >= 4 ? argv[3] : "button-pressed") < 0;
+
+        usage(argv[0]);
+        return 1;
+}
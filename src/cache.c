@@ -32,17 +32,121 @@
 #include <pthread.h>
 #include <errno.h>
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #include <tdb.h>
 
 #include "malloc.h"
 #include "macro.h"
 #include "mutex.h"
+#include "llist.h"
 #include "canberra.h"
 #include "sound-theme-spec.h"
 #include "cache.h"
 
 #define FILENAME "event-sound-cache.tdb"
 #define UPDATE_INTERVAL 10
+#define MEM_HASH_SIZE 127
+#define MEM_ENTRIES_MAX 1024
+#define CACHE_VERSION 2
+#define CACHE_FLAG_INFO 1
+#define CACHE_SIZE_MAX_DEFAULT (256U*1024U)
+#define HIT_UPDATE_INTERVAL (24*60*60)
+#define MAINTENANCE_INTERVAL (60*60)
+#define REPACK_SLACK (64U*1024U)
+
+/* Keys and values of this size are handled on the stack during lookups,
+ * so that a cache hit doesn't allocate memory */
+#define KEY_BUF_SIZE 256
+#define VALUE_BUF_SIZE 1024
+
+/* Entries consist of a time stamp of when they were created, followed
+ * by a struct cache_header, optionally followed by a struct cache_info
+ * and for positive entries followed by the NUL terminated path.
+ * Entries written by older versions have no header and no cache_info,
+ * but since paths are always absolute the version byte tells them
+ * apart. Negative entries written by older versions consist of the
+ * time stamp only. */
+
+struct cache_header {
+        uint8_t version;
+        uint8_t flags;
+        uint8_t reserved[2];
+        uint32_t last_hit;
+};
+
+struct cache_info {
+        uint8_t container;
+        uint8_t sample_type;
+        uint8_t has_channel_map;
+        uint8_t reserved;
+        uint32_t nchannels;
+        uint32_t rate;
+        uint8_t channel_map[_CA_CHANNEL_POSITION_MAX];
+        int64_t data_offset;
+        int64_t data_size;
+        int64_t file_size;
+        int64_t file_mtime;
+};
+
+struct cache_value {
+        uint32_t timestamp;
+        uint32_t last_hit;
+        const char *path;
+        ca_bool_t have_info;
+        ca_sound_file_info info;
+};
+
+/* Used while looking for entries to evict */
+struct usage {
+        CA_LLIST_FIELDS(struct usage);
+        void *key;
+        size_t klen;
+        size_t size;
+        uint32_t last_hit;
+};
+
+struct usage_list {
+        CA_LLIST_HEAD(struct usage, items);
+        unsigned n;
+        size_t total;
+        ca_bool_t oom;
+};
+
+/* Cache updates are not written to the database from the thread that
+ * triggered them. Instead they are queued up and written by a
+ * background thread, so that ca_context_play() never has to wait for
+ * the database locks. Updates for the same key that are queued are
+ * coalesced. A NULL data pointer in a queue entry means "remove". */
+
+struct pending {
+        CA_LLIST_FIELDS(struct pending);
+        void *key;
+        size_t klen;
+        void *data;
+        size_t dlen;
+};
+
+/* A tdb handle may not be used from more than one thread at a time,
+ * and tdb refuses to open the same file twice in one process, so we
+ * cannot hand out per-thread handles. Instead the entries we have
+ * seen are kept in an in-memory table that is protected by a
+ * reader/writer lock, so that concurrent lookups of hot entries never
+ * serialize on the database mutex. The table always reflects the
+ * latest queued update for the keys it contains. Once it is full, new
+ * entries replace old ones more or less at random, since keeping
+ * track of which entries were used would need the write lock on every
+ * hit. */
+
+struct mem_entry {
+        struct mem_entry *next;
+        void *key;
+        size_t klen;
+        void *data;
+        size_t dlen;
+};
 
 /* This part is not portable due to pthread_once usage, should be abstracted
  * when we port this to platforms that do not have POSIX threading */
@@ -50,8 +154,49 @@
 static ca_mutex *mutex = NULL;
 static struct tdb_context *database = NULL;
 
+/* Protects the in-memory table */
+static ca_rwlock *mem_lock = NULL;
+static struct mem_entry *mem_table[MEM_HASH_SIZE];
+static unsigned mem_n_entries = 0;
+static unsigned mem_generation = 0;
+static unsigned mem_hand = 0;
+
+/* Serializes refreshes of the sound dir modification time */
+static ca_mutex *change_mutex = NULL;
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Whether the watch thread runs */
+static volatile ca_bool_t watching = FALSE;
+#endif
+
+/* Protects the write queue; never held while accessing the database */
+static ca_mutex *queue_mutex = NULL;
+static ca_cond *queue_cond = NULL;
+static CA_LLIST_HEAD(struct pending, queue) = NULL;
+static CA_LLIST_HEAD(struct pending, flushing) = NULL;
+static ca_bool_t writer_running = FALSE;
+static ca_bool_t writer_quit = FALSE;
+static pthread_t writer_thread;
+static ca_bool_t maintenance_pending = FALSE;
+static time_t last_maintenance = 0;
+
+static void atfork_prepare(void);
+static void atfork_parent(void);
+static void atfork_child(void);
+
 static void allocate_mutex_once(void) {
         mutex = ca_mutex_new();
+        queue_mutex = ca_mutex_new();
+        queue_cond = ca_cond_new();
+        mem_lock = ca_rwlock_new();
+        change_mutex = ca_mutex_new();
+
+        if (!mutex || !queue_mutex || !queue_cond || !mem_lock || !change_mutex)
+                return;
+
+        /* If this fails a forked child might find our locks taken or
+         * wait for a writer thread that doesn't exist */
+        pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
 }
 
 static int allocate_mutex(void) {
@@ -60,7 +205,7 @@ static int allocate_mutex(void) {
         if (pthread_once(&once, allocate_mutex_once) != 0)
                 return CA_ERROR_OOM;
 
-        if (!mutex)
+        if (!mutex || !queue_mutex || !queue_cond || !mem_lock || !change_mutex)
                 return CA_ERROR_OOM;
 
         return 0;
@@ -159,9 +304,12 @@ static int get_machine_id(char **id) {
         return CA_SUCCESS;
 }
 
+static void schedule_maintenance(void);
+
 static int db_open(void) {
         int ret;
         char *c, *id, *pn;
+        ca_bool_t opened = FALSE;
 
         if ((ret = allocate_mutex()) < 0)
                 return ret;
@@ -218,14 +366,191 @@ static int db_open(void) {
                 goto finish;
         }
 
+        opened = TRUE;
         ret = CA_SUCCESS;
 
 finish:
         ca_mutex_unlock(mutex);
 
+        /* The file might have grown big in previous runs, so check it
+         * right away in the background */
+        if (opened)
+                schedule_maintenance();
+
+        return ret;
+}
+
+static unsigned mem_hash(const void *key, size_t klen) {
+        unsigned hash = 0;
+        const uint8_t *k;
+
+        for (k = key; klen > 0; k++, klen--)
+                hash = 31 * hash + *k;
+
+        return hash % MEM_HASH_SIZE;
+}
+
+static void mem_entry_free(struct mem_entry *e) {
+        ca_assert(e);
+
+        ca_free(e->key);
+        ca_free(e->data);
+        ca_free(e);
+}
+
+static struct mem_entry **mem_find_unlocked(const void *key, size_t klen) {
+        struct mem_entry **e;
+
+        for (e = &mem_table[mem_hash(key, klen)]; *e; e = &(*e)->next)
+                if ((*e)->klen == klen && memcmp((*e)->key, key, klen) == 0)
+                        return e;
+
+        return NULL;
+}
+
+/* Copies a value into the buffer supplied by the caller if it fits
+ * there, into newly allocated memory otherwise */
+static int copy_value(const void *src, size_t l, void *buf, size_t bufsize, void **data, size_t *dlen) {
+
+        if (l <= bufsize) {
+                memcpy(buf, src, l);
+                *data = buf;
+        } else if (!(*data = ca_memdup(src, l)))
+                return CA_ERROR_OOM;
+
+        *dlen = l;
+        return CA_SUCCESS;
+}
+
+/* Returns a copy of the entry for the key, and the table generation
+ * the lookup was made at in any case */
+static int mem_lookup(const void *key, size_t klen, void *buf, size_t bufsize, void **data, size_t *dlen, unsigned *generation) {
+        struct mem_entry **e;
+        int ret;
+
+        ca_return_val_if_fail(key, CA_ERROR_INVALID);
+        ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(data, CA_ERROR_INVALID);
+        ca_return_val_if_fail(dlen, CA_ERROR_INVALID);
+        ca_return_val_if_fail(generation, CA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        ca_rwlock_rdlock(mem_lock);
+
+        *generation = mem_generation;
+
+        if (!(e = mem_find_unlocked(key, klen)))
+                ret = CA_ERROR_NOTFOUND;
+        else
+                ret = copy_value((*e)->data, (*e)->dlen, buf, bufsize, data, dlen);
+
+        ca_rwlock_unlock(mem_lock);
+
         return ret;
 }
 
+/* Makes room by dropping the oldest entry of the next bucket that has
+ * one */
+static void mem_evict_unlocked(void) {
+        struct mem_entry **e, *n;
+        unsigned i;
+
+        for (i = 0; i < MEM_HASH_SIZE; i++) {
+                e = &mem_table[mem_hand];
+                mem_hand = (mem_hand + 1) % MEM_HASH_SIZE;
+
+                if (!*e)
+                        continue;
+
+                /* New entries are added at the front */
+                while ((*e)->next)
+                        e = &(*e)->next;
+
+                n = *e;
+                *e = NULL;
+                mem_entry_free(n);
+                mem_n_entries--;
+                return;
+        }
+}
+
+static void mem_put_unlocked(const void *key, size_t klen, const void *data, size_t dlen) {
+        struct mem_entry **e, *n;
+        void *d;
+
+        if ((e = mem_find_unlocked(key, klen))) {
+
+                if (!data) {
+                        n = *e;
+                        *e = n->next;
+                        mem_entry_free(n);
+                        mem_n_entries--;
+                        return;
+                }
+
+                /* On OOM we drop the entry, so that we never return
+                 * stale data for it */
+                if (!(d = ca_memdup(data, dlen))) {
+                        n = *e;
+                        *e = n->next;
+                        mem_entry_free(n);
+                        mem_n_entries--;
+                        return;
+                }
+
+                ca_free((*e)->data);
+                (*e)->data = d;
+                (*e)->dlen = dlen;
+                return;
+        }
+
+        if (!data)
+                return;
+
+        if (mem_n_entries >= MEM_ENTRIES_MAX)
+                mem_evict_unlocked();
+
+        if (!(n = ca_new0(struct mem_entry, 1)))
+                return;
+
+        if (!(n->key = ca_memdup(key, klen)) ||
+            !(n->data = ca_memdup(data, dlen))) {
+                mem_entry_free(n);
+                return;
+        }
+
+        n->klen = klen;
+        n->dlen = dlen;
+
+        e = &mem_table[mem_hash(key, klen)];
+        n->next = *e;
+        *e = n;
+        mem_n_entries++;
+}
+
+/* Called for every update we queue. A NULL data pointer removes the
+ * entry. */
+static void mem_update(const void *key, size_t klen, const void *data, size_t dlen) {
+
+        ca_rwlock_wrlock(mem_lock);
+        mem_generation++;
+        mem_put_unlocked(key, klen, data, dlen);
+        ca_rwlock_unlock(mem_lock);
+}
+
+/* Called with data read from the database. This is only put in the
+ * table if no update happened since the lookup in the table failed,
+ * since the data might otherwise be outdated. */
+static void mem_fill(const void *key, size_t klen, const void *data, size_t dlen, unsigned generation) {
+
+        ca_rwlock_wrlock(mem_lock);
+        if (mem_generation == generation && !mem_find_unlocked(key, klen))
+                mem_put_unlocked(key, klen, data, dlen);
+        ca_rwlock_unlock(mem_lock);
+}
+
 #ifdef CA_GCC_DESTRUCTOR
 
 static void db_close(void) CA_GCC_DESTRUCTOR;
@@ -236,11 +561,63 @@ static void db_close(void) {
         if (!getenv("VALGRIND"))
                 return;
 
+        /* The writer uses everything below, so let it write out what
+         * is queued and wait until it is gone */
+        if (queue_mutex) {
+                ca_bool_t running;
+
+                ca_mutex_lock(queue_mutex);
+
+                if ((running = writer_running)) {
+                        writer_quit = TRUE;
+                        ca_cond_signal(queue_cond, FALSE);
+                }
+
+                ca_mutex_unlock(queue_mutex);
+
+                /* Only returns once the queue is empty */
+                if (running)
+                        pthread_join(writer_thread, NULL);
+
+                ca_cond_free(queue_cond);
+                queue_cond = NULL;
+
+                ca_mutex_free(queue_mutex);
+                queue_mutex = NULL;
+        }
+
         if (mutex) {
                 ca_mutex_free(mutex);
                 mutex = NULL;
         }
 
+#ifdef HAVE_SYS_INOTIFY_H
+        /* The watch thread doesn't exit, and takes this when it fails */
+        if (watching)
+                change_mutex = NULL;
+#endif
+
+        if (change_mutex) {
+                ca_mutex_free(change_mutex);
+                change_mutex = NULL;
+        }
+
+        if (mem_lock) {
+                unsigned i;
+
+                for (i = 0; i < MEM_HASH_SIZE; i++)
+                        while (mem_table[i]) {
+                                struct mem_entry *e = mem_table[i];
+                                mem_table[i] = e->next;
+                                mem_entry_free(e);
+                        }
+
+                mem_n_entries = 0;
+
+                ca_rwlock_free(mem_lock);
+                mem_lock = NULL;
+        }
+
         if (database) {
                 tdb_close(database);
                 database = NULL;
@@ -249,9 +626,28 @@ static void db_close(void) {
 
 #endif
 
-static int db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
+struct parse_data {
+        void *buf;
+        size_t bufsize;
+        void **data;
+        size_t *dlen;
         int ret;
-        TDB_DATA k, d;
+};
+
+static int parse_record(TDB_DATA k, TDB_DATA d, void *userdata) {
+        struct parse_data *p = userdata;
+
+        /* Called with the record still in tdb's own buffer, so that we
+         * can copy it straight to where the caller wants it */
+        p->ret = copy_value(d.dptr, d.dsize, p->buf, p->bufsize, p->data, p->dlen);
+
+        return 0;
+}
+
+static int db_lookup(const void *key, size_t klen, void *buf, size_t bufsize, void **data, size_t *dlen) {
+        int ret;
+        TDB_DATA k;
+        struct parse_data p;
 
         ca_return_val_if_fail(key, CA_ERROR_INVALID);
         ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
@@ -264,22 +660,20 @@ static int db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
         k.dptr = (void*) key;
         k.dsize = klen;
 
+        p.buf = buf;
+        p.bufsize = bufsize;
+        p.data = data;
+        p.dlen = dlen;
+        p.ret = CA_ERROR_NOTFOUND;
+
         ca_mutex_lock(mutex);
 
         ca_assert(database);
-        d = tdb_fetch(database, k);
-        if (!d.dptr) {
-                ret = CA_ERROR_NOTFOUND;
-                goto finish;
-        }
-
-        *data = d.dptr;
-        *dlen = d.dsize;
+        tdb_parse_record(database, k, parse_record, &p);
 
-finish:
         ca_mutex_unlock(mutex);
 
-        return ret;
+        return p.ret;
 }
 
 static int db_store(const void *key, size_t klen, const void *data, size_t dlen) {
@@ -344,11 +738,557 @@ finish:
         return ret;
 }
 
+static void info_to_cache(struct cache_info *ci, const ca_sound_file_info *i) {
+        unsigned c;
+
+        memset(ci, 0, sizeof(*ci));
+
+        ci->container = (uint8_t) i->container;
+        ci->sample_type = (uint8_t) i->type;
+        ci->nchannels = i->nchannels;
+        ci->rate = i->rate;
+
+        if (i->has_channel_map && i->nchannels <= _CA_CHANNEL_POSITION_MAX) {
+                ci->has_channel_map = 1;
+
+                for (c = 0; c < i->nchannels; c++)
+                        ci->channel_map[c] = (uint8_t) i->channel_map[c];
+        }
+
+        ci->data_offset = (int64_t) i->data_offset;
+        ci->data_size = (int64_t) i->data_size;
+        ci->file_size = (int64_t) i->file_size;
+        ci->file_mtime = (int64_t) i->file_mtime;
+}
+
+static int info_from_cache(ca_sound_file_info *i, const struct cache_info *ci) {
+        unsigned c;
+
+        if (ci->container <= CA_SOUND_FILE_CONTAINER_INVALID ||
+            ci->container >= _CA_SOUND_FILE_CONTAINER_MAX ||
+            ci->sample_type > CA_SAMPLE_U8 ||
+            ci->nchannels <= 0 ||
+            ci->rate <= 0 ||
+            (ci->has_channel_map && ci->nchannels > _CA_CHANNEL_POSITION_MAX))
+                return CA_ERROR_CORRUPT;
+
+        memset(i, 0, sizeof(*i));
+
+        i->container = (ca_sound_file_container_t) ci->container;
+        i->type = (ca_sample_type_t) ci->sample_type;
+        i->nchannels = ci->nchannels;
+        i->rate = ci->rate;
+
+        if (ci->has_channel_map) {
+                i->has_channel_map = 1;
+
+                for (c = 0; c < ci->nchannels; c++) {
+                        if (ci->channel_map[c] >= _CA_CHANNEL_POSITION_MAX)
+                                return CA_ERROR_CORRUPT;
+
+                        i->channel_map[c] = (ca_channel_position_t) ci->channel_map[c];
+                }
+        }
+
+        i->data_offset = (off_t) ci->data_offset;
+        i->data_size = (off_t) ci->data_size;
+        i->file_size = (off_t) ci->file_size;
+        i->file_mtime = (time_t) ci->file_mtime;
+
+        return CA_SUCCESS;
+}
+
+static int parse_value(struct cache_value *v, const void *data, size_t dlen) {
+        const char *p;
+        struct cache_header h;
+        struct cache_info ci;
+
+        if (dlen < sizeof(uint32_t))
+                return CA_ERROR_CORRUPT;
+
+        memset(v, 0, sizeof(*v));
+        memcpy(&v->timestamp, data, sizeof(uint32_t));
+        v->last_hit = v->timestamp;
+
+        p = (const char*) data + sizeof(uint32_t);
+        dlen -= sizeof(uint32_t);
+
+        /* Old style negative entry */
+        if (dlen == 0)
+                return CA_SUCCESS;
+
+        if (*p != '/') {
+
+                if (dlen < sizeof(h))
+                        return CA_ERROR_CORRUPT;
+
+                memcpy(&h, p, sizeof(h));
+                p += sizeof(h);
+                dlen -= sizeof(h);
+
+                if (h.version != CACHE_VERSION)
+                        return CA_ERROR_CORRUPT;
+
+                v->last_hit = h.last_hit;
+
+                if (dlen == 0)
+                        return h.flags & CACHE_FLAG_INFO ? CA_ERROR_CORRUPT : CA_SUCCESS;
+
+                if (h.flags & CACHE_FLAG_INFO) {
+
+                        if (dlen < sizeof(ci))
+                                return CA_ERROR_CORRUPT;
+
+                        memcpy(&ci, p, sizeof(ci));
+                        p += sizeof(ci);
+                        dlen -= sizeof(ci);
+
+                        if (info_from_cache(&v->info, &ci) < 0)
+                                return CA_ERROR_CORRUPT;
+
+                        v->have_info = TRUE;
+                }
+        }
+
+        if (dlen < 2 || *p != '/' || p[dlen-1] != 0)
+                return CA_ERROR_CORRUPT;
+
+        v->path = p;
+
+        return CA_SUCCESS;
+}
+
+static void *build_value(
+                uint32_t timestamp,
+                uint32_t last_hit,
+                const char *fname,
+                const ca_sound_file_info *info,
+                size_t *dlen) {
+
+        struct cache_header h;
+        struct cache_info ci;
+        char *data, *p;
+
+        *dlen = sizeof(uint32_t) + sizeof(h) + (info ? sizeof(ci) : 0) + (fname ? strlen(fname) + 1 : 0);
+
+        if (!(data = ca_malloc(*dlen)))
+                return NULL;
+
+        memcpy(data, &timestamp, sizeof(uint32_t));
+        p = data + sizeof(uint32_t);
+
+        memset(&h, 0, sizeof(h));
+        h.version = CACHE_VERSION;
+        h.flags = info ? CACHE_FLAG_INFO : 0;
+        h.last_hit = last_hit;
+        memcpy(p, &h, sizeof(h));
+        p += sizeof(h);
+
+        if (info) {
+                info_to_cache(&ci, info);
+                memcpy(p, &ci, sizeof(ci));
+                p += sizeof(ci);
+        }
+
+        if (fname)
+                strcpy(p, fname);
+
+        return data;
+}
+
+static void pending_free(struct pending *e) {
+        ca_assert(e);
+
+        ca_free(e->key);
+        ca_free(e->data);
+        ca_free(e);
+}
+
+static struct pending *queue_find(struct pending *l, const void *key, size_t klen) {
+        struct pending *e;
+
+        for (e = l; e; e = e->next)
+                if (e->klen == klen && memcmp(e->key, key, klen) == 0)
+                        return e;
+
+        return NULL;
+}
+
+static void flush_batch(struct pending *batch) {
+        struct pending *e;
+        ca_bool_t locked;
+
+        if (db_open() < 0)
+                return;
+
+        ca_mutex_lock(mutex);
+        ca_assert(database);
+
+        /* Take the database lock only once for the whole batch */
+        locked = tdb_lockall(database) >= 0;
+
+        for (e = batch; e; e = e->next) {
+                TDB_DATA k, d;
+
+                k.dptr = e->key;
+                k.dsize = e->klen;
+
+                if (e->data) {
+                        d.dptr = e->data;
+                        d.dsize = e->dlen;
+
+                        tdb_store(database, k, d, TDB_REPLACE);
+                } else
+                        tdb_delete(database, k);
+        }
+
+        if (locked)
+                tdb_unlockall(database);
+
+        ca_mutex_unlock(mutex);
+}
+
+/* The size budget for the database in bytes, 0 for no limit. */
+static size_t get_size_max(void) {
+        const char *e;
+        char *end;
+        unsigned long u;
+
+        if (!(e = getenv("CANBERRA_CACHE_SIZE_MAX")))
+                return CACHE_SIZE_MAX_DEFAULT;
+
+        errno = 0;
+        u = strtoul(e, &end, 10);
+
+        if (errno != 0 || end == e || *end)
+                return CACHE_SIZE_MAX_DEFAULT;
+
+        return (size_t) u;
+}
+
+static int collect_usage(TDB_DATA k, TDB_DATA d, void *userdata) {
+        struct usage_list *l = userdata;
+        struct usage *u;
+        struct cache_value v;
+
+        if (!(u = ca_new0(struct usage, 1)) ||
+            !(u->key = ca_memdup(k.dptr, k.dsize))) {
+                ca_free(u);
+                l->oom = TRUE;
+                return 0;
+        }
+
+        u->klen = k.dsize;
+        u->size = k.dsize + d.dsize;
+
+        /* Corrupt entries are the first to go */
+        u->last_hit = parse_value(&v, d.dptr, d.dsize) < 0 ? 0 : v.last_hit;
+
+        CA_LLIST_PREPEND(struct usage, l->items, u);
+        l->n++;
+        l->total += u->size;
+
+        return 0;
+}
+
+static int usage_compare(const void *a, const void *b) {
+        const struct usage *x = *(const struct usage* const*) a, *y = *(const struct usage* const*) b;
+
+        return x->last_hit < y->last_hit ? -1 : (x->last_hit > y->last_hit ? 1 : 0);
+}
+
+/* Evicts the least recently used entries if the database grew beyond
+ * its size budget and rewrites the file if it is mostly empty
+ * space. Runs in the writer thread. */
+static void db_maintain(void) {
+        struct usage_list l;
+        struct usage **sorted = NULL, *u;
+        size_t size_max, low;
+        unsigned i;
+        TDB_DATA k;
+        ca_bool_t locked;
+#ifdef HAVE_TDB_REPACK
+        struct stat st;
+#endif
+
+        if ((size_max = get_size_max()) <= 0)
+                return;
+
+        if (db_open() < 0)
+                return;
+
+        memset(&l, 0, sizeof(l));
+
+        /* We walk the database one record at a time instead of
+         * traversing it with the lock held, so that lookups only ever
+         * wait for a single record to be read. Entries that are
+         * changed in the meantime might be missed or seen twice, which
+         * is good enough for estimating the size. */
+        ca_mutex_lock(mutex);
+        ca_assert(database);
+        k = tdb_firstkey(database);
+        ca_mutex_unlock(mutex);
+
+        while (k.dptr) {
+                TDB_DATA next;
+
+                ca_mutex_lock(mutex);
+                tdb_parse_record(database, k, collect_usage, &l);
+                next = tdb_nextkey(database, k);
+                ca_mutex_unlock(mutex);
+
+                /* tdb allocates keys with malloc() */
+                free(k.dptr);
+                k = next;
+
+                if (l.oom) {
+                        free(k.dptr);
+                        goto finish;
+                }
+        }
+
+        ca_mutex_lock(mutex);
+
+        if (l.total > size_max) {
+
+                if (!(sorted = ca_new(struct usage*, l.n)))
+                        goto unlock;
+
+                for (i = 0, u = l.items; u; u = u->next)
+                        sorted[i++] = u;
+
+                qsort(sorted, l.n, sizeof(struct usage*), usage_compare);
+
+                /* Evict a bit more than needed so that we don't have
+                 * to do this again right away */
+                low = size_max - size_max/4;
+
+                /* Deleting is quick, so do it in one go */
+                locked = tdb_lockall(database) >= 0;
+
+                for (i = 0; i < l.n && (l.total > low || sorted[i]->last_hit == 0); i++) {
+
+                        k.dptr = sorted[i]->key;
+                        k.dsize = sorted[i]->klen;
+
+                        if (tdb_delete(database, k) >= 0) {
+                                l.total -= sorted[i]->size;
+
+                                /* Otherwise the budget would not bound
+                                 * what we keep in memory */
+                                mem_update(k.dptr, k.dsize, NULL, 0);
+                        }
+                }
+
+                if (locked)
+                        tdb_unlockall(database);
+        }
+
+#ifdef HAVE_TDB_REPACK
+        /* tdb never shrinks the file by itself, hence rewrite it if
+         * most of it is unused. This needs the database for itself
+         * for as long as it takes, but it is rarely necessary. */
+        if (fstat(tdb_fd(database), &st) >= 0 &&
+            (size_t) st.st_size > l.total*2 + REPACK_SLACK)
+                tdb_repack(database);
+#endif
+
+unlock:
+        ca_mutex_unlock(mutex);
+
+finish:
+        ca_free(sorted);
+
+        while ((u = l.items)) {
+                CA_LLIST_REMOVE(struct usage, l.items, u);
+                ca_free(u->key);
+                ca_free(u);
+        }
+}
+
+/* Only ever returns when asked to by db_close() */
+static void* writer_func(void *userdata) {
+
+        ca_mutex_lock(queue_mutex);
+
+        for (;;) {
+                time_t now;
+
+                while (!queue && !maintenance_pending && !writer_quit)
+                        ca_cond_wait(queue_cond, queue_mutex);
+
+                if (!queue && writer_quit)
+                        break;
+
+                if (queue) {
+                        /* Take the whole queue as one batch, but leave it
+                         * visible to lookups until it is on disk */
+                        ca_assert(!flushing);
+                        flushing = queue;
+                        queue = NULL;
+
+                        ca_mutex_unlock(queue_mutex);
+                        flush_batch(flushing);
+                        ca_mutex_lock(queue_mutex);
+
+                        while (flushing) {
+                                struct pending *e = flushing;
+                                CA_LLIST_REMOVE(struct pending, flushing, e);
+                                pending_free(e);
+                        }
+                }
+
+                /* The database only grows when we write to it, so
+                 * check whether it needs maintenance every now and
+                 * then after writing. */
+                ca_assert_se(time(&now) != (time_t) -1);
+
+                if (now >= last_maintenance + MAINTENANCE_INTERVAL || now < last_maintenance)
+                        maintenance_pending = TRUE;
+
+                if (maintenance_pending) {
+                        maintenance_pending = FALSE;
+                        last_maintenance = now;
+
+                        ca_mutex_unlock(queue_mutex);
+                        db_maintain();
+                        ca_mutex_lock(queue_mutex);
+                }
+        }
+
+        writer_running = FALSE;
+        ca_mutex_unlock(queue_mutex);
+
+        return NULL;
+}
+
+static int start_writer_unlocked(void) {
+
+        if (writer_running)
+                return CA_SUCCESS;
+
+        if (pthread_create(&writer_thread, NULL, writer_func, NULL) != 0)
+                return CA_ERROR_OOM;
+
+        writer_running = TRUE;
+        return CA_SUCCESS;
+}
+
+/* Asks the writer thread to check the database size as soon as
+ * possible */
+static void schedule_maintenance(void) {
+
+        ca_mutex_lock(queue_mutex);
+
+        if (start_writer_unlocked() >= 0) {
+                maintenance_pending = TRUE;
+                ca_cond_signal(queue_cond, FALSE);
+        }
+
+        ca_mutex_unlock(queue_mutex);
+}
+
+static int queue_update(const void *key, size_t klen, const void *data, size_t dlen) {
+        struct pending *e, *old;
+        int ret;
+
+        ca_return_val_if_fail(key, CA_ERROR_INVALID);
+        ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        if (!(e = ca_new0(struct pending, 1)))
+                return CA_ERROR_OOM;
+
+        if (!(e->key = ca_memdup(key, klen))) {
+                pending_free(e);
+                return CA_ERROR_OOM;
+        }
+
+        e->klen = klen;
+
+        if (data) {
+                if (!(e->data = ca_memdup(data, dlen))) {
+                        pending_free(e);
+                        return CA_ERROR_OOM;
+                }
+
+                e->dlen = dlen;
+        }
+
+        ca_mutex_lock(queue_mutex);
+
+        /* Updated while holding queue_mutex, so that the table and the
+         * queue see updates for the same key in the same order */
+        mem_update(key, klen, data, dlen);
+
+        if (start_writer_unlocked() < 0) {
+                ca_mutex_unlock(queue_mutex);
+
+                /* No thread, no queue. Write it synchronously then. */
+                ret = data ? db_store(key, klen, data, dlen) : db_remove(key, klen);
+                pending_free(e);
+                return ret;
+        }
+
+        /* Coalesce with an update for the same key that is still queued */
+        if ((old = queue_find(queue, key, klen))) {
+                CA_LLIST_REMOVE(struct pending, queue, old);
+                pending_free(old);
+        }
+
+        CA_LLIST_PREPEND(struct pending, queue, e);
+
+        ca_cond_signal(queue_cond, FALSE);
+        ca_mutex_unlock(queue_mutex);
+
+        return CA_SUCCESS;
+}
+
+/* Looks for an update that hasn't been written to disk yet. Sets
+ * *queued if one was found. If it is a removal CA_ERROR_NOTFOUND is
+ * returned. */
+static int queue_lookup(const void *key, size_t klen, void *buf, size_t bufsize, void **data, size_t *dlen, ca_bool_t *queued) {
+        struct pending *e;
+        int ret;
+
+        ca_return_val_if_fail(key, CA_ERROR_INVALID);
+        ca_return_val_if_fail(klen > 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(data, CA_ERROR_INVALID);
+        ca_return_val_if_fail(dlen, CA_ERROR_INVALID);
+        ca_return_val_if_fail(queued, CA_ERROR_INVALID);
+
+        *queued = FALSE;
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        ca_mutex_lock(queue_mutex);
+
+        if (!(e = queue_find(queue, key, klen)))
+                e = queue_find(flushing, key, klen);
+
+        if (!e)
+                ret = CA_SUCCESS;
+        else if (!e->data) {
+                *queued = TRUE;
+                ret = CA_ERROR_NOTFOUND;
+        } else if ((ret = copy_value(e->data, e->dlen, buf, bufsize, data, dlen)) >= 0)
+                *queued = TRUE;
+
+        ca_mutex_unlock(queue_mutex);
+
+        return ret;
+}
+
 static char *build_key(
                 const char *theme,
                 const char *name,
                 const char *locale,
                 const char *profile,
+                char *buf,
+                size_t bufsize,
                 size_t *klen) {
 
         char *key, *k;
@@ -360,7 +1300,10 @@ static char *build_key(
         pl = strlen(profile);
         *klen = tl+1+nl+1+ll+1+pl+1;
 
-        if (!(key = ca_new(char, *klen)))
+        /* Use the caller's buffer if the key fits in */
+        if (*klen <= bufsize)
+                key = buf;
+        else if (!(key = ca_new(char, *klen)))
                 return NULL;
 
         k = key;
@@ -375,33 +1318,256 @@ static char *build_key(
         return key;
 }
 
+static volatile time_t last_dir_change = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* Instead of stat()ing the sound directories every now and then we
+ * let the kernel tell us about changes to them, so that the lookup
+ * path doesn't need to do any syscalls at all. The parent
+ * directories are watched too, to notice when a sound directory
+ * shows up or goes away. */
+
+#define WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+#define WATCH_PARENT_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+struct watch {
+        CA_LLIST_FIELDS(struct watch);
+        int wd;
+        char *path;
+};
+
+static int watch_fd = -1;
+static CA_LLIST_HEAD(struct watch, watches) = NULL;
+
+static void watch_dir(const char *k) {
+        struct watch *w;
+        char *slash;
+
+        /* k is the sounds directory, we watch its parent for it being
+         * created or removed */
+        if (!(w = ca_new0(struct watch, 1)))
+                return;
+
+        if (!(w->path = ca_strdup(k))) {
+                ca_free(w);
+                return;
+        }
+
+        if ((slash = strrchr(w->path, '/')))
+                *slash = 0;
+
+        if ((w->wd = inotify_add_watch(watch_fd, *w->path ? w->path : "/", WATCH_PARENT_MASK)) < 0) {
+                ca_free(w->path);
+                ca_free(w);
+        } else
+                CA_LLIST_PREPEND(struct watch, watches, w);
+
+        inotify_add_watch(watch_fd, k, WATCH_MASK);
+}
+
+static void bump_last_change(void) {
+        time_t now;
+
+        ca_assert_se(time(&now) != (time_t) -1);
+
+        if (now > last_dir_change)
+                last_dir_change = now;
+}
+
+static void watches_free(void) {
+        struct watch *w;
+
+        while ((w = watches)) {
+                CA_LLIST_REMOVE(struct watch, watches, w);
+                ca_free(w->path);
+                ca_free(w);
+        }
+
+        close(watch_fd);
+        watch_fd = -1;
+}
+
+static void* watch_func(void *userdata) {
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+        pthread_detach(pthread_self());
+
+        for (;;) {
+                ssize_t l;
+                char *i;
+
+                if ((l = read(watch_fd, buf, sizeof(buf))) <= 0) {
+
+                        if (l < 0 && errno == EINTR)
+                                continue;
+
+                        break;
+                }
+
+                for (i = buf; i < buf + l; ) {
+                        struct inotify_event *e = (struct inotify_event*) i;
+                        struct watch *w;
+
+                        i += sizeof(struct inotify_event) + e->len;
+
+                        for (w = watches; w; w = w->next)
+                                if (w->wd == e->wd)
+                                        break;
+
+                        if (w) {
+                                char *k;
+
+                                /* Only the sound directory itself is of interest here */
+                                if (e->len <= 0 || !ca_streq(e->name, "sounds"))
+                                        continue;
+
+                                /* A new sound directory needs to be watched too */
+                                if ((k = ca_sprintf_malloc("%s/sounds", w->path))) {
+                                        inotify_add_watch(watch_fd, k, WATCH_MASK);
+                                        ca_free(k);
+                                }
+                        }
+
+                        bump_last_change();
+                }
+        }
+
+        /* Something went wrong, go back to polling */
+        ca_mutex_lock(change_mutex);
+        bump_last_change();
+        watching = FALSE;
+        watches_free();
+        ca_mutex_unlock(change_mutex);
+
+        return NULL;
+}
+
+#endif
+
+/* Takes all our locks, in the order they nest, so that the state they
+ * protect is consistent in a forked child. This might delay fork()
+ * until the writer thread is done with the batch it is writing. */
+static void atfork_prepare(void) {
+        ca_mutex_lock(change_mutex);
+        ca_mutex_lock(mutex);
+        ca_mutex_lock(queue_mutex);
+        ca_rwlock_wrlock(mem_lock);
+}
+
+static void atfork_parent(void) {
+        ca_rwlock_unlock(mem_lock);
+        ca_mutex_unlock(queue_mutex);
+        ca_mutex_unlock(mutex);
+        ca_mutex_unlock(change_mutex);
+}
+
+/* Only the thread that called fork() exists in the child, so we
+ * forget about the writer and watch threads. A new writer is started
+ * with the next update. */
+static void atfork_child(void) {
+        struct pending *e;
+
+        writer_running = FALSE;
+
+        /* The batch the writer took may or may not be on disk, so queue
+         * it again unless it has been superseded in the meantime */
+        while ((e = flushing)) {
+                CA_LLIST_REMOVE(struct pending, flushing, e);
+
+                if (queue_find(queue, e->key, e->klen))
+                        pending_free(e);
+                else
+                        CA_LLIST_PREPEND(struct pending, queue, e);
+        }
+
+#ifdef HAVE_SYS_INOTIFY_H
+        /* Go back to polling */
+        if (watching) {
+                watching = FALSE;
+                watches_free();
+        }
+#endif
+
+        /* Threads that waited for our locks in the parent might have
+         * left traces in them, hence we don't reuse them */
+        mutex = ca_mutex_new();
+        queue_mutex = ca_mutex_new();
+        queue_cond = ca_cond_new();
+        mem_lock = ca_rwlock_new();
+        change_mutex = ca_mutex_new();
+}
+
 static int get_last_change(time_t *t) {
         int ret;
         char *e, *k;
         struct stat st;
-        static time_t last_check = 0, last_change = 0;
-        time_t now;
+        static volatile time_t last_check = 0;
+        time_t now, c;
         const char *g;
+#ifdef HAVE_SYS_INOTIFY_H
+        static ca_bool_t watch_tried = FALSE;
+        ca_bool_t start_watch = FALSE;
+#endif
 
         ca_return_val_if_fail(t, CA_ERROR_INVALID);
 
+#ifdef HAVE_SYS_INOTIFY_H
+        /* The watch thread keeps last_dir_change up-to-date for us */
+        if (watching) {
+                *t = last_dir_change;
+                return CA_SUCCESS;
+        }
+#endif
+
+        ca_assert_se(time(&now) != (time_t) -1);
+
+        /* Fast path, without taking any lock. Ideally we'd use atomic
+         * operations here, but we don't have them. Reading a
+         * last_dir_change that is one refresh old is harmless however. */
+        if (last_check > 0 && now < last_check + UPDATE_INTERVAL) {
+                *t = last_dir_change;
+                return CA_SUCCESS;
+        }
+
         if ((ret = allocate_mutex()) < 0)
                 return ret;
 
-        ca_mutex_lock(mutex);
-
-        ca_assert_se(time(&now) != (time_t) -1);
+        if (last_check > 0) {
+                /* If somebody else is already refreshing the time stamp
+                 * we just use the old one */
+                if (!ca_mutex_try_lock(change_mutex)) {
+                        *t = last_dir_change;
+                        return CA_SUCCESS;
+                }
+        } else
+                ca_mutex_lock(change_mutex);
 
-        if (now < last_check + UPDATE_INTERVAL) {
-                *t = last_change;
+        if (last_check > 0 && now < last_check + UPDATE_INTERVAL) {
+                *t = last_dir_change;
                 ret = CA_SUCCESS;
                 goto finish;
         }
 
+#ifdef HAVE_SYS_INOTIFY_H
+        /* We set up the watches before we stat() the directories
+         * so that we cannot miss any change in between. */
+        if (!watch_tried) {
+                watch_tried = TRUE;
+#ifdef IN_CLOEXEC
+                watch_fd = inotify_init1(IN_CLOEXEC);
+#else
+                if ((watch_fd = inotify_init()) >= 0)
+                        fcntl(watch_fd, F_SETFD, FD_CLOEXEC);
+#endif
+                start_watch = watch_fd >= 0;
+        }
+#endif
+
         if ((ret = ca_get_data_home(&e)) < 0)
                 goto finish;
 
-        *t = 0;
+        c = 0;
 
         if (e) {
                 if (!(k = ca_new(char, strlen(e) + sizeof("/sounds")))) {
@@ -413,8 +1579,13 @@ static int get_last_change(time_t *t) {
                 sprintf(k, "%s/sounds", e);
                 ca_free(e);
 
+#ifdef HAVE_SYS_INOTIFY_H
+                if (start_watch)
+                        watch_dir(k);
+#endif
+
                 if (stat(k, &st) >= 0)
-                        *t = st.st_mtime;
+                        c = st.st_mtime;
 
                 ca_free(k);
         }
@@ -434,9 +1605,14 @@ static int get_last_change(time_t *t) {
                         memcpy(k, g, j);
                         strcpy(k+j, "/sounds");
 
+#ifdef HAVE_SYS_INOTIFY_H
+                        if (start_watch)
+                                watch_dir(k);
+#endif
+
                         if (stat(k, &st) >= 0)
-                                if (st.st_mtime >= *t)
-                                        *t = st.st_mtime;
+                                if (st.st_mtime >= c)
+                                        c = st.st_mtime;
 
                         ca_free(k);
                 }
@@ -447,34 +1623,58 @@ static int get_last_change(time_t *t) {
                 g += j+1;
         }
 
-        last_change = *t;
+        if (c > last_dir_change)
+                last_dir_change = c;
+
+        *t = last_dir_change;
         last_check = now;
 
+#ifdef HAVE_SYS_INOTIFY_H
+        if (start_watch) {
+                pthread_t thread;
+
+                if (pthread_create(&thread, NULL, watch_func, NULL) == 0)
+                        watching = TRUE;
+        }
+#endif
+
         ret = 0;
 
 finish:
 
-        ca_mutex_unlock(mutex);
+#ifdef HAVE_SYS_INOTIFY_H
+        if (start_watch && !watching)
+                watches_free();
+#endif
+
+        ca_mutex_unlock(change_mutex);
 
         return ret;
 }
 
+int ca_cache_get_last_change(time_t *t) {
+        return get_last_change(t);
+}
+
 int ca_cache_lookup_sound(
                 ca_sound_file **f,
                 ca_sound_file_open_callback_t sfopen,
+                ca_sound_file_open_info_callback_t sfopen_info,
                 char **sound_path,
                 const char *theme,
                 const char *name,
                 const char *locale,
                 const char *profile) {
 
+        char kbuf[KEY_BUF_SIZE], vbuf[VALUE_BUF_SIZE];
         char *key = NULL;
         void *data = NULL;
         size_t klen, dlen;
         int ret;
-        uint32_t timestamp;
         time_t last_change, now;
-        ca_bool_t remove_entry = FALSE;
+        ca_bool_t remove_entry = FALSE, update_hit = FALSE, queued;
+        unsigned generation;
+        struct cache_value v;
 
         ca_return_val_if_fail(f, CA_ERROR_INVALID);
         ca_return_val_if_fail(sfopen, CA_ERROR_INVALID);
@@ -486,18 +1686,27 @@ int ca_cache_lookup_sound(
         if (sound_path)
                 *sound_path = NULL;
 
-        if (!(key = build_key(theme, name, locale, profile, &klen)))
+        if (!(key = build_key(theme, name, locale, profile, kbuf, sizeof(kbuf), &klen)))
                 return CA_ERROR_OOM;
 
-        ret = db_lookup(key, klen, &data, &dlen);
+        if ((ret = mem_lookup(key, klen, vbuf, sizeof(vbuf), &data, &dlen, &generation)) == CA_ERROR_NOTFOUND) {
 
-        if (ret < 0)
+                if ((ret = queue_lookup(key, klen, vbuf, sizeof(vbuf), &data, &dlen, &queued)) < 0)
+                        goto finish;
+
+                if (!queued) {
+                        if ((ret = db_lookup(key, klen, vbuf, sizeof(vbuf), &data, &dlen)) < 0)
+                                goto finish;
+
+                        mem_fill(key, klen, data, dlen, generation);
+                }
+
+        } else if (ret < 0)
                 goto finish;
 
         ca_assert(data);
 
-        if (dlen < sizeof(uint32_t) ||
-            (dlen > sizeof(uint32_t) && ((char*) data)[dlen-1] != 0)) {
+        if (parse_value(&v, data, dlen) < 0) {
 
                 /* Corrupt entry */
                 ret = CA_ERROR_NOTFOUND;
@@ -505,8 +1714,6 @@ int ca_cache_lookup_sound(
                 goto finish;
         }
 
-        memcpy(&timestamp, data, sizeof(timestamp));
-
         if ((ret = get_last_change(&last_change)) < 0)
                 goto finish;
 
@@ -514,13 +1721,19 @@ int ca_cache_lookup_sound(
 
         /* Hmm, is the entry older than the last change to our sound theme
          * dirs? Also, check for clock skews */
-        if ((time_t) timestamp < last_change || ((time_t) timestamp > now)) {
+        if ((time_t) v.timestamp < last_change || ((time_t) v.timestamp > now)) {
                 remove_entry = TRUE;
                 ret = CA_ERROR_NOTFOUND;
                 goto finish;
         }
 
-        if (dlen <= sizeof(uint32_t)) {
+        /* Remember when this entry was last used, so that the least
+         * recently used entries can be evicted. We only do this once in
+         * a while to avoid writing on every hit. This also converts old
+         * style entries. */
+        update_hit = (time_t) v.last_hit + HIT_UPDATE_INTERVAL <= now;
+
+        if (!v.path) {
                 /* Negative caching entry. */
                 *f = NULL;
                 ret = CA_SUCCESS;
@@ -528,25 +1741,42 @@ int ca_cache_lookup_sound(
         }
 
         if (sound_path) {
-                if (!(*sound_path = ca_strdup((const char*) data + sizeof(uint32_t)))) {
+                if (!(*sound_path = ca_strdup(v.path))) {
                         ret = CA_ERROR_OOM;
                         goto finish;
                 }
         }
 
-        if ((ret = sfopen(f, (const char*) data + sizeof(uint32_t))) < 0)
+        if (v.have_info && sfopen_info)
+                ret = sfopen_info(f, v.path, &v.info);
+        else
+                ret = sfopen(f, v.path);
+
+        if (ret < 0)
                 remove_entry = TRUE;
 
 finish:
 
         if (remove_entry)
-                db_remove(key, klen);
+                queue_update(key, klen, NULL, 0);
+        else if (ret >= 0 && update_hit) {
+                void *nd;
+                size_t nl;
+
+                if ((nd = build_value(v.timestamp, (uint32_t) now, v.path, v.have_info ? &v.info : NULL, &nl))) {
+                        queue_update(key, klen, nd, nl);
+                        ca_free(nd);
+                }
+        }
 
         if (sound_path && ret < 0)
                 ca_free(*sound_path);
 
-        ca_free(key);
-        ca_free(data);
+        if (key != kbuf)
+                ca_free(key);
+
+        if (data != vbuf)
+                ca_free(data);
 
         return ret;
 }
@@ -556,9 +1786,10 @@ int ca_cache_store_sound(
                 const char *name,
                 const char *locale,
                 const char *profile,
-                const char *fname) {
+                const char *fname,
+                const ca_sound_file_info *info) {
 
-        char *key;
+        char kbuf[KEY_BUF_SIZE], *key;
         void *data;
         size_t klen, dlen;
         int ret;
@@ -568,26 +1799,22 @@ int ca_cache_store_sound(
         ca_return_val_if_fail(name && *name, CA_ERROR_INVALID);
         ca_return_val_if_fail(locale, CA_ERROR_INVALID);
         ca_return_val_if_fail(profile, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!fname || *fname == '/', CA_ERROR_INVALID);
+        ca_return_val_if_fail(fname || !info, CA_ERROR_INVALID);
 
-        if (!(key = build_key(theme, name, locale, profile, &klen)))
-                return CA_ERROR_OOM;
-
-        dlen = sizeof(uint32_t) + (fname ? strlen(fname) + 1 : 0);
-
-        if (!(data = ca_malloc(dlen))) {
-                ca_free(key);
+        if (!(key = build_key(theme, name, locale, profile, kbuf, sizeof(kbuf), &klen)))
                 return CA_ERROR_OOM;
-        }
 
         ca_assert_se(time(&now) != (time_t) -1);
-        *(uint32_t*) data = (uint32_t) now;
 
-        if (fname)
-                strcpy((char*) data + sizeof(uint32_t), fname);
+        if ((data = build_value((uint32_t) now, (uint32_t) now, fname, info, &dlen)))
+                ret = queue_update(key, klen, data, dlen);
+        else
+                ret = CA_ERROR_OOM;
 
-        ret = db_store(key, klen, data, dlen);
+        if (key != kbuf)
+                ca_free(key);
 
-        ca_free(key);
         ca_free(data);
 
         return ret;
@@ -23,11 +23,15 @@
   <http://www.gnu.org/licenses/>.
 ***/
 
+#include <time.h>
+
 #include "read-sound-file.h"
+#include "sound-theme-spec.h"
 
 int ca_cache_lookup_sound(
                 ca_sound_file **f,
                 ca_sound_file_open_callback_t sfopen,
+                ca_sound_file_open_info_callback_t sfopen_info,
                 char **sound_path,
                 const char *theme,
                 const char *name,
@@ -39,6 +43,11 @@ int ca_cache_store_sound(
                 const char *name,
                 const char *locale,
                 const char *profile,
-                const char *fname);
+                const char *fname,
+                const ca_sound_file_info *info);
+
+/* Returns when the sound theme directories last changed, as far as we
+ * know. Cheap enough to be called on every play. */
+int ca_cache_get_last_change(time_t *t);
 
 #endif
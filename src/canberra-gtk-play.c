@@ -114,7 +114,7 @@ static gboolean property_callback(
 
 int main (int argc, char *argv[]) {
         GOptionContext *oc;
-        static gchar *event_id = NULL, *filename = NULL, *event_description = NULL, *cache_control = NULL, *volume = NULL;
+        static gchar *event_id = NULL, *filename = NULL, *event_description = NULL, *cache_control = NULL, *volume = NULL, *latency = NULL;
         int r;
         static gboolean version = FALSE;
         GError *error = NULL;
@@ -127,6 +127,7 @@ int main (int argc, char *argv[]) {
                 { "cache-control", 'c', 0, G_OPTION_ARG_STRING,   &cache_control,            "Cache control (permanent, volatile, never)", "STRING" },
                 { "loop",          'l', 0, G_OPTION_ARG_INT,      &n_loops,                  "Loop how many times (detault: 1)", "INTEGER" },
                 { "volume",        'V', 0, G_OPTION_ARG_STRING,   &volume,                   "A floating point dB value for the sample volume (ex: 0.0)", "STRING" },
+                { "latency",       0,   0, G_OPTION_ARG_STRING,   &latency,                  "Latency (low, default, powersave, or usec)", "STRING" },
                 { "property",      0,   0, G_OPTION_ARG_CALLBACK, (void*) property_callback, "An arbitrary property", "STRING" },
                 { NULL, 0, 0, 0, NULL, NULL, NULL }
         };
@@ -180,6 +181,9 @@ int main (int argc, char *argv[]) {
         if (volume)
                 ca_proplist_sets(proplist, CA_PROP_CANBERRA_VOLUME, volume);
 
+        if (latency)
+                ca_proplist_sets(proplist, CA_PROP_CANBERRA_LATENCY, latency);
+
         r = ca_context_play_full(ca_gtk_context_get(), 1, proplist, callback, NULL);
 
         if (r < 0) {
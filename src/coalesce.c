@@ -0,0 +1,288 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "coalesce.h"
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+
+#define N_HASHTABLE 31
+
+/* When we track more event ids than this, idle ones whose interval
+ * is over are dropped */
+#define N_ENTRIES_MAX 256
+
+struct entry {
+        struct entry *next;
+        char *event_id;
+        uint64_t last_onset;
+        unsigned min_interval;
+        unsigned n_playing;
+};
+
+struct closure {
+        ca_coalesce *coalesce;
+        struct entry *entry;
+        ca_finish_callback_t callback;
+        void *userdata;
+};
+
+struct ca_coalesce {
+        ca_mutex *mutex;
+        struct entry *entries[N_HASHTABLE];
+        unsigned n_entries;
+};
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        ca_assert_se(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+        return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+static unsigned hash(const char *s) {
+        unsigned h = 0;
+
+        while (*s)
+                h = 31 * h + (unsigned) *(s++);
+
+        return h % N_HASHTABLE;
+}
+
+static int parse_unsigned(const char *t, unsigned *u) {
+        char *e = NULL;
+        unsigned long l;
+
+        errno = 0;
+        l = strtoul(t, &e, 10);
+
+        if (errno != 0 || !e || *e || e == t || l > (unsigned) -1)
+                return CA_ERROR_INVALID;
+
+        *u = (unsigned) l;
+        return CA_SUCCESS;
+}
+
+int ca_coalesce_new(ca_coalesce **_s) {
+        ca_coalesce *s;
+
+        ca_return_val_if_fail(_s, CA_ERROR_INVALID);
+
+        if (!(s = ca_new0(ca_coalesce, 1)))
+                return CA_ERROR_OOM;
+
+        if (!(s->mutex = ca_mutex_new())) {
+                ca_free(s);
+                return CA_ERROR_OOM;
+        }
+
+        *_s = s;
+        return CA_SUCCESS;
+}
+
+void ca_coalesce_free(ca_coalesce *s) {
+        unsigned i;
+
+        ca_assert(s);
+
+        for (i = 0; i < N_HASHTABLE; i++)
+                while (s->entries[i]) {
+                        struct entry *e = s->entries[i];
+                        s->entries[i] = e->next;
+
+                        ca_free(e->event_id);
+                        ca_free(e);
+                }
+
+        ca_mutex_free(s->mutex);
+        ca_free(s);
+}
+
+/* Drops the entries no sound refers to anymore and that would not
+ * suppress a sound played now either. Call with the mutex held. */
+static void gc_unlocked(ca_coalesce *s, uint64_t now) {
+        unsigned i;
+
+        for (i = 0; i < N_HASHTABLE; i++) {
+                struct entry **e = &s->entries[i];
+
+                while (*e) {
+                        struct entry *n = *e;
+
+                        if (n->n_playing > 0 ||
+                            now < n->last_onset + (uint64_t) n->min_interval * 1000ULL) {
+                                e = &n->next;
+                                continue;
+                        }
+
+                        *e = n->next;
+                        ca_free(n->event_id);
+                        ca_free(n);
+                        s->n_entries--;
+                }
+        }
+}
+
+static struct entry* get_entry_unlocked(ca_coalesce *s, const char *event_id, uint64_t now) {
+        struct entry *e;
+        unsigned h;
+
+        h = hash(event_id);
+
+        for (e = s->entries[h]; e; e = e->next)
+                if (ca_streq(e->event_id, event_id))
+                        return e;
+
+        if (s->n_entries >= N_ENTRIES_MAX)
+                gc_unlocked(s, now);
+
+        if (!(e = ca_new0(struct entry, 1)))
+                return NULL;
+
+        if (!(e->event_id = ca_strdup(event_id))) {
+                ca_free(e);
+                return NULL;
+        }
+
+        e->next = s->entries[h];
+        s->entries[h] = e;
+        s->n_entries++;
+
+        return e;
+}
+
+static void finish_cb(ca_context *c, uint32_t id, int error_code, void *userdata) {
+        struct closure *closure = userdata;
+
+        ca_mutex_lock(closure->coalesce->mutex);
+        ca_assert(closure->entry->n_playing > 0);
+        closure->entry->n_playing--;
+        ca_mutex_unlock(closure->coalesce->mutex);
+
+        if (closure->callback)
+                closure->callback(c, id, error_code, closure->userdata);
+
+        ca_free(closure);
+}
+
+int ca_coalesce_admit(ca_coalesce *s, const ca_propview *v, ca_finish_callback_t *cb, void **userdata) {
+        const char *t, *event_id;
+        unsigned min_interval = 0, max_playing = 0;
+        struct closure *closure = NULL;
+        struct entry *e;
+        uint64_t now;
+        int ret = CA_SUCCESS;
+
+        ca_return_val_if_fail(s, CA_ERROR_INVALID);
+        ca_return_val_if_fail(v, CA_ERROR_INVALID);
+        ca_return_val_if_fail(cb, CA_ERROR_INVALID);
+        ca_return_val_if_fail(userdata, CA_ERROR_INVALID);
+
+        if (!(event_id = ca_propview_gets_atom(v, CA_ATOM_EVENT_ID)))
+                return CA_SUCCESS;
+
+        if ((t = ca_propview_gets_atom(v, CA_ATOM_CANBERRA_MIN_INTERVAL)))
+                if (parse_unsigned(t, &min_interval) < 0)
+                        return CA_ERROR_INVALID;
+
+        if ((t = ca_propview_gets_atom(v, CA_ATOM_CANBERRA_MAX_PLAYING)))
+                if (parse_unsigned(t, &max_playing) < 0)
+                        return CA_ERROR_INVALID;
+
+        /* The common case, nothing to do */
+        if (min_interval <= 0 && max_playing <= 0)
+                return CA_SUCCESS;
+
+        if (max_playing > 0) {
+                if (!(closure = ca_new(struct closure, 1)))
+                        return CA_ERROR_OOM;
+
+                closure->coalesce = s;
+                closure->callback = *cb;
+                closure->userdata = *userdata;
+        }
+
+        now = now_usec();
+
+        ca_mutex_lock(s->mutex);
+
+        if (!(e = get_entry_unlocked(s, event_id, now))) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+        }
+
+        if (min_interval > 0 &&
+            e->last_onset > 0 &&
+            now < e->last_onset + (uint64_t) min_interval * 1000ULL) {
+                ret = CA_ERROR_SUPPRESSED;
+                goto finish;
+        }
+
+        if (max_playing > 0 && e->n_playing >= max_playing) {
+                ret = CA_ERROR_SUPPRESSED;
+                goto finish;
+        }
+
+        e->last_onset = now;
+        e->min_interval = min_interval;
+
+        if (closure) {
+                e->n_playing++;
+                closure->entry = e;
+
+                *cb = finish_cb;
+                *userdata = closure;
+                closure = NULL;
+        }
+
+finish:
+        ca_mutex_unlock(s->mutex);
+
+        ca_free(closure);
+
+        return ret;
+}
+
+void ca_coalesce_abort(ca_coalesce *s, ca_finish_callback_t cb, void *userdata) {
+        struct closure *closure = userdata;
+
+        ca_assert(s);
+
+        if (cb != finish_cb)
+                return;
+
+        ca_mutex_lock(s->mutex);
+        ca_assert(closure->entry->n_playing > 0);
+        closure->entry->n_playing--;
+        ca_mutex_unlock(s->mutex);
+
+        ca_free(closure);
+}
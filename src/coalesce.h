@@ -0,0 +1,45 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef foocanberracoalescehfoo
+#define foocanberracoalescehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "canberra.h"
+#include "proplist.h"
+
+/* Per-context bookkeeping for CA_PROP_CANBERRA_MIN_INTERVAL and
+ * CA_PROP_CANBERRA_MAX_PLAYING, keyed by event id */
+typedef struct ca_coalesce ca_coalesce;
+
+int ca_coalesce_new(ca_coalesce **_s);
+void ca_coalesce_free(ca_coalesce *s);
+
+/* Decides whether a sound with the properties in v may be started
+ * now. Returns CA_ERROR_SUPPRESSED if not. If the number of playing
+ * sounds needs to be tracked *cb and *userdata are replaced by a
+ * wrapper that has to be passed on to the driver instead. If the
+ * driver then fails to start the sound, call ca_coalesce_abort() with
+ * the new userdata. */
+int ca_coalesce_admit(ca_coalesce *s, const ca_propview *v, ca_finish_callback_t *cb, void **userdata);
+void ca_coalesce_abort(ca_coalesce *s, ca_finish_callback_t cb, void *userdata);
+
+#endif
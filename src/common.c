@@ -25,6 +25,8 @@
 #endif
 
 #include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
 
 #include "canberra.h"
 #include "common.h"
@@ -33,6 +35,10 @@
 #include "proplist.h"
 #include "macro.h"
 #include "fork-detect.h"
+#include "sound-theme-spec.h"
+#ifdef HAVE_CACHE
+#include "cache.h"
+#endif
 
 /**
  * SECTION:canberra
@@ -113,6 +119,144 @@
  *
  */
 
+#define ASYNC_QUEUE_MAX 64
+
+/* How many sounds with the same id ca_context_cancel() and
+ * ca_context_playing() handle without allocating memory */
+#define VOICE_IDS_MAX 8
+
+static void async_request_free(struct ca_async_request *r) {
+        ca_assert(r);
+
+        if (r->props)
+                ca_assert_se(ca_proplist_destroy(r->props) == CA_SUCCESS);
+
+        ca_free(r);
+}
+
+static int context_play(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata, ca_bool_t coalesce);
+static int context_cancel_unlocked(ca_context *c, uint32_t id);
+
+static void* async_thread(void *data) {
+        ca_context *c = data;
+
+        ca_mutex_lock(c->async_mutex);
+
+        for (;;) {
+                struct ca_async_request *r;
+                ca_bool_t canceled;
+                int ret;
+
+                while (!c->async_queue && !c->async_quit)
+                        ca_cond_wait(c->async_cond, c->async_mutex);
+
+                if (c->async_quit)
+                        break;
+
+                r = c->async_queue;
+                CA_LLIST_REMOVE(struct ca_async_request, c->async_queue, r);
+                if (c->async_queue_tail == r)
+                        c->async_queue_tail = NULL;
+                c->n_async_queue--;
+
+                /* Until the driver has it, ca_context_cancel() and
+                 * ca_context_playing() look here */
+                c->async_in_flight = r;
+
+                ca_mutex_unlock(c->async_mutex);
+
+                ret = context_play(c, r->id, r->props, r->callback, r->userdata, FALSE);
+
+                ca_mutex_lock(c->async_mutex);
+                c->async_in_flight = NULL;
+                canceled = r->canceled;
+                ca_mutex_unlock(c->async_mutex);
+
+                /* If this fails the driver never saw the request, so
+                 * we have to report the error ourselves. If it was
+                 * canceled while we started it, the driver stops it
+                 * now. */
+                if (ret < 0) {
+                        if (r->callback)
+                                r->callback(c, r->id, ret, r->userdata);
+                } else if (canceled) {
+                        ca_mutex_lock(c->mutex);
+
+                        if (c->opened)
+                                context_cancel_unlocked(c, r->id);
+                        else
+                                ca_mutex_unlock(c->mutex);
+                }
+
+                async_request_free(r);
+
+                ca_mutex_lock(c->async_mutex);
+        }
+
+        ca_mutex_unlock(c->async_mutex);
+
+        return NULL;
+}
+
+static void async_stop(ca_context *c) {
+        ca_assert(c->async_running);
+
+        ca_mutex_lock(c->async_mutex);
+        c->async_quit = TRUE;
+        ca_cond_signal(c->async_cond, FALSE);
+        ca_mutex_unlock(c->async_mutex);
+
+        pthread_join(c->async_thread, NULL);
+        c->async_running = FALSE;
+}
+
+/* Removes all queued requests, or only those with the specified id,
+ * and tells their callbacks. A request that is just being started is
+ * marked to be canceled once the driver has it. Returns how many were
+ * removed or marked. */
+static unsigned async_flush(ca_context *c, ca_bool_t match_id, uint32_t id, int error) {
+        struct ca_async_request *r, *n, *removed = NULL;
+        unsigned k = 0;
+
+        if (!c->async_mutex)
+                return 0;
+
+        ca_mutex_lock(c->async_mutex);
+
+        if ((r = c->async_in_flight) && !r->canceled && (!match_id || r->id == id)) {
+                r->canceled = TRUE;
+                k++;
+        }
+
+        for (r = c->async_queue; r; r = n) {
+                n = r->next;
+
+                if (match_id && r->id != id)
+                        continue;
+
+                if (c->async_queue_tail == r)
+                        c->async_queue_tail = r->prev;
+
+                CA_LLIST_REMOVE(struct ca_async_request, c->async_queue, r);
+                CA_LLIST_PREPEND(struct ca_async_request, removed, r);
+                c->n_async_queue--;
+                k++;
+        }
+
+        ca_mutex_unlock(c->async_mutex);
+
+        while ((r = removed)) {
+                CA_LLIST_REMOVE(struct ca_async_request, removed, r);
+
+                if (r->callback)
+                        r->callback(c, r->id, error, r->userdata);
+
+                async_request_free(r);
+        }
+
+        return k;
+}
+
 /**
  * ca_context_create:
  * @c: A pointer wheere to fill in the newly created context object.
@@ -124,7 +268,6 @@
  *
  * Returns: 0 on success, negative error code on error.
  */
-
 int ca_context_create(ca_context **_c) {
         ca_context *c;
         int ret;
@@ -141,11 +284,36 @@ int ca_context_create(ca_context **_c) {
                 return CA_ERROR_OOM;
         }
 
+        if (!(c->driver_lock = ca_rwlock_new())) {
+                ca_context_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
+        if (!(c->async_mutex = ca_mutex_new()) ||
+            !(c->async_cond = ca_cond_new())) {
+                ca_context_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
         if ((ret = ca_proplist_create(&c->props)) < 0) {
                 ca_context_destroy(c);
                 return ret;
         }
 
+        if ((ret = ca_coalesce_new(&c->coalesce)) < 0) {
+                ca_context_destroy(c);
+                return ret;
+        }
+
+        if ((ret = ca_voices_new(&c->voices)) < 0) {
+                ca_context_destroy(c);
+                return ret;
+        }
+
+        /* The context properties are only ever replaced as a whole,
+         * never modified in place */
+        ca_proplist_freeze(c->props);
+
         if ((d = getenv("CANBERRA_DRIVER"))) {
                 if ((ret = ca_context_set_driver(c, d)) < 0) {
                         ca_context_destroy(c);
@@ -182,12 +350,33 @@ int ca_context_destroy(ca_context *c) {
          * broken anyway if it destructs this object in one thread and
          * still is calling a method of it in another. */
 
+        if (c->async_running)
+                async_stop(c);
+
+        async_flush(c, FALSE, 0, CA_ERROR_DESTROYED);
+
         if (c->opened)
                 ret = driver_destroy(c);
 
         if (c->props)
                 ca_assert_se(ca_proplist_destroy(c->props) == CA_SUCCESS);
 
+        /* The driver called all callbacks by now */
+        if (c->coalesce)
+                ca_coalesce_free(c->coalesce);
+
+        if (c->voices)
+                ca_voices_free(c->voices);
+
+        if (c->driver_lock)
+                ca_rwlock_free(c->driver_lock);
+
+        if (c->async_cond)
+                ca_cond_free(c->async_cond);
+
+        if (c->async_mutex)
+                ca_mutex_free(c->async_mutex);
+
         if (c->mutex)
                 ca_mutex_free(c->mutex);
 
@@ -267,6 +456,9 @@ int ca_context_change_device(ca_context *c, const char *device) {
                 goto fail;
         }
 
+        if (c->opened)
+                ca_rwlock_wrlock(c->driver_lock);
+
         ret = c->opened ? driver_change_device(c, n) : CA_SUCCESS;
 
         if (ret == CA_SUCCESS) {
@@ -275,6 +467,9 @@ int ca_context_change_device(ca_context *c, const char *device) {
         } else
                 ca_free(n);
 
+        if (c->opened)
+                ca_rwlock_unlock(c->driver_lock);
+
 fail:
         ca_mutex_unlock(c->mutex);
 
@@ -296,6 +491,81 @@ static int context_open_unlocked(ca_context *c) {
         return ret;
 }
 
+/* Called with c->mutex held on an opened context, releases it.
+ * Playing, canceling, caching and querying only need the driver and
+ * the context state to stay as they are, and may run concurrently
+ * with each other. Hence we take the driver lock shared and don't
+ * block the context during the driver call. */
+static void driver_enter_unlocked(ca_context *c) {
+        ca_assert(c->opened);
+
+        ca_rwlock_rdlock(c->driver_lock);
+        ca_mutex_unlock(c->mutex);
+}
+
+static void driver_leave(ca_context *c) {
+        ca_rwlock_unlock(c->driver_lock);
+}
+
+/* Registers a sound that passed all checks as voice and hands it to
+ * the driver, making room for it first if necessary. Called with
+ * c->mutex held on an opened context, releases it. If coalesce is
+ * TRUE cb and userdata are undone with ca_coalesce_abort() on
+ * failure, otherwise that is left to the caller. */
+static int driver_play_voice_unlocked(ca_context *c, const ca_propview *v, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata, ca_bool_t coalesce) {
+        ca_bool_t steal;
+        uint32_t victim;
+        int ret;
+
+        if ((ret = ca_voices_start(c->voices, v, &id, &cb, &userdata, &steal, &victim)) < 0) {
+                ca_mutex_unlock(c->mutex);
+
+                if (coalesce)
+                        ca_coalesce_abort(c->coalesce, cb, userdata);
+
+                return ret;
+        }
+
+        driver_enter_unlocked(c);
+
+        if (steal)
+                driver_cancel(c, victim);
+
+        ret = driver_play(c, id, p, cb, userdata);
+
+        driver_leave(c);
+
+        if (ret < 0) {
+                ca_voices_abort(c->voices, &id, &cb, &userdata);
+
+                if (coalesce)
+                        ca_coalesce_abort(c->coalesce, cb, userdata);
+        } else
+                ca_voices_started(c->voices, cb, userdata);
+
+        return ret;
+}
+
+/* The checks of ca_context_play_full(), without the warnings. Called
+ * with the context mutex held. */
+static int check_props_unlocked(ca_context *c, ca_proplist *p) {
+        ca_propview v;
+        const char *t;
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+
+        if (!ca_propview_get_atom(&v, CA_ATOM_EVENT_ID) &&
+            !ca_propview_get_atom(&v, CA_ATOM_MEDIA_FILENAME))
+                return CA_ERROR_INVALID;
+
+        if ((t = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_ENABLE)) && ca_streq(t, "0"))
+                return CA_ERROR_DISABLED;
+
+        return CA_SUCCESS;
+}
+
 /**
  * ca_context_open:
  * @c: the context to connect.
@@ -387,6 +657,12 @@ int ca_context_change_props_full(ca_context *c, ca_proplist *p) {
         if ((ret = ca_proplist_merge(&merged, c->props, p)) < 0)
                 goto finish;
 
+        ca_proplist_freeze(merged);
+
+        /* Drivers read c->props while playing, so wait for them */
+        if (c->opened)
+                ca_rwlock_wrlock(c->driver_lock);
+
         ret = c->opened ? driver_change_props(c, p, merged) : CA_SUCCESS;
 
         if (ret == CA_SUCCESS) {
@@ -395,6 +671,9 @@ int ca_context_change_props_full(ca_context *c, ca_proplist *p) {
         } else
                 ca_assert_se(ca_proplist_destroy(merged) == CA_SUCCESS);
 
+        if (c->opened)
+                ca_rwlock_unlock(c->driver_lock);
+
 finish:
 
         ca_mutex_unlock(c->mutex);
@@ -482,48 +761,325 @@ int ca_context_play(ca_context *c, uint32_t id, ...) {
  * allocated memory to the callback and assume that it is freed
  * properly.
  *
+ * Sounds that exceed the limits set with %CA_PROP_CANBERRA_MIN_INTERVAL
+ * or %CA_PROP_CANBERRA_MAX_PLAYING are not played and this function
+ * fails with %CA_ERROR_SUPPRESSED.
+ *
  * Returns: 0 on success, negative error code on error.
  */
 
 int ca_context_play_full(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata) {
+        ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(p, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+
+        return context_play(c, id, p, cb, userdata, TRUE);
+}
+
+/* Requests from ca_context_play_async() have been checked against the
+ * limits when they were queued already, hence coalesce is FALSE for
+ * them. Their callback then is the wrapper from ca_coalesce_admit(),
+ * which we must not free on failure: the queue calls it with the
+ * error, and that undoes the admission exactly once. */
+static int context_play(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata, ca_bool_t coalesce) {
         int ret;
         const char *t;
         ca_bool_t enabled = TRUE;
+        ca_propview v;
+
+        ca_mutex_lock(c->mutex);
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+
+        ca_return_val_if_fail_unlock(ca_propview_get_atom(&v, CA_ATOM_EVENT_ID) ||
+                                     ca_propview_get_atom(&v, CA_ATOM_MEDIA_FILENAME), CA_ERROR_INVALID, c->mutex);
+
+        if ((t = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_ENABLE)))
+                enabled = !ca_streq(t, "0");
+
+        ca_return_val_if_fail_unlock(enabled, CA_ERROR_DISABLED, c->mutex);
+
+        if (coalesce)
+                if ((ret = ca_coalesce_admit(c->coalesce, &v, &cb, &userdata)) < 0)
+                        goto finish;
+
+        if ((ret = context_open_unlocked(c)) < 0) {
+                if (coalesce)
+                        ca_coalesce_abort(c->coalesce, cb, userdata);
+                goto finish;
+        }
+
+        return driver_play_voice_unlocked(c, &v, id, p, cb, userdata, coalesce);
+
+finish:
+
+        ca_mutex_unlock(c->mutex);
+
+        return ret;
+}
+
+/**
+ * ca_context_play_async:
+ * @c: the context to play the event sound on
+ * @id: an integer id this sound can later be identified with when calling ca_context_cancel()
+ * @p: A property list of properties for this event sound
+ * @cb: A callback to call when this event sound finished playing, failed, or was canceled, or NULL
+ * @userdata: Some data to pass to the callback
+ *
+ * Play one event sound without blocking. Unlike ca_context_play_full()
+ * this only checks the arguments, copies the properties and queues
+ * the request for a background thread that connects to the sound
+ * system, looks up the sound and starts playback. This function hence
+ * never waits for the sound system, which makes it suitable for
+ * calling from UI threads.
+ *
+ * Errors that are detected later, including everything
+ * ca_context_play_full() would have returned, are passed to the
+ * callback instead. The callback is guaranteed to be called exactly
+ * once if this function returns CA_SUCCESS. Queued requests are
+ * dropped by ca_context_cancel() with %CA_ERROR_CANCELED and by
+ * ca_context_destroy() with %CA_ERROR_DESTROYED.
+ *
+ * At most 64 requests are queued per context. If that many are still
+ * pending, %CA_ERROR_BUSY is returned.
+ *
+ * Returns: 0 on success, negative error code on error.
+ * Since: 0.30
+ */
+int ca_context_play_async(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata) {
+        struct ca_async_request *r;
+        ca_propview v;
+        int ret;
 
         ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(p, CA_ERROR_INVALID);
         ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
 
+        /* Suppressed sounds shall not even be queued */
         ca_mutex_lock(c->mutex);
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+        ret = ca_coalesce_admit(c->coalesce, &v, &cb, &userdata);
+        ca_mutex_unlock(c->mutex);
 
-        ca_return_val_if_fail_unlock(ca_proplist_contains(p, CA_PROP_EVENT_ID) ||
-                                     ca_proplist_contains(c->props, CA_PROP_EVENT_ID) ||
-                                     ca_proplist_contains(p, CA_PROP_MEDIA_FILENAME) ||
-                                     ca_proplist_contains(c->props, CA_PROP_MEDIA_FILENAME), CA_ERROR_INVALID, c->mutex);
+        if (ret < 0)
+                return ret;
 
-        ca_mutex_lock(c->props->mutex);
-        if ((t = ca_proplist_gets_unlocked(c->props, CA_PROP_CANBERRA_ENABLE)))
-                enabled = !ca_streq(t, "0");
-        ca_mutex_unlock(c->props->mutex);
+        if (!(r = ca_new0(struct ca_async_request, 1))) {
+                ca_coalesce_abort(c->coalesce, cb, userdata);
+                return CA_ERROR_OOM;
+        }
 
-        ca_mutex_lock(p->mutex);
-        if ((t = ca_proplist_gets_unlocked(p, CA_PROP_CANBERRA_ENABLE)))
-                enabled = !ca_streq(t, "0");
-        ca_mutex_unlock(p->mutex);
+        r->id = id;
+        r->callback = cb;
+        r->userdata = userdata;
 
-        ca_return_val_if_fail_unlock(enabled, CA_ERROR_DISABLED, c->mutex);
+        /* The caller may change or free the list right after we return */
+        if ((ret = ca_proplist_copy(&r->props, p)) < 0) {
+                ca_coalesce_abort(c->coalesce, cb, userdata);
+                ca_free(r);
+                return ret;
+        }
+
+        ca_proplist_freeze(r->props);
+
+        ca_mutex_lock(c->async_mutex);
+
+        if (c->n_async_queue >= ASYNC_QUEUE_MAX) {
+                ret = CA_ERROR_BUSY;
+                goto fail;
+        }
+
+        if (!c->async_running) {
+                c->async_quit = FALSE;
+
+                if (pthread_create(&c->async_thread, NULL, async_thread, c) != 0) {
+                        ret = CA_ERROR_OOM;
+                        goto fail;
+                }
+
+                c->async_running = TRUE;
+        }
+
+        CA_LLIST_INSERT_AFTER(struct ca_async_request, c->async_queue, c->async_queue_tail, r);
+        c->async_queue_tail = r;
+        c->n_async_queue++;
+
+        ca_cond_signal(c->async_cond, FALSE);
+        ca_mutex_unlock(c->async_mutex);
+
+        return CA_SUCCESS;
+
+fail:
+        ca_mutex_unlock(c->async_mutex);
+        ca_coalesce_abort(c->coalesce, cb, userdata);
+        async_request_free(r);
+
+        return ret;
+}
+
+/* What ca_context_play_many() needs to remember about each request */
+struct play_many_item {
+        ca_play_request saved;
+        ca_bool_t started, steal;
+        uint32_t victim;
+};
+
+/* Applies the limits to one request and registers it as voice. The
+ * id and callback of the request are replaced by those for the
+ * driver. Called with the context mutex held. */
+static void play_many_start_unlocked(ca_context *c, ca_play_request *r, struct play_many_item *i) {
+        ca_propview v;
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, r->proplist);
+        ca_propview_add(&v, c->props);
+
+        if ((r->error = ca_coalesce_admit(c->coalesce, &v, &r->callback, &r->userdata)) < 0)
+                return;
+
+        if ((r->error = ca_voices_start(c->voices, &v, &r->id, &r->callback, &r->userdata, &i->steal, &i->victim)) < 0) {
+                ca_coalesce_abort(c->coalesce, r->callback, r->userdata);
+                return;
+        }
+
+        i->started = TRUE;
+}
+
+/**
+ * ca_context_play_many:
+ * @c: the context to play the event sounds on
+ * @r: an array of sounds to play
+ * @n: the number of entries in @r
+ *
+ * Start several event sounds at once, for example a notification
+ * sound together with a chime. This is equivalent to calling
+ * ca_context_play_full() for each entry of @r, but the context is
+ * locked only once and backends may start the sounds in parallel:
+ * the PulseAudio backend issues all requests to the server before
+ * waiting for any of them, the ALSA backend opens the devices
+ * concurrently.
+ *
+ * The result for each sound is stored in its error field, and its
+ * callback is called exactly once if that is CA_SUCCESS.
+ *
+ * Returns: 0 if all sounds were started, the first error otherwise.
+ * Since: 0.30
+ */
+int ca_context_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        int ret = CA_SUCCESS, k;
+        unsigned i;
+        struct play_many_item *items;
+
+        ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(r || n == 0, CA_ERROR_INVALID);
+
+        for (i = 0; i < n; i++) {
+                ca_return_val_if_fail(r[i].proplist, CA_ERROR_INVALID);
+                ca_return_val_if_fail(!r[i].userdata || r[i].callback, CA_ERROR_INVALID);
+        }
+
+        if (n == 0)
+                return CA_SUCCESS;
+
+        if (!(items = ca_new0(struct play_many_item, n))) {
+                for (i = 0; i < n; i++)
+                        r[i].error = CA_ERROR_OOM;
+
+                return CA_ERROR_OOM;
+        }
+
+        /* The driver gets our ids and callbacks, the caller's are
+         * restored when we are done */
+        for (i = 0; i < n; i++)
+                items[i].saved = r[i];
+
+        ca_mutex_lock(c->mutex);
+
+        for (i = 0; i < n; i++)
+                r[i].error = check_props_unlocked(c, r[i].proplist);
+
+        if ((k = context_open_unlocked(c)) < 0) {
+                ca_mutex_unlock(c->mutex);
+
+                for (i = 0; i < n; i++)
+                        if (r[i].error == CA_SUCCESS)
+                                r[i].error = k;
 
-        if ((ret = context_open_unlocked(c)) < 0)
                 goto finish;
+        }
 
-        ca_assert(c->opened);
+        for (i = 0; i < n; i++)
+                if (r[i].error == CA_SUCCESS)
+                        play_many_start_unlocked(c, r + i, items + i);
 
-        ret = driver_play(c, id, p, cb, userdata);
+        driver_enter_unlocked(c);
+
+        for (i = 0; i < n; i++)
+                if (items[i].steal)
+                        driver_cancel(c, items[i].victim);
+
+        driver_play_many(c, r, n);
+
+        driver_leave(c);
 
 finish:
 
-        ca_mutex_unlock(c->mutex);
+        for (i = 0; i < n; i++) {
+
+                if (items[i].started) {
+                        if (r[i].error < 0) {
+                                ca_voices_abort(c->voices, &r[i].id, &r[i].callback, &r[i].userdata);
+                                ca_coalesce_abort(c->coalesce, r[i].callback, r[i].userdata);
+                        } else
+                                ca_voices_started(c->voices, r[i].callback, r[i].userdata);
+                }
+
+                r[i].id = items[i].saved.id;
+                r[i].callback = items[i].saved.callback;
+                r[i].userdata = items[i].saved.userdata;
+
+                if (ret == CA_SUCCESS && r[i].error < 0)
+                        ret = r[i].error;
+        }
+
+        ca_free(items);
+
+        return ret;
+}
+
+/* Cancels all sounds with the specified id in the driver. Called with
+ * c->mutex held on an opened context, releases it. */
+static int context_cancel_unlocked(ca_context *c, uint32_t id) {
+        int ret;
+        unsigned i, n;
+        uint32_t buf[VOICE_IDS_MAX], *ids;
+
+        /* The driver knows the sounds by their voice ids */
+        if ((ret = ca_voices_lookup(c->voices, id, buf, CA_ELEMENTSOF(buf), &ids, &n)) < 0) {
+                ca_mutex_unlock(c->mutex);
+                return ret;
+        }
+
+        driver_enter_unlocked(c);
+
+        for (i = 0; i < n; i++) {
+                int r;
+
+                if ((r = driver_cancel(c, ids[i])) < 0 && ret == CA_SUCCESS)
+                        ret = r;
+        }
+
+        driver_leave(c);
+
+        if (ids != buf)
+                ca_free(ids);
 
         return ret;
 }
@@ -538,23 +1094,31 @@ finish:
  * ca_context_play(). If the sound was started with
  * ca_context_play_full() and a callback function was passed this
  * might cause this function to be called with %CA_ERROR_CANCELED as
- * error code.
+ * error code. Sounds queued with ca_context_play_async() that did not
+ * start yet are dropped and their callbacks are called with
+ * %CA_ERROR_CANCELED, too.
  *
  * Returns: 0 on success, negative error code on error.
  */
 int ca_context_cancel(ca_context *c, uint32_t id)  {
-        int ret;
+        unsigned n;
 
         ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
+
+        /* Sounds still waiting in the async queue never reach the driver */
+        n = async_flush(c, TRUE, id, CA_ERROR_CANCELED);
+
         ca_mutex_lock(c->mutex);
-        ca_return_val_if_fail_unlock(c->opened, CA_ERROR_STATE, c->mutex);
 
-        ret = driver_cancel(c, id);
+        if (n > 0 && !c->opened) {
+                ca_mutex_unlock(c->mutex);
+                return CA_SUCCESS;
+        }
 
-        ca_mutex_unlock(c->mutex);
+        ca_return_val_if_fail_unlock(c->opened, CA_ERROR_STATE, c->mutex);
 
-        return ret;
+        return context_cancel_unlocked(c, id);
 }
 
 /**
@@ -613,6 +1177,7 @@ int ca_context_cache(ca_context *c, ...) {
  */
 int ca_context_cache_full(ca_context *c, ca_proplist *p) {
         int ret;
+        ca_propview v;
 
         ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
@@ -620,15 +1185,225 @@ int ca_context_cache_full(ca_context *c, ca_proplist *p) {
 
         ca_mutex_lock(c->mutex);
 
-        ca_return_val_if_fail_unlock(ca_proplist_contains(p, CA_PROP_EVENT_ID) ||
-                                     ca_proplist_contains(c->props, CA_PROP_EVENT_ID), CA_ERROR_INVALID, c->mutex);
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+
+        ca_return_val_if_fail_unlock(ca_propview_get_atom(&v, CA_ATOM_EVENT_ID), CA_ERROR_INVALID, c->mutex);
 
         if ((ret = context_open_unlocked(c)) < 0)
                 goto finish;
 
-        ca_assert(c->opened);
-
+        driver_enter_unlocked(c);
         ret = driver_cache(c, p);
+        driver_leave(c);
+
+        return ret;
+
+finish:
+
+        ca_mutex_unlock(c->mutex);
+
+        return ret;
+}
+
+/* Redoes the checks of ca_context_play_full() for an event and looks
+ * for its sound file again, whenever the context properties or the
+ * sound theme directories changed since the last time. Called with
+ * the context mutex held, which is dropped while we look for the
+ * file. */
+static void event_update_unlocked(ca_event *e) {
+        ca_context *c = e->context;
+        ca_proplist *cp, *resolved = NULL;
+        time_t theme_change = e->theme_change;
+        unsigned n;
+
+#ifdef HAVE_CACHE
+        /* If we cannot tell, we go on with what we have */
+        if (ca_cache_get_last_change(&theme_change) < 0)
+                theme_change = e->theme_change;
+#endif
+
+        if (e->context_props == c->props && e->theme_change == theme_change)
+                return;
+
+        e->theme_change = theme_change;
+        n = ++e->n_updates;
+
+        e->state = check_props_unlocked(c, e->props);
+
+        if (e->context_props)
+                ca_assert_se(ca_proplist_destroy(e->context_props) == CA_SUCCESS);
+
+        e->context_props = ca_proplist_ref(c->props);
+
+        /* Until we are done the driver looks for the file itself */
+        if (e->resolved) {
+                ca_assert_se(ca_proplist_destroy(e->resolved) == CA_SUCCESS);
+                e->resolved = NULL;
+        }
+
+        if (e->state < 0)
+                return;
+
+        /* The theme, the locale or the output profile might have
+         * changed, so look for the sound file again. That touches the
+         * file system, hence we don't keep other threads waiting on
+         * the context meanwhile. If it fails the driver just looks for
+         * the file on every play. */
+        cp = ca_proplist_ref(e->context_props);
+        ca_mutex_unlock(c->mutex);
+
+        ca_resolve_sound(&resolved, &e->theme, cp, e->props);
+
+        ca_mutex_lock(c->mutex);
+
+        /* Unless somebody else did it again in the meantime */
+        if (e->n_updates == n) {
+                e->resolved = resolved;
+                resolved = NULL;
+        }
+
+        ca_assert_se(ca_proplist_destroy(cp) == CA_SUCCESS);
+
+        if (resolved)
+                ca_assert_se(ca_proplist_destroy(resolved) == CA_SUCCESS);
+}
+
+/**
+ * ca_event_new:
+ * @e: A pointer where to fill in a pointer for the new event object.
+ * @c: the context the event sound shall be played on
+ * @p: the properties describing the event sound
+ *
+ * Prepare an event sound that is played frequently, such as
+ * button-pressed. Everything that only depends on the properties is
+ * done once here instead of on every ca_event_play(): the properties
+ * are copied and checked, the sound file is looked up in the sound
+ * theme, the context is connected to the sound system and, if
+ * %CA_PROP_CANBERRA_CACHE_CONTROL asks for it and the backend supports
+ * it, the sample is uploaded to the sound server.
+ *
+ * Later changes to the context properties or to the sound theme
+ * directories are picked up automatically, the sound file is then
+ * looked up again. The property list @p is not referenced after this
+ * call returns. The event object must be destroyed before the context
+ * it belongs to.
+ *
+ * Returns: 0 on success, negative error code on error.
+ * Since: 0.30
+ */
+int ca_event_new(ca_event **_e, ca_context *c, ca_proplist *p) {
+        int ret;
+        ca_event *e;
+        const char *t;
+        ca_cache_control_t cache_control = CA_CACHE_CONTROL_NEVER;
+
+        ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+        ca_return_val_if_fail(_e, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(p, CA_ERROR_INVALID);
+
+        if (!(e = ca_new0(ca_event, 1)))
+                return CA_ERROR_OOM;
+
+        e->context = c;
+
+        if ((ret = ca_proplist_copy(&e->props, p)) < 0)
+                goto fail;
+
+        ca_proplist_freeze(e->props);
+
+        ca_mutex_lock(c->mutex);
+
+        event_update_unlocked(e);
+
+        if ((ret = e->state) < 0)
+                goto fail_unlock;
+
+        if ((ret = context_open_unlocked(c)) < 0)
+                goto fail_unlock;
+
+        if ((t = ca_proplist_gets_atom_unlocked(e->props, CA_ATOM_CANBERRA_CACHE_CONTROL)))
+                if ((ret = ca_parse_cache_control(&cache_control, t)) < 0)
+                        goto fail_unlock;
+
+        driver_enter_unlocked(c);
+
+        /* Failing to cache is not fatal, the sample will then be
+         * looked up again on every play */
+        if (cache_control != CA_CACHE_CONTROL_NEVER)
+                driver_cache(c, e->props);
+
+        driver_leave(c);
+
+        *_e = e;
+
+        return CA_SUCCESS;
+
+fail_unlock:
+        ca_mutex_unlock(c->mutex);
+
+fail:
+        ca_event_destroy(e);
+
+        return ret;
+}
+
+/**
+ * ca_event_play:
+ * @e: the event to play
+ * @id: an integer id this sound can later be identified with when calling ca_context_cancel()
+ * @cb: a callback to call as soon as the event sound is finished playing, or NULL
+ * @userdata: some data to pass to the callback
+ *
+ * Play an event sound prepared with ca_event_new(). This behaves like
+ * ca_context_play_full() with the properties the event was created
+ * with, but skips the work that has already been done.
+ *
+ * Returns: 0 on success, negative error code on error.
+ * Since: 0.30
+ */
+int ca_event_play(ca_event *e, uint32_t id, ca_finish_callback_t cb, void *userdata) {
+        int ret;
+        ca_context *c;
+        ca_propview v;
+        ca_proplist *p;
+
+        ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
+        ca_return_val_if_fail(e, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!userdata || cb, CA_ERROR_INVALID);
+
+        c = e->context;
+
+        ca_mutex_lock(c->mutex);
+
+        event_update_unlocked(e);
+
+        if ((ret = e->state) < 0)
+                goto finish;
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, e->props);
+        ca_propview_add(&v, c->props);
+
+        if ((ret = ca_coalesce_admit(c->coalesce, &v, &cb, &userdata)) < 0)
+                goto finish;
+
+        if ((ret = context_open_unlocked(c)) < 0) {
+                ca_coalesce_abort(c->coalesce, cb, userdata);
+                goto finish;
+        }
+
+        /* Another thread might replace e->resolved while the driver
+         * looks at it */
+        p = ca_proplist_ref(e->resolved ? e->resolved : e->props);
+
+        ret = driver_play_voice_unlocked(c, &v, id, p, cb, userdata, TRUE);
+
+        ca_assert_se(ca_proplist_destroy(p) == CA_SUCCESS);
+
+        return ret;
 
 finish:
 
@@ -637,6 +1412,36 @@ finish:
         return ret;
 }
 
+/**
+ * ca_event_destroy:
+ * @e: the event to destroy.
+ *
+ * Destroy an event object created with ca_event_new(). Sounds that
+ * are still playing are not affected.
+ *
+ * Returns: 0 on success, negative error code on error.
+ * Since: 0.30
+ */
+int ca_event_destroy(ca_event *e) {
+        ca_return_val_if_fail(e, CA_ERROR_INVALID);
+
+        if (e->props)
+                ca_assert_se(ca_proplist_destroy(e->props) == CA_SUCCESS);
+
+        if (e->context_props)
+                ca_assert_se(ca_proplist_destroy(e->context_props) == CA_SUCCESS);
+
+        if (e->resolved)
+                ca_assert_se(ca_proplist_destroy(e->resolved) == CA_SUCCESS);
+
+        if (e->theme)
+                ca_theme_data_free(e->theme);
+
+        ca_free(e);
+
+        return CA_SUCCESS;
+}
+
 /**
  * ca_strerror:
  * @code: Numerical error code as returned by a libcanberra API function
@@ -666,7 +1471,9 @@ const char *ca_strerror(int code) {
                 [-CA_ERROR_INTERNAL] = "Internal error",
                 [-CA_ERROR_DISABLED] = "Sound disabled",
                 [-CA_ERROR_FORKED] = "Process forked",
-                [-CA_ERROR_DISCONNECTED] = "Disconnected"
+                [-CA_ERROR_DISCONNECTED] = "Disconnected",
+                [-CA_ERROR_BUSY] = "Busy",
+                [-CA_ERROR_SUPPRESSED] = "Suppressed"
         };
 
         ca_return_val_if_fail(code <= 0, NULL);
@@ -675,6 +1482,28 @@ const char *ca_strerror(int code) {
         return error_table[-code];
 }
 
+/* Not exported. For drivers that cannot do better than playing the
+ * sounds one after the other. */
+int ca_play_many_each(ca_context *c, ca_play_request *r, unsigned n, ca_driver_play_t play) {
+        int ret = CA_SUCCESS;
+        unsigned i;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(r || n == 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(play, CA_ERROR_INVALID);
+
+        for (i = 0; i < n; i++) {
+
+                if (r[i].error < 0)
+                        continue;
+
+                if ((r[i].error = play(c, r[i].id, r[i].proplist, r[i].callback, r[i].userdata)) < 0 && ret == CA_SUCCESS)
+                        ret = r[i].error;
+        }
+
+        return ret;
+}
+
 /* Not exported */
 int ca_parse_cache_control(ca_cache_control_t *control, const char *c) {
         ca_return_val_if_fail(control, CA_ERROR_INVALID);
@@ -692,6 +1521,79 @@ int ca_parse_cache_control(ca_cache_control_t *control, const char *c) {
         return CA_SUCCESS;
 }
 
+/* Not exported */
+int ca_parse_latency(uint32_t *latency, const char *t) {
+        ca_return_val_if_fail(latency, CA_ERROR_INVALID);
+        ca_return_val_if_fail(t, CA_ERROR_INVALID);
+
+        if (ca_streq(t, "low"))
+                *latency = CA_LATENCY_LOW;
+        else if (ca_streq(t, "default"))
+                *latency = CA_LATENCY_DEFAULT;
+        else if (ca_streq(t, "powersave"))
+                *latency = CA_LATENCY_POWERSAVE;
+        else {
+                char *e = NULL;
+                unsigned long l;
+
+                errno = 0;
+                l = strtoul(t, &e, 10);
+
+                if (errno != 0 || !e || *e || e == t || l >= CA_LATENCY_POWERSAVE)
+                        return CA_ERROR_INVALID;
+
+                *latency = (uint32_t) l;
+        }
+
+        return CA_SUCCESS;
+}
+
+/* Not exported */
+int ca_get_latency(ca_context *c, ca_proplist *p, uint32_t *latency) {
+        ca_propview v;
+        const char *t;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(p, CA_ERROR_INVALID);
+        ca_return_val_if_fail(latency, CA_ERROR_INVALID);
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+
+        if (!(t = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_LATENCY))) {
+                *latency = CA_LATENCY_DEFAULT;
+                return CA_SUCCESS;
+        }
+
+        return ca_parse_latency(latency, t);
+}
+
+/* Not exported */
+int ca_get_realtime(ca_context *c, ca_proplist *p, ca_bool_t *realtime) {
+        ca_propview v;
+        const char *t;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(p, CA_ERROR_INVALID);
+        ca_return_val_if_fail(realtime, CA_ERROR_INVALID);
+
+        /* The environment overrides whatever the application asks for */
+        if ((t = getenv("CANBERRA_REALTIME"))) {
+                *realtime = !ca_streq(t, "0");
+                return CA_SUCCESS;
+        }
+
+        ca_propview_init(&v);
+        ca_propview_add(&v, p);
+        ca_propview_add(&v, c->props);
+
+        t = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_REALTIME);
+        *realtime = t && !ca_streq(t, "0");
+
+        return CA_SUCCESS;
+}
+
 /**
  * ca_context_playing:
  * @c: the context to check if sound is still playing
@@ -707,16 +1609,48 @@ int ca_parse_cache_control(ca_cache_control_t *control, const char *c) {
  */
 int ca_context_playing(ca_context *c, uint32_t id, int *playing)  {
         int ret;
+        struct ca_async_request *r;
+        uint32_t buf[VOICE_IDS_MAX], *ids;
+        unsigned i, n;
 
         ca_return_val_if_fail(!ca_detect_fork(), CA_ERROR_FORKED);
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(playing, CA_ERROR_INVALID);
+
+        /* Queued sounds count as playing, and so does one that is just
+         * being handed to the driver */
+        ca_mutex_lock(c->async_mutex);
+        if (!(r = c->async_in_flight) || r->id != id || r->canceled)
+                for (r = c->async_queue; r; r = r->next)
+                        if (r->id == id)
+                                break;
+        ca_mutex_unlock(c->async_mutex);
+
+        if (r) {
+                *playing = 1;
+                return CA_SUCCESS;
+        }
+
         ca_mutex_lock(c->mutex);
         ca_return_val_if_fail_unlock(c->opened, CA_ERROR_STATE, c->mutex);
 
-        ret = driver_playing(c, id, playing);
+        if ((ret = ca_voices_lookup(c->voices, id, buf, CA_ELEMENTSOF(buf), &ids, &n)) < 0) {
+                ca_mutex_unlock(c->mutex);
+                return ret;
+        }
 
-        ca_mutex_unlock(c->mutex);
+        driver_enter_unlocked(c);
+
+        *playing = 0;
+
+        for (i = 0; i < n && !*playing; i++)
+                if ((ret = driver_playing(c, ids[i], playing)) < 0)
+                        break;
+
+        driver_leave(c);
+
+        if (ids != buf)
+                ca_free(ids);
 
         return ret;
 }
@@ -23,16 +23,55 @@
   <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
+#include <time.h>
+
 #include "canberra.h"
 #include "macro.h"
 #include "mutex.h"
+#include "llist.h"
+#include "coalesce.h"
+#include "voices.h"
+
+struct ca_async_request {
+        CA_LLIST_FIELDS(struct ca_async_request);
+        uint32_t id;
+        ca_proplist *props;
+        ca_finish_callback_t callback;
+        void *userdata;
+        ca_bool_t canceled;
+};
 
 struct ca_context {
         ca_bool_t opened;
         ca_mutex *mutex;
 
+        /* Taken shared around driver calls that may run concurrently
+         * and exclusively around those that change the driver state
+         * or the properties. Always taken after mutex. */
+        ca_rwlock *driver_lock;
+
         ca_proplist *props;
 
+        /* Event sounds that are currently limited */
+        ca_coalesce *coalesce;
+
+        /* All sounds the driver is playing for us */
+        ca_voices *voices;
+
+        /* Requests from ca_context_play_async(), served in order by a
+         * worker thread that is started on first use */
+        ca_mutex *async_mutex;
+        ca_cond *async_cond;
+        CA_LLIST_HEAD(struct ca_async_request, async_queue);
+        struct ca_async_request *async_queue_tail;
+        unsigned n_async_queue;
+        /* Taken off the queue but maybe not known to the driver yet */
+        struct ca_async_request *async_in_flight;
+        pthread_t async_thread;
+        ca_bool_t async_running;
+        ca_bool_t async_quit;
+
         char *driver;
         char *device;
 
@@ -42,6 +81,29 @@ struct ca_context {
 #endif
 };
 
+struct ca_event {
+        ca_context *context;
+
+        /* Frozen copy of the event properties */
+        ca_proplist *props;
+
+        /* The context properties snapshot the checks below were last
+         * done against. We keep a reference so that the pointer stays
+         * unique while we compare against it. */
+        ca_proplist *context_props;
+        int state;
+
+        /* The event properties plus the sound file they were resolved
+         * to, NULL if that didn't work out */
+        ca_proplist *resolved;
+        struct ca_theme_data *theme;
+
+        /* When the theme directories last changed before we resolved,
+         * and how often we did so, to tell which result is the latest */
+        time_t theme_change;
+        unsigned n_updates;
+};
+
 typedef enum ca_cache_control {
         CA_CACHE_CONTROL_NEVER,
         CA_CACHE_CONTROL_PERMANENT,
@@ -50,4 +112,22 @@ typedef enum ca_cache_control {
 
 int ca_parse_cache_control(ca_cache_control_t *control, const char *c);
 
+/* Latency targets in usec, as selected with canberra.latency */
+#define CA_LATENCY_DEFAULT ((uint32_t) 0)
+#define CA_LATENCY_LOW ((uint32_t) 10000)
+#define CA_LATENCY_POWERSAVE ((uint32_t) -1)
+
+int ca_parse_latency(uint32_t *latency, const char *t);
+
+/* Play properties take precedence over the context properties */
+int ca_get_latency(ca_context *c, ca_proplist *p, uint32_t *latency);
+
+/* Whether the threads playing the sound should ask for real-time
+ * scheduling. $CANBERRA_REALTIME takes precedence over both. */
+int ca_get_realtime(ca_context *c, ca_proplist *p, ca_bool_t *realtime);
+
+typedef int (*ca_driver_play_t)(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata);
+
+int ca_play_many_each(ca_context *c, ca_play_request *r, unsigned n, ca_driver_play_t play);
+
 #endif
@@ -32,6 +32,10 @@ int driver_change_device(ca_context *c, const char *device);
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged);
 
 int driver_play(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata);
+
+/* Plays all requests whose error is CA_SUCCESS when called and stores
+ * the result for each of them in error. Returns the first error. */
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n);
 int driver_cancel(ca_context *c, uint32_t id);
 int driver_cache(ca_context *c, ca_proplist *p);
 
@@ -42,6 +42,7 @@ struct private_dso {
         int (*driver_change_device)(ca_context *c, const char *device);
         int (*driver_change_props)(ca_context *c, ca_proplist *changed, ca_proplist *merged);
         int (*driver_play)(ca_context *c, uint32_t id, ca_proplist *p, ca_finish_callback_t cb, void *userdata);
+        int (*driver_play_many)(ca_context *c, ca_play_request *r, unsigned n);
         int (*driver_cancel)(ca_context *c, uint32_t id);
         int (*driver_cache)(ca_context *c, ca_proplist *p);
         int (*driver_playing)(ca_context *c, uint32_t id, int *playing);
@@ -268,6 +269,9 @@ int driver_open(ca_context *c) {
                 return CA_ERROR_CORRUPT;
         }
 
+        /* Optional, older plugins don't have it */
+        p->driver_play_many = GET_FUNC_PTR(p->module, driver, "driver_play_many", int, (ca_context*, ca_play_request *, unsigned));
+
         ca_free(driver);
 
         if ((ret = p->driver_open(c)) < 0) {
@@ -342,6 +346,21 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *pl, ca_finish_callback_
         return p->driver_play(c, id, pl, cb, userdata);
 }
 
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        struct private_dso *p;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private_dso, CA_ERROR_STATE);
+
+        p = PRIVATE_DSO(c);
+        ca_return_val_if_fail(p->driver_play, CA_ERROR_STATE);
+
+        if (!p->driver_play_many)
+                return ca_play_many_each(c, r, n, p->driver_play);
+
+        return p->driver_play_many(c, r, n);
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         struct private_dso *p;
 
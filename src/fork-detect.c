@@ -26,10 +26,23 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "fork-detect.h"
 
+static volatile int forked = 0;
+static int atfork_installed = 0;
+
+static void atfork_child(void) {
+        forked = 1;
+}
+
+static void install_atfork(void) {
+        atfork_installed = pthread_atfork(NULL, NULL, atfork_child) == 0;
+}
+
 int ca_detect_fork(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
         static volatile pid_t pid = (pid_t) -1;
         pid_t v, we;
 
@@ -39,6 +52,15 @@ int ca_detect_fork(void) {
          * to detect the forks making sure all our calls fail cleanly
          * after the fork. */
 
+        /* Every API call ends up here, hence we'd rather not ask the
+         * kernel for our PID each time. Instead we get notified about
+         * forks, which we only need to care about after our first
+         * call. */
+        pthread_once(&once, install_atfork);
+
+        if (atfork_installed)
+                return forked;
+
         /* Ideally we'd use atomic operations here, but we don't have them
          * and this is not exactly crucial, so we don't care */
 
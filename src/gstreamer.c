@@ -44,11 +44,13 @@
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
 #include "malloc.h"
+#include "id-table.h"
 
 struct outstanding {
         CA_LLIST_FIELDS(struct outstanding);
         ca_bool_t dead;
         uint32_t id;
+        ca_id_link by_id;
         int err;
         ca_finish_callback_t callback;
         void *userdata;
@@ -68,6 +70,7 @@ struct private {
         ca_bool_t mgr_thread_running;
         ca_bool_t semaphore_allocated;
         CA_LLIST_HEAD(struct outstanding, outstanding);
+        ca_id_table outstanding_by_id;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -119,6 +122,11 @@ int driver_open(ca_context *c) {
                 return CA_ERROR_OOM;
         }
 
+        if (ca_id_table_init(&p->outstanding_by_id) < 0) {
+                driver_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
         if (sem_init(&p->semaphore, 0, 0) < 0) {
                 driver_destroy(c);
                 return CA_ERROR_OOM;
@@ -188,6 +196,8 @@ int driver_destroy(ca_context *c) {
         if (p->semaphore_allocated)
                 sem_destroy(&p->semaphore);
 
+        ca_id_table_done(&p->outstanding_by_id);
+
         ca_free(p);
 
         /* no gst_deinit(), see doc */
@@ -380,6 +390,7 @@ static void* thread_func(void *userdata) {
 
                 ca_mutex_lock(p->outstanding_mutex);
                 CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
                 outstanding_free(out);
                 ca_mutex_unlock(p->outstanding_mutex);
 
@@ -490,6 +501,7 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
 
         ca_mutex_lock(p->outstanding_mutex);
         CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        ca_id_table_put(&p->outstanding_by_id, &out->by_id, out->id);
         ca_mutex_unlock(p->outstanding_mutex);
 
         if (gst_element_set_state(out->pipeline,
@@ -510,9 +522,17 @@ fail:
         return ret;
 }
 
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        return ca_play_many_each(c, r, n, driver_play);
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         struct private *p;
         struct outstanding *out = NULL;
+        ca_id_link *l, *n;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(PRIVATE(c), CA_ERROR_STATE);
@@ -521,13 +541,12 @@ int driver_cancel(ca_context *c, uint32_t id) {
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out;/* out = out->next*/) {
-                struct outstanding *next;
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = n) {
+                n = ca_id_table_next(l);
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
-                if (out->id != id || out->pipeline == NULL || out->dead == TRUE) {
-                        out = out->next;
+                if (out->pipeline == NULL || out->dead == TRUE)
                         continue;
-                }
 
                 if (gst_element_set_state(out->pipeline, GST_STATE_NULL) ==
                     GST_STATE_CHANGE_FAILURE)
@@ -535,10 +554,9 @@ int driver_cancel(ca_context *c, uint32_t id) {
 
                 if (out->callback)
                         out->callback(c, out->id, CA_ERROR_CANCELED, out->userdata);
-                next = out->next;
                 CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
                 outstanding_free(out);
-                out = next;
         }
 
         ca_mutex_unlock(p->outstanding_mutex);
@@ -561,6 +579,7 @@ int driver_cache(ca_context *c, ca_proplist *proplist) {
 int driver_playing(ca_context *c, uint32_t id, int *playing) {
         struct private *p;
         struct outstanding *out;
+        ca_id_link *l;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -572,9 +591,10 @@ int driver_playing(ca_context *c, uint32_t id, int *playing) {
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
-                if (out->id != id || out->pipeline == NULL || out->dead == TRUE)
+                if (out->pipeline == NULL || out->dead == TRUE)
                         continue;
 
                 *playing = 1;
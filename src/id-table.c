@@ -0,0 +1,152 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "canberra.h"
+#include "id-table.h"
+#include "malloc.h"
+#include "macro.h"
+
+#define N_BUCKETS_MIN 16
+
+static unsigned bucket(unsigned n_buckets, uint32_t key) {
+        /* n_buckets is always a power of two */
+        return (unsigned) ((key * 2654435761U) >> 7) & (n_buckets - 1);
+}
+
+int ca_id_table_init(ca_id_table *t) {
+        ca_assert(t);
+
+        if (!(t->buckets = ca_new0(ca_id_link*, N_BUCKETS_MIN)))
+                return CA_ERROR_OOM;
+
+        t->n_buckets = N_BUCKETS_MIN;
+        t->n_links = 0;
+
+        return CA_SUCCESS;
+}
+
+void ca_id_table_done(ca_id_table *t) {
+        ca_assert(t);
+
+        ca_free(t->buckets);
+        t->buckets = NULL;
+        t->n_buckets = t->n_links = 0;
+}
+
+static void grow(ca_id_table *t) {
+        ca_id_link **b;
+        unsigned i, n;
+
+        n = t->n_buckets * 2;
+
+        /* If this fails the chains just get longer */
+        if (!(b = ca_new0(ca_id_link*, n)))
+                return;
+
+        for (i = 0; i < t->n_buckets; i++)
+                while (t->buckets[i]) {
+                        ca_id_link *l = t->buckets[i];
+                        unsigned j;
+
+                        t->buckets[i] = l->next;
+
+                        j = bucket(n, l->key);
+                        l->prev = NULL;
+                        l->next = b[j];
+                        if (l->next)
+                                l->next->prev = l;
+                        b[j] = l;
+                }
+
+        ca_free(t->buckets);
+        t->buckets = b;
+        t->n_buckets = n;
+}
+
+void ca_id_table_put(ca_id_table *t, ca_id_link *l, uint32_t key) {
+        unsigned i;
+
+        ca_assert(t);
+        ca_assert(t->buckets);
+        ca_assert(l);
+
+        if (t->n_links >= t->n_buckets * 2)
+                grow(t);
+
+        i = bucket(t->n_buckets, key);
+
+        l->key = key;
+        l->prev = NULL;
+        l->next = t->buckets[i];
+        if (l->next)
+                l->next->prev = l;
+        t->buckets[i] = l;
+
+        t->n_links++;
+}
+
+void ca_id_table_remove(ca_id_table *t, ca_id_link *l) {
+        ca_assert(t);
+        ca_assert(l);
+        ca_assert(t->n_links > 0);
+
+        if (l->next)
+                l->next->prev = l->prev;
+
+        if (l->prev)
+                l->prev->next = l->next;
+        else {
+                unsigned i = bucket(t->n_buckets, l->key);
+
+                ca_assert(t->buckets[i] == l);
+                t->buckets[i] = l->next;
+        }
+
+        l->next = l->prev = NULL;
+        t->n_links--;
+}
+
+static ca_id_link* find(ca_id_link *l, uint32_t key) {
+
+        for (; l; l = l->next)
+                if (l->key == key)
+                        return l;
+
+        return NULL;
+}
+
+ca_id_link* ca_id_table_first(ca_id_table *t, uint32_t key) {
+        ca_assert(t);
+        ca_assert(t->buckets);
+
+        return find(t->buckets[bucket(t->n_buckets, key)], key);
+}
+
+ca_id_link* ca_id_table_next(ca_id_link *l) {
+        ca_assert(l);
+
+        return find(l->next, l->key);
+}
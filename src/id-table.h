@@ -0,0 +1,56 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef foocanberraidtablehfoo
+#define foocanberraidtablehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* A hash index on a 32bit key, such as a sound id. The links are
+ * embedded in the indexed structures and several of them may have the
+ * same key. Not locked. */
+
+typedef struct ca_id_link {
+        struct ca_id_link *next, *prev;
+        uint32_t key;
+} ca_id_link;
+
+typedef struct ca_id_table {
+        ca_id_link **buckets;
+        unsigned n_buckets;
+        unsigned n_links;
+} ca_id_table;
+
+#define CA_ID_TABLE_ENTRY(l, type, member) ((type*) ((char*) (l) - offsetof(type, member)))
+
+int ca_id_table_init(ca_id_table *t);
+void ca_id_table_done(ca_id_table *t);
+
+void ca_id_table_put(ca_id_table *t, ca_id_link *l, uint32_t key);
+void ca_id_table_remove(ca_id_table *t, ca_id_link *l);
+
+/* Iterates through all links with the specified key */
+ca_id_link* ca_id_table_first(ca_id_table *t, uint32_t key);
+ca_id_link* ca_id_table_next(ca_id_link *l);
+
+#endif
@@ -284,6 +284,113 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         return ret;
 }
 
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        int ret = CA_SUCCESS;
+        struct private *p;
+        struct backend *b;
+        struct closure **closures = NULL;
+        ca_play_request *sub = NULL;
+        unsigned *idx = NULL;
+        int *first_error = NULL;
+        unsigned i;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(r || n <= 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        if (n <= 0)
+                return CA_SUCCESS;
+
+        if (!(closures = ca_new0(struct closure*, n)) ||
+            !(sub = ca_new(ca_play_request, n)) ||
+            !(idx = ca_new(unsigned, n)) ||
+            !(first_error = ca_new0(int, n))) {
+
+                for (i = 0; i < n; i++)
+                        if (r[i].error >= 0)
+                                r[i].error = CA_ERROR_OOM;
+
+                ret = CA_ERROR_OOM;
+                goto finish;
+        }
+
+        /* Wrap the callbacks the same way driver_play() does. Requests
+         * that have not been taken by any backend yet are marked with
+         * CA_ERROR_NOTAVAILABLE. */
+        for (i = 0; i < n; i++) {
+
+                if (r[i].error < 0)
+                        continue;
+
+                if (r[i].callback) {
+                        if (!(closures[i] = ca_new(struct closure, 1))) {
+                                r[i].error = CA_ERROR_OOM;
+                                continue;
+                        }
+
+                        closures[i]->context = c;
+                        closures[i]->callback = r[i].callback;
+                        closures[i]->userdata = r[i].userdata;
+                }
+
+                r[i].error = CA_ERROR_NOTAVAILABLE;
+        }
+
+        /* Hand everything that is still left to each backend in turn,
+         * the first one that can play a request takes it */
+        for (b = p->backends; b; b = b->next) {
+                unsigned j, k = 0;
+
+                for (i = 0; i < n; i++) {
+                        if (r[i].error != CA_ERROR_NOTAVAILABLE)
+                                continue;
+
+                        sub[k] = r[i];
+                        sub[k].callback = closures[i] ? call_closure : NULL;
+                        sub[k].userdata = closures[i];
+                        sub[k].error = CA_SUCCESS;
+                        idx[k++] = i;
+                }
+
+                if (k <= 0)
+                        break;
+
+                ca_context_play_many(b->context, sub, k);
+
+                for (j = 0; j < k; j++) {
+                        i = idx[j];
+
+                        if (sub[j].error == CA_SUCCESS) {
+                                r[i].error = CA_SUCCESS;
+                                closures[i] = NULL;
+
+                        /* We only return the first failure */
+                        } else if (first_error[i] == CA_SUCCESS)
+                                first_error[i] = sub[j].error;
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                if (r[i].error == CA_ERROR_NOTAVAILABLE) {
+                        r[i].error = first_error[i];
+                        ca_free(closures[i]);
+                }
+
+                if (ret == CA_SUCCESS && r[i].error < 0)
+                        ret = r[i].error;
+        }
+
+finish:
+        ca_free(closures);
+        ca_free(sub);
+        ca_free(idx);
+        ca_free(first_error);
+
+        return ret;
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         int ret = CA_SUCCESS;
         struct private *p;
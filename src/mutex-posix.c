@@ -26,6 +26,7 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #include "mutex.h"
 #include "malloc.h"
@@ -34,6 +35,14 @@ struct ca_mutex {
         pthread_mutex_t mutex;
 };
 
+struct ca_cond {
+        pthread_cond_t cond;
+};
+
+struct ca_rwlock {
+        pthread_rwlock_t rwlock;
+};
+
 ca_mutex* ca_mutex_new(void) {
         ca_mutex *m;
 
@@ -78,3 +87,104 @@ void ca_mutex_unlock(ca_mutex *m) {
 
         ca_assert_se(pthread_mutex_unlock(&m->mutex) == 0);
 }
+
+ca_cond *ca_cond_new(void) {
+        ca_cond *c;
+
+        if (!(c = ca_new(ca_cond, 1)))
+                return NULL;
+
+        if (pthread_cond_init(&c->cond, NULL) != 0) {
+                ca_free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+void ca_cond_free(ca_cond *c) {
+        ca_assert(c);
+
+        ca_assert_se(pthread_cond_destroy(&c->cond) == 0);
+        ca_free(c);
+}
+
+void ca_cond_signal(ca_cond *c, ca_bool_t broadcast) {
+        ca_assert(c);
+
+        if (broadcast)
+                ca_assert_se(pthread_cond_broadcast(&c->cond) == 0);
+        else
+                ca_assert_se(pthread_cond_signal(&c->cond) == 0);
+}
+
+void ca_cond_wait(ca_cond *c, ca_mutex *m) {
+        ca_assert(c);
+        ca_assert(m);
+
+        ca_assert_se(pthread_cond_wait(&c->cond, &m->mutex) == 0);
+}
+
+ca_bool_t ca_cond_timedwait(ca_cond *c, ca_mutex *m, unsigned msec) {
+        struct timespec ts;
+        int r;
+
+        ca_assert(c);
+        ca_assert(m);
+
+        ca_assert_se(clock_gettime(CLOCK_REALTIME, &ts) == 0);
+
+        ts.tv_sec += (time_t) (msec / 1000);
+        ts.tv_nsec += (long) (msec % 1000) * 1000000L;
+
+        if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+        }
+
+        if ((r = pthread_cond_timedwait(&c->cond, &m->mutex, &ts)) != 0) {
+                ca_assert(r == ETIMEDOUT);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+ca_rwlock *ca_rwlock_new(void) {
+        ca_rwlock *l;
+
+        if (!(l = ca_new(ca_rwlock, 1)))
+                return NULL;
+
+        if (pthread_rwlock_init(&l->rwlock, NULL) != 0) {
+                ca_free(l);
+                return NULL;
+        }
+
+        return l;
+}
+
+void ca_rwlock_free(ca_rwlock *l) {
+        ca_assert(l);
+
+        ca_assert_se(pthread_rwlock_destroy(&l->rwlock) == 0);
+        ca_free(l);
+}
+
+void ca_rwlock_rdlock(ca_rwlock *l) {
+        ca_assert(l);
+
+        ca_assert_se(pthread_rwlock_rdlock(&l->rwlock) == 0);
+}
+
+void ca_rwlock_wrlock(ca_rwlock *l) {
+        ca_assert(l);
+
+        ca_assert_se(pthread_rwlock_wrlock(&l->rwlock) == 0);
+}
+
+void ca_rwlock_unlock(ca_rwlock *l) {
+        ca_assert(l);
+
+        ca_assert_se(pthread_rwlock_unlock(&l->rwlock) == 0);
+}
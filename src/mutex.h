@@ -34,4 +34,24 @@ void ca_mutex_lock(ca_mutex *m);
 ca_bool_t ca_mutex_try_lock(ca_mutex *m);
 void ca_mutex_unlock(ca_mutex *m);
 
+typedef struct ca_cond ca_cond;
+
+ca_cond *ca_cond_new(void);
+void ca_cond_free(ca_cond *c);
+
+void ca_cond_signal(ca_cond *c, ca_bool_t broadcast);
+void ca_cond_wait(ca_cond *c, ca_mutex *m);
+
+/* Returns FALSE if the condition was not signalled within msec */
+ca_bool_t ca_cond_timedwait(ca_cond *c, ca_mutex *m, unsigned msec);
+
+typedef struct ca_rwlock ca_rwlock;
+
+ca_rwlock *ca_rwlock_new(void);
+void ca_rwlock_free(ca_rwlock *l);
+
+void ca_rwlock_rdlock(ca_rwlock *l);
+void ca_rwlock_wrlock(ca_rwlock *l);
+void ca_rwlock_unlock(ca_rwlock *l);
+
 #endif
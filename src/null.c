@@ -68,12 +68,28 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         return CA_SUCCESS;
 }
 
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+
+        return ca_play_many_each(c, r, n, driver_play);
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
 
         return CA_SUCCESS;
 }
 
+int driver_playing(ca_context *c, uint32_t id, int *playing) {
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(playing, CA_ERROR_INVALID);
+
+        /* Our sounds are over as soon as they started */
+        *playing = 0;
+
+        return CA_SUCCESS;
+}
+
 int driver_cache(ca_context *c, ca_proplist *proplist) {
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -55,18 +56,33 @@
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
 #include "malloc.h"
+#include "id-table.h"
+#include "player-pool.h"
 
 struct private;
 
 struct outstanding {
         CA_LLIST_FIELDS(struct outstanding);
+        ca_id_link by_id;
         ca_bool_t dead;
         uint32_t id;
         ca_finish_callback_t callback;
         void *userdata;
         ca_sound_file *file;
         int pcm;
-        int pipe_fd[2];
+        uint32_t latency;
+        /* The beginning of the sound, decoded while the device was
+         * being opened */
+        void *predecoded;
+        size_t n_predecoded, predecoded_index;
+        /* Fed by a worker of the player pool */
+        ca_playback playback;
+        size_t fs;
+        void *data, *d;
+        size_t nbytes;
+        /* Everything has been written, we only wait for the device to
+         * play it */
+        ca_bool_t draining;
         ca_context *context;
 };
 
@@ -77,6 +93,7 @@ struct private {
         sem_t semaphore;
         ca_bool_t semaphore_allocated;
         CA_LLIST_HEAD(struct outstanding, outstanding);
+        ca_id_table outstanding_by_id;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -84,12 +101,6 @@ struct private {
 static void outstanding_free(struct outstanding *o) {
         ca_assert(o);
 
-        if (o->pipe_fd[1] >= 0)
-                close(o->pipe_fd[1]);
-
-        if (o->pipe_fd[0] >= 0)
-                close(o->pipe_fd[0]);
-
         if (o->file)
                 ca_sound_file_close(o->file);
 
@@ -98,6 +109,8 @@ static void outstanding_free(struct outstanding *o) {
                 o->pcm = -1;
         }
 
+        ca_free(o->predecoded);
+        ca_free(o->data);
         ca_free(o);
 }
 
@@ -116,6 +129,11 @@ int driver_open(ca_context *c) {
                 return CA_ERROR_OOM;
         }
 
+        if (ca_id_table_init(&p->outstanding_by_id) < 0) {
+                driver_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
         if (sem_init(&p->semaphore, 0, 0) < 0) {
                 driver_destroy(c);
                 return CA_ERROR_OOM;
@@ -149,11 +167,8 @@ int driver_destroy(ca_context *c) {
                         if (out->callback)
                                 out->callback(c, out->id, CA_ERROR_DESTROYED, out->userdata);
 
-                        /* This will cause the thread to wakeup and terminate */
-                        if (out->pipe_fd[1] >= 0) {
-                                close(out->pipe_fd[1]);
-                                out->pipe_fd[1] = -1;
-                        }
+                        /* This will cause the worker to drop the sound */
+                        ca_player_pool_wakeup(&out->playback);
                 }
 
                 if (p->semaphore_allocated) {
@@ -170,6 +185,8 @@ int driver_destroy(ca_context *c) {
                 ca_mutex_free(p->outstanding_mutex);
         }
 
+        ca_id_table_done(&p->outstanding_by_id);
+
         if (p->theme)
                 ca_theme_data_free(p->theme);
 
@@ -229,27 +246,62 @@ static int translate_error(int error) {
         }
 }
 
+static void set_fragments(struct outstanding *out) {
+        int val;
+        unsigned shift;
+        uint64_t bytes;
+
+        if (out->latency == CA_LATENCY_DEFAULT)
+                return;
+
+        if (out->latency == CA_LATENCY_POWERSAVE)
+                /* As many 64K fragments as the driver is willing to give
+                 * us */
+                val = (0x7fff << 16) | 16;
+        else {
+                /* Two fragments, so that one can be refilled while the
+                 * other one is played */
+                bytes = (uint64_t) out->latency * ca_sound_file_get_rate(out->file) * ca_sound_file_frame_size(out->file) / 1000000 / 2;
+
+                for (shift = 4; shift < 16 && ((uint64_t) 1 << shift) < bytes; shift++)
+                        ;
+
+                val = (2 << 16) | (int) shift;
+        }
+
+        /* This is only a hint, if the driver cannot do it we just go
+         * on with its defaults */
+        ioctl(out->pcm, SNDCTL_DSP_SETFRAGMENT, &val);
+}
+
+/* Opening the device doesn't depend on the sound, so this may be
+ * done while the sound is still being looked up. The device stays in
+ * non-blocking mode, since the worker feeding it must never block. */
+static int open_dsp(ca_context *c, struct outstanding *out) {
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(out, CA_ERROR_INVALID);
+
+        if ((out->pcm = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
+                return translate_error(errno);
+
+        return CA_SUCCESS;
+}
+
 static int open_oss(ca_context *c, struct outstanding *out) {
-        int mode, val, test, ret;
+        int val, test, ret;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
         ca_return_val_if_fail(out, CA_ERROR_INVALID);
+        ca_return_val_if_fail(out->pcm >= 0, CA_ERROR_STATE);
 
         /* In OSS we have no way to configure a channel mapping for
          * multichannel streams. We cannot support those files hence */
         ca_return_val_if_fail(ca_sound_file_get_nchannels(out->file) <= 2, CA_ERROR_NOTSUPPORTED);
 
-        if ((out->pcm = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
-                goto finish_errno;
-
-        if ((mode = fcntl(out->pcm, F_GETFL)) < 0)
-                goto finish_errno;
-
-        mode &= ~O_NONBLOCK;
-
-        if (fcntl(out->pcm, F_SETFL, mode) < 0)
-                goto finish_errno;
+        /* Needs to be set before the sample format */
+        set_fragments(out);
 
         switch (ca_sound_file_get_sample_type(out->file)) {
         case CA_SAMPLE_U8:
@@ -307,89 +359,149 @@ finish_ret:
 
 #define BUFSIZE (4*1024)
 
-static void* thread_func(void *userdata) {
-        struct outstanding *out = userdata;
+/* How much of a sound we decode while the device is being opened */
+#define PREDECODE_USEC (20*1000)
+
+static int predecode(struct outstanding *out) {
+        size_t nbytes;
         int ret;
-        void *data, *d = NULL;
-        size_t fs, data_size;
-        size_t nbytes = 0;
-        struct pollfd pfd[2];
-        nfds_t n_pfd = 2;
-        struct private *p;
 
-        p = PRIVATE(out->context);
+        nbytes = CA_MAX((size_t) ((uint64_t) ca_sound_file_get_rate(out->file) * PREDECODE_USEC / 1000000ULL), 1U) * ca_sound_file_frame_size(out->file);
 
-        pthread_detach(pthread_self());
+        if (!(out->predecoded = ca_malloc(nbytes)))
+                return CA_ERROR_OOM;
 
-        fs = ca_sound_file_frame_size(out->file);
-        data_size = (BUFSIZE/fs)*fs;
+        if ((ret = ca_sound_file_read_arbitrary(out->file, out->predecoded, &nbytes)) < 0)
+                return ret;
 
-        if (!(data = ca_malloc(data_size))) {
-                ret = CA_ERROR_OOM;
-                goto finish;
+        out->n_predecoded = nbytes;
+        return CA_SUCCESS;
+}
+
+/* Like ca_sound_file_read_arbitrary(), but hands out what has been
+ * decoded in advance first */
+static int read_sound(struct outstanding *out, void *d, size_t *nbytes) {
+
+        if (out->predecoded_index < out->n_predecoded) {
+                size_t n;
+
+                n = CA_MIN(*nbytes, out->n_predecoded - out->predecoded_index);
+                memcpy(d, (uint8_t*) out->predecoded + out->predecoded_index, n);
+                out->predecoded_index += n;
+
+                *nbytes = n;
+                return CA_SUCCESS;
+        }
+
+        return ca_sound_file_read_arbitrary(out->file, d, nbytes);
+}
+
+/* How many bytes the device still has to play, or 0 if we cannot tell */
+static size_t get_delay(struct outstanding *out) {
+        int delay;
+
+        if (ioctl(out->pcm, SNDCTL_DSP_GETODELAY, &delay) < 0 || delay <= 0)
+                return 0;
+
+        return (size_t) delay;
+}
+
+static int playback_prepare(ca_playback *pb, struct pollfd *pfd, int *timeout) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+
+        if (out->draining) {
+                int t;
+
+                /* Wake up when the device should be done */
+                t = (int) ((uint64_t) get_delay(out) * 1000 / (ca_sound_file_get_rate(out->file) * out->fs)) + 1;
+
+                if (*timeout < 0 || t < *timeout)
+                        *timeout = t;
+
+                return 0;
         }
 
-        pfd[0].fd = out->pipe_fd[0];
-        pfd[0].events = POLLIN;
+        pfd[0].fd = out->pcm;
+        pfd[0].events = POLLOUT;
         pfd[0].revents = 0;
-        pfd[1].fd = out->pcm;
-        pfd[1].events = POLLOUT;
-        pfd[1].revents = 0;
 
-        for (;;) {
-                ssize_t bytes_written;
+        return 1;
+}
 
-                if (out->dead)
-                        break;
+static int playback_dispatch(ca_playback *pb, struct pollfd *pfd, unsigned n) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+        ssize_t bytes_written;
+        int ret;
 
-                if (poll(pfd, n_pfd, -1) < 0) {
-                        ret = CA_ERROR_SYSTEM;
-                        goto finish;
-                }
+        /* We have been asked to shut down */
+        if (out->dead)
+                return 1;
 
-                /* We have been asked to shut down */
-                if (pfd[0].revents)
-                        break;
+        if (out->draining)
+                return get_delay(out) > 0 ? 0 : 1;
 
-                if (pfd[1].revents != POLLOUT) {
-                        ret = CA_ERROR_IO;
-                        goto finish;
-                }
+        /* The wakeup was for somebody else */
+        if (!pfd[0].revents)
+                return 0;
 
-                if (nbytes <= 0) {
-                        nbytes = data_size;
+        if (pfd[0].revents != POLLOUT)
+                return CA_ERROR_IO;
+
+        /* Write until the buffer is full */
+        for (;;) {
+
+                if (out->nbytes <= 0) {
+                        out->nbytes = BUFSIZE/out->fs*out->fs;
 
-                        if ((ret = ca_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
-                                goto finish;
+                        if ((ret = read_sound(out, out->data, &out->nbytes)) < 0)
+                                return ret;
 
-                        d = data;
+                        out->d = out->data;
                 }
 
-                if (nbytes <= 0)
-                        break;
+                if (out->nbytes <= 0) {
+                        out->draining = TRUE;
+                        return 0;
+                }
+
+                if ((bytes_written = write(out->pcm, out->d, out->nbytes)) <= 0) {
+
+                        if (bytes_written < 0 && errno == EAGAIN)
+                                return 0;
 
-                if ((bytes_written = write(out->pcm, d, nbytes)) <= 0) {
-                        ret = translate_error(errno);
-                        goto finish;
+                        return translate_error(errno);
                 }
 
-                nbytes -= (size_t) bytes_written;
-                d = (uint8_t*) d + (size_t) bytes_written;
+                out->nbytes -= (size_t) bytes_written;
+                out->d = (uint8_t*) out->d + (size_t) bytes_written;
+
+                if (out->nbytes > 0)
+                        return 0;
         }
+}
 
-        ret = CA_SUCCESS;
+static void playback_finish(ca_playback *pb, int ret) {
+        struct outstanding *out = CA_PLAYBACK_ENTRY(pb, struct outstanding, playback);
+        struct private *p;
+        ca_bool_t dead;
 
-finish:
+        p = PRIVATE(out->context);
 
-        ca_free(data);
+        /* driver_cancel() might be calling back right now, the flag
+         * decides who does it */
+        ca_mutex_lock(p->outstanding_mutex);
+        dead = out->dead;
+        out->dead = TRUE;
+        ca_mutex_unlock(p->outstanding_mutex);
 
-        if (!out->dead)
+        if (!dead)
                 if (out->callback)
                         out->callback(out->context, out->id, ret, out->userdata);
 
         ca_mutex_lock(p->outstanding_mutex);
 
         CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
 
         if (!p->outstanding && p->signal_semaphore)
                 sem_post(&p->semaphore);
@@ -397,15 +509,27 @@ finish:
         outstanding_free(out);
 
         ca_mutex_unlock(p->outstanding_mutex);
+}
 
-        return NULL;
+struct open_job {
+        ca_player_job job;
+        ca_context *context;
+        struct outstanding *out;
+        int ret;
+};
+
+static void open_job_run(ca_player_job *job) {
+        struct open_job *j = CA_PLAYER_JOB_ENTRY(job, struct open_job, job);
+
+        j->ret = open_dsp(j->context, j->out);
 }
 
 int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
         struct private *p;
         struct outstanding *out = NULL;
+        struct open_job job;
+        ca_bool_t queued;
         int ret;
-        pthread_t thread;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(proplist, CA_ERROR_INVALID);
@@ -423,30 +547,62 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         out->id = id;
         out->callback = cb;
         out->userdata = userdata;
-        out->pipe_fd[0] = out->pipe_fd[1] = -1;
         out->pcm = -1;
 
-        if (pipe(out->pipe_fd) < 0) {
-                ret = CA_ERROR_SYSTEM;
+        if ((ret = ca_get_latency(c, proplist, &out->latency)) < 0)
                 goto finish;
-        }
 
-        if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
+        if ((ret = ca_get_realtime(c, proplist, &out->playback.realtime)) < 0)
+                goto finish;
+
+        /* Opening the device may take a while, so we leave it to a
+         * helper of the pool while we look up the sound and decode its
+         * beginning */
+        memset(&job, 0, sizeof(job));
+        job.job.run = open_job_run;
+        job.context = c;
+        job.out = out;
+        queued = ca_player_pool_run(&job.job) == CA_SUCCESS;
+
+        if ((ret = ca_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) == CA_SUCCESS)
+                ret = predecode(out);
+
+        if (queued)
+                ca_player_pool_wait(&job.job);
+        else if (ret == CA_SUCCESS)
+                job.ret = open_dsp(c, out);
+
+        if (ret < 0)
+                goto finish;
+
+        if ((ret = job.ret) < 0)
                 goto finish;
 
         if ((ret = open_oss(c, out)) < 0)
                 goto finish;
 
+        out->fs = ca_sound_file_frame_size(out->file);
+
+        if (!(out->data = ca_malloc(BUFSIZE))) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+        }
+
+        out->playback.n_pollfd = 1;
+        out->playback.prepare = playback_prepare;
+        out->playback.dispatch = playback_dispatch;
+        out->playback.finish = playback_finish;
+
         /* OK, we're ready to go, so let's add this to our list */
         ca_mutex_lock(p->outstanding_mutex);
         CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        ca_id_table_put(&p->outstanding_by_id, &out->by_id, out->id);
         ca_mutex_unlock(p->outstanding_mutex);
 
-        if (pthread_create(&thread, NULL, thread_func, out) < 0) {
-                ret = CA_ERROR_OOM;
-
+        if ((ret = ca_player_pool_add(&out->playback)) < 0) {
                 ca_mutex_lock(p->outstanding_mutex);
                 CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                ca_id_table_remove(&p->outstanding_by_id, &out->by_id);
                 ca_mutex_unlock(p->outstanding_mutex);
 
                 goto finish;
@@ -463,9 +619,17 @@ finish:
         return ret;
 }
 
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        return ca_play_many_each(c, r, n, driver_play);
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         struct private *p;
         struct outstanding *out;
+        ca_id_link *l;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -474,10 +638,8 @@ int driver_cancel(ca_context *c, uint32_t id) {
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
-
-                if (out->id != id)
-                        continue;
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
                 if (out->dead)
                         continue;
@@ -487,11 +649,8 @@ int driver_cancel(ca_context *c, uint32_t id) {
                 if (out->callback)
                         out->callback(c, out->id, CA_ERROR_CANCELED, out->userdata);
 
-                /* This will cause the thread to wakeup and terminate */
-                if (out->pipe_fd[1] >= 0) {
-                        close(out->pipe_fd[1]);
-                        out->pipe_fd[1] = -1;
-                }
+                /* This will cause the worker to drop the sound */
+                ca_player_pool_wakeup(&out->playback);
         }
 
         ca_mutex_unlock(p->outstanding_mutex);
@@ -502,6 +661,7 @@ int driver_cancel(ca_context *c, uint32_t id) {
 int driver_playing(ca_context *c, uint32_t id, int *playing) {
         struct private *p;
         struct outstanding *out;
+        ca_id_link *l;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -513,10 +673,10 @@ int driver_playing(ca_context *c, uint32_t id, int *playing) {
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
-                if (out->dead ||
-                    out->id != id)
+                if (out->dead)
                         continue;
 
                 *playing = 1;
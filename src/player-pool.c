@@ -0,0 +1,567 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "canberra.h"
+#include "player-pool.h"
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+#include "realtime.h"
+
+/* We never run more than this many workers. Another one is only
+ * started when all of them are busy with this many playbacks. */
+#define WORKERS_MAX 4
+#define WORKER_PLAYBACKS 4
+
+/* The workers only decode and copy data around, so they don't need
+ * the default stack of several MB */
+#define WORKER_STACK_SIZE (256*1024)
+
+/* How long an idle worker waits for more work before it exits */
+#define WORKER_IDLE_MSEC (5*1000)
+
+/* Jobs are run by at most this many helpers, everything beyond that
+ * waits or is run by whoever waits for it. Opening many devices at
+ * the same time is not going to make any of them faster. */
+#define HELPERS_MAX 2
+
+struct ca_player_worker {
+        CA_LLIST_FIELDS(struct ca_player_worker);
+
+        /* Used to wake the worker up: an eventfd if available, a pipe
+         * otherwise */
+        int wakeup_fd[2];
+
+        /* Playbacks that have been added but not been picked up by the
+         * worker yet */
+        CA_LLIST_HEAD(ca_playback, incoming);
+
+        /* Including the incoming ones */
+        unsigned n_playbacks;
+
+        /* Only accessed by the worker itself */
+        ca_bool_t realtime;
+};
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *mutex = NULL;
+static CA_LLIST_HEAD(struct ca_player_worker, workers) = NULL;
+static unsigned n_workers = 0;
+
+/* Signalled when a job is queued, resp. when one is done */
+static ca_cond *job_cond = NULL, *done_cond = NULL;
+static CA_LLIST_HEAD(ca_player_job, jobs) = NULL;
+static unsigned n_helpers = 0, n_idle_helpers = 0;
+
+static void worker_free(struct ca_player_worker *w);
+
+/* Keeps the worker list consistent across fork() */
+static void atfork_prepare(void) {
+        ca_mutex_lock(mutex);
+}
+
+static void atfork_parent(void) {
+        ca_mutex_unlock(mutex);
+}
+
+/* The threads of the workers don't exist in the child, so forget
+ * about them and start new ones when needed. The playbacks they had
+ * belong to contexts that cannot be used after fork() anyway. */
+static void atfork_child(void) {
+        struct ca_player_worker *w;
+
+        while ((w = workers)) {
+                CA_LLIST_REMOVE(struct ca_player_worker, workers, w);
+                worker_free(w);
+        }
+
+        n_workers = 0;
+
+        /* The same goes for the helpers. Their conditions might still
+         * count them as waiters, so we leave them behind. */
+        jobs = NULL;
+        n_helpers = n_idle_helpers = 0;
+        job_cond = ca_cond_new();
+        done_cond = ca_cond_new();
+
+        ca_mutex_unlock(mutex);
+}
+
+static void allocate_mutex_once(void) {
+        if (!(mutex = ca_mutex_new()))
+                return;
+
+        job_cond = ca_cond_new();
+        done_cond = ca_cond_new();
+
+        /* If this fails we only get confused after fork() */
+        pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+static int allocate_mutex(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        if (pthread_once(&once, allocate_mutex_once) != 0)
+                return CA_ERROR_OOM;
+
+        if (!mutex || !job_cond || !done_cond)
+                return CA_ERROR_OOM;
+
+        return 0;
+}
+
+static int wakeup_open(struct ca_player_worker *w) {
+
+#ifdef HAVE_SYS_EVENTFD_H
+        if ((w->wakeup_fd[0] = w->wakeup_fd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+                return CA_ERROR_SYSTEM;
+#else
+        if (pipe(w->wakeup_fd) < 0)
+                return CA_ERROR_SYSTEM;
+
+        if (fcntl(w->wakeup_fd[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(w->wakeup_fd[1], F_SETFL, O_NONBLOCK) < 0)
+                return CA_ERROR_SYSTEM;
+#endif
+
+        return CA_SUCCESS;
+}
+
+static void wakeup_close(struct ca_player_worker *w) {
+
+        if (w->wakeup_fd[1] >= 0 && w->wakeup_fd[1] != w->wakeup_fd[0])
+                close(w->wakeup_fd[1]);
+
+        if (w->wakeup_fd[0] >= 0)
+                close(w->wakeup_fd[0]);
+
+        w->wakeup_fd[0] = w->wakeup_fd[1] = -1;
+}
+
+static void wakeup_signal(struct ca_player_worker *w) {
+#ifdef HAVE_SYS_EVENTFD_H
+        uint64_t u = 1;
+#else
+        char u = 'x';
+#endif
+
+        /* If this fails the worker has been woken up already */
+        (void) write(w->wakeup_fd[1], &u, sizeof(u));
+}
+
+static void wakeup_clear(struct ca_player_worker *w) {
+        uint64_t buf[8];
+
+        while (read(w->wakeup_fd[0], buf, sizeof(buf)) > 0)
+                ;
+}
+
+static void worker_free(struct ca_player_worker *w) {
+        ca_assert(w);
+
+        wakeup_close(w);
+        ca_free(w);
+}
+
+/* Takes the pool mutex */
+static void worker_done(ca_playback *pb, int ret) {
+        ca_mutex_lock(mutex);
+        pb->worker->n_playbacks--;
+        ca_mutex_unlock(mutex);
+
+        pb->finish(pb, ret);
+}
+
+static void* worker_func(void *userdata) {
+        struct ca_player_worker *w = userdata;
+        CA_LLIST_HEAD(ca_playback, playbacks) = NULL;
+        struct pollfd *pfd = NULL;
+        unsigned n_allocated = 0;
+
+        for (;;) {
+                ca_playback *pb, *n;
+                unsigned n_pfd, k;
+                int timeout, r;
+                ca_bool_t realtime;
+
+                /* Pick up new work, or go away if there is none */
+                ca_mutex_lock(mutex);
+
+                while ((pb = w->incoming)) {
+                        CA_LLIST_REMOVE(ca_playback, w->incoming, pb);
+                        CA_LLIST_PREPEND(ca_playback, playbacks, pb);
+                }
+
+                ca_mutex_unlock(mutex);
+
+                n_pfd = 1;
+                realtime = FALSE;
+                for (pb = playbacks; pb; pb = pb->next) {
+                        n_pfd += pb->n_pollfd;
+                        realtime = realtime || pb->realtime;
+                }
+
+                /* We are shared, so we only run with real-time
+                 * scheduling for as long as a playback asks for it */
+                if (realtime != w->realtime) {
+                        if (realtime)
+                                ca_realtime_request();
+                        else
+                                ca_realtime_drop();
+
+                        w->realtime = realtime;
+                }
+
+                if (n_pfd > n_allocated) {
+                        ca_free(pfd);
+
+                        if (!(pfd = ca_new(struct pollfd, n_pfd))) {
+                                n_allocated = 0;
+
+                                while ((pb = playbacks)) {
+                                        CA_LLIST_REMOVE(ca_playback, playbacks, pb);
+                                        worker_done(pb, CA_ERROR_OOM);
+                                }
+
+                                continue;
+                        }
+
+                        n_allocated = n_pfd;
+                }
+
+                pfd[0].fd = w->wakeup_fd[0];
+                pfd[0].events = POLLIN;
+                pfd[0].revents = 0;
+
+                timeout = playbacks ? -1 : WORKER_IDLE_MSEC;
+
+                for (pb = playbacks, k = 1; pb; pb = n) {
+                        n = pb->next;
+
+                        if ((r = pb->prepare(pb, pfd + k, &timeout)) < 0) {
+                                CA_LLIST_REMOVE(ca_playback, playbacks, pb);
+                                worker_done(pb, r);
+                                continue;
+                        }
+
+                        ca_assert((unsigned) r <= pb->n_pollfd);
+                        pb->n_prepared = (unsigned) r;
+                        k += (unsigned) r;
+                }
+
+                if ((r = poll(pfd, k, timeout)) < 0) {
+
+                        if (errno == EINTR)
+                                continue;
+
+                        while ((pb = playbacks)) {
+                                CA_LLIST_REMOVE(ca_playback, playbacks, pb);
+                                worker_done(pb, CA_ERROR_SYSTEM);
+                        }
+
+                        continue;
+                }
+
+                if (pfd[0].revents)
+                        wakeup_clear(w);
+
+                if (!playbacks) {
+
+                        if (r > 0)
+                                continue;
+
+                        /* We have been idle for a while, so unless we
+                         * got new work in the meantime let's exit */
+                        ca_mutex_lock(mutex);
+
+                        if (!w->incoming) {
+                                CA_LLIST_REMOVE(struct ca_player_worker, workers, w);
+                                n_workers--;
+                                ca_mutex_unlock(mutex);
+                                break;
+                        }
+
+                        ca_mutex_unlock(mutex);
+                        continue;
+                }
+
+                for (pb = playbacks, k = 1; pb; pb = n) {
+                        n = pb->next;
+
+                        r = pb->dispatch(pb, pfd + k, pb->n_prepared);
+                        k += pb->n_prepared;
+
+                        if (r == 0)
+                                continue;
+
+                        CA_LLIST_REMOVE(ca_playback, playbacks, pb);
+                        worker_done(pb, r > 0 ? CA_SUCCESS : r);
+                }
+        }
+
+        ca_free(pfd);
+        worker_free(w);
+
+        return NULL;
+}
+
+static int thread_create(pthread_t *thread, void* (*func)(void *userdata), void *userdata, ca_bool_t detached) {
+        pthread_attr_t attr;
+        size_t stack_size;
+        int r;
+
+        if (pthread_attr_init(&attr) != 0)
+                return -1;
+
+        stack_size = WORKER_STACK_SIZE;
+#ifdef PTHREAD_STACK_MIN
+        stack_size = CA_MAX(stack_size, (size_t) PTHREAD_STACK_MIN);
+#endif
+
+        pthread_attr_setstacksize(&attr, stack_size);
+
+        if (detached)
+                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        r = pthread_create(thread, &attr, func, userdata);
+        pthread_attr_destroy(&attr);
+
+        return r == 0 ? 0 : -1;
+}
+
+/* Needs the pool mutex */
+static struct ca_player_worker* worker_new(void) {
+        struct ca_player_worker *w;
+        pthread_t thread;
+
+        if (!(w = ca_new0(struct ca_player_worker, 1)))
+                return NULL;
+
+        w->wakeup_fd[0] = w->wakeup_fd[1] = -1;
+
+        if (wakeup_open(w) < 0)
+                goto fail;
+
+        if (thread_create(&thread, worker_func, w, TRUE) < 0)
+                goto fail;
+
+        CA_LLIST_PREPEND(struct ca_player_worker, workers, w);
+        n_workers++;
+
+        return w;
+
+fail:
+        worker_free(w);
+        return NULL;
+}
+
+int ca_player_pool_add(ca_playback *pb) {
+        struct ca_player_worker *w, *best = NULL;
+        int ret;
+
+        ca_return_val_if_fail(pb, CA_ERROR_INVALID);
+        ca_return_val_if_fail(pb->prepare, CA_ERROR_INVALID);
+        ca_return_val_if_fail(pb->dispatch, CA_ERROR_INVALID);
+        ca_return_val_if_fail(pb->finish, CA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        ca_mutex_lock(mutex);
+
+        for (w = workers; w; w = w->next)
+                if (!best || w->n_playbacks < best->n_playbacks)
+                        best = w;
+
+        /* If we cannot start another worker, the busy ones will have
+         * to take more */
+        if ((!best || best->n_playbacks >= WORKER_PLAYBACKS) && n_workers < WORKERS_MAX)
+                if ((w = worker_new()))
+                        best = w;
+
+        if (!best) {
+                ca_mutex_unlock(mutex);
+                return CA_ERROR_OOM;
+        }
+
+        pb->worker = best;
+        pb->n_prepared = 0;
+        best->n_playbacks++;
+        CA_LLIST_PREPEND(ca_playback, best->incoming, pb);
+
+        wakeup_signal(best);
+
+        ca_mutex_unlock(mutex);
+
+        return CA_SUCCESS;
+}
+
+int ca_player_pool_spawn(pthread_t *thread, void* (*func)(void *userdata), void *userdata) {
+        ca_return_val_if_fail(thread, CA_ERROR_INVALID);
+        ca_return_val_if_fail(func, CA_ERROR_INVALID);
+
+        if (thread_create(thread, func, userdata, FALSE) < 0)
+                return CA_ERROR_OOM;
+
+        return CA_SUCCESS;
+}
+
+/* Needs the pool mutex. Jobs are queued at the head, so the oldest one
+ * is at the tail. */
+static ca_player_job* job_oldest(void) {
+        ca_player_job *j;
+
+        if (!(j = jobs))
+                return NULL;
+
+        while (j->next)
+                j = j->next;
+
+        return j;
+}
+
+static void* helper_func(void *userdata) {
+        ca_player_job *j;
+
+        ca_mutex_lock(mutex);
+
+        for (;;) {
+
+                if (!(j = job_oldest())) {
+                        ca_bool_t signalled;
+
+                        n_idle_helpers++;
+                        signalled = ca_cond_timedwait(job_cond, mutex, WORKER_IDLE_MSEC);
+                        n_idle_helpers--;
+
+                        /* Idle for a while, so let's exit */
+                        if (!signalled && !jobs)
+                                break;
+
+                        continue;
+                }
+
+                CA_LLIST_REMOVE(ca_player_job, jobs, j);
+                j->queued = FALSE;
+
+                ca_mutex_unlock(mutex);
+                j->run(j);
+                ca_mutex_lock(mutex);
+
+                /* The job may be freed as soon as we signal this */
+                j->done = TRUE;
+                ca_cond_signal(done_cond, TRUE);
+        }
+
+        n_helpers--;
+
+        ca_mutex_unlock(mutex);
+
+        return NULL;
+}
+
+int ca_player_pool_run(ca_player_job *j) {
+        pthread_t thread;
+        int ret;
+
+        ca_return_val_if_fail(j, CA_ERROR_INVALID);
+        ca_return_val_if_fail(j->run, CA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        ca_mutex_lock(mutex);
+
+        j->done = FALSE;
+        j->queued = TRUE;
+        CA_LLIST_PREPEND(ca_player_job, jobs, j);
+
+        if (n_idle_helpers > 0)
+                ca_cond_signal(job_cond, FALSE);
+
+        /* If we cannot start another helper, the job waits for one of
+         * the busy ones, or for ca_player_pool_wait() to run it */
+        else if (n_helpers < HELPERS_MAX) {
+                if (thread_create(&thread, helper_func, NULL, TRUE) == 0)
+                        n_helpers++;
+                else if (n_helpers <= 0) {
+                        CA_LLIST_REMOVE(ca_player_job, jobs, j);
+                        j->queued = FALSE;
+                        ret = CA_ERROR_OOM;
+                }
+        }
+
+        ca_mutex_unlock(mutex);
+
+        return ret;
+}
+
+void ca_player_pool_wait(ca_player_job *j) {
+        ca_return_if_fail(j);
+
+        ca_mutex_lock(mutex);
+
+        /* Rather than waiting for a helper to get to it, run it here */
+        if (j->queued) {
+                CA_LLIST_REMOVE(ca_player_job, jobs, j);
+                j->queued = FALSE;
+
+                ca_mutex_unlock(mutex);
+                j->run(j);
+                return;
+        }
+
+        while (!j->done)
+                ca_cond_wait(done_cond, mutex);
+
+        ca_mutex_unlock(mutex);
+}
+
+void ca_player_pool_wakeup(ca_playback *pb) {
+        ca_return_if_fail(pb);
+
+        if (allocate_mutex() < 0)
+                return;
+
+        ca_mutex_lock(mutex);
+
+        if (pb->worker)
+                wakeup_signal(pb->worker);
+
+        ca_mutex_unlock(mutex);
+}
@@ -0,0 +1,102 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef foocanberraplayerpoolhfoo
+#define foocanberraplayerpoolhfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "llist.h"
+#include "macro.h"
+
+/* A small set of worker threads, shared by all contexts, for the
+ * drivers that feed the audio device themselves. Each worker waits for
+ * all of its playbacks in a single poll() loop. */
+
+typedef struct ca_playback ca_playback;
+
+struct ca_playback {
+        /* Fills in at most n_pollfd descriptors to wait for and returns
+         * how many, or a negative error. May lower *timeout, which is
+         * in msec, -1 meaning forever. */
+        int (*prepare)(ca_playback *pb, struct pollfd *pfd, int *timeout);
+
+        /* Called after every wakeup of the worker, with the descriptors
+         * filled in by prepare(). Returns 0 to go on, 1 when the
+         * playback is over, or a negative error. */
+        int (*dispatch)(ca_playback *pb, struct pollfd *pfd, unsigned n);
+
+        /* Called once when the playback is over, with CA_SUCCESS or the
+         * error. The playback may be freed from here. */
+        void (*finish)(ca_playback *pb, int ret);
+
+        unsigned n_pollfd;
+
+        /* Whether the worker should ask for real-time scheduling. It
+         * gives it up again once none of its playbacks needs it. */
+        ca_bool_t realtime;
+
+        /* Private to the pool */
+        CA_LLIST_FIELDS(ca_playback);
+        struct ca_player_worker *worker;
+        unsigned n_prepared;
+};
+
+#define CA_PLAYBACK_ENTRY(pb, type, member) ((type*) ((char*) (pb) - offsetof(type, member)))
+
+int ca_player_pool_add(ca_playback *pb);
+
+/* Starts a joinable thread with the same small stack as the workers,
+ * for helpers of a backend that live longer than a single job */
+int ca_player_pool_spawn(pthread_t *thread, void* (*func)(void *userdata), void *userdata);
+
+typedef struct ca_player_job ca_player_job;
+
+/* A short blocking job, such as opening a device, that one of a few
+ * helper threads of the pool runs while the caller goes on with
+ * something else */
+struct ca_player_job {
+        void (*run)(ca_player_job *j);
+
+        /* Private to the pool */
+        CA_LLIST_FIELDS(ca_player_job);
+        ca_bool_t queued;
+        ca_bool_t done;
+};
+
+#define CA_PLAYER_JOB_ENTRY(j, type, member) ((type*) ((char*) (j) - offsetof(type, member)))
+
+/* Queues the job for the helpers. If this fails the caller has to run
+ * it itself. */
+int ca_player_pool_run(ca_player_job *j);
+
+/* Waits until the job has been run. If no helper has picked it up yet,
+ * it is run on the calling thread. */
+void ca_player_pool_wait(ca_player_job *j);
+
+/* Makes the worker of the playback call its dispatch() function, for
+ * example after the playback has been canceled */
+void ca_player_pool_wakeup(ca_playback *pb);
+
+#endif
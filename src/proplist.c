@@ -25,12 +25,73 @@
 #endif
 
 #include <stdarg.h>
+#include <stdlib.h>
 
 #include "canberra.h"
 #include "proplist.h"
 #include "macro.h"
 #include "malloc.h"
 
+#define ARENA_BLOCK_SIZE 512
+#define ARENA_COMPACT_MIN 4096
+
+/* Sorted by name, for bsearch() */
+static const char * const atom_names[_CA_ATOM_MAX] = {
+        [CA_ATOM_APPLICATION_ICON] = CA_PROP_APPLICATION_ICON,
+        [CA_ATOM_APPLICATION_ICON_NAME] = CA_PROP_APPLICATION_ICON_NAME,
+        [CA_ATOM_APPLICATION_ID] = CA_PROP_APPLICATION_ID,
+        [CA_ATOM_APPLICATION_LANGUAGE] = CA_PROP_APPLICATION_LANGUAGE,
+        [CA_ATOM_APPLICATION_NAME] = CA_PROP_APPLICATION_NAME,
+        [CA_ATOM_APPLICATION_PROCESS_BINARY] = CA_PROP_APPLICATION_PROCESS_BINARY,
+        [CA_ATOM_APPLICATION_PROCESS_HOST] = CA_PROP_APPLICATION_PROCESS_HOST,
+        [CA_ATOM_APPLICATION_PROCESS_ID] = CA_PROP_APPLICATION_PROCESS_ID,
+        [CA_ATOM_APPLICATION_PROCESS_USER] = CA_PROP_APPLICATION_PROCESS_USER,
+        [CA_ATOM_APPLICATION_VERSION] = CA_PROP_APPLICATION_VERSION,
+        [CA_ATOM_CANBERRA_CACHE_CONTROL] = CA_PROP_CANBERRA_CACHE_CONTROL,
+        [CA_ATOM_CANBERRA_ENABLE] = CA_PROP_CANBERRA_ENABLE,
+        [CA_ATOM_CANBERRA_FORCE_CHANNEL] = CA_PROP_CANBERRA_FORCE_CHANNEL,
+        [CA_ATOM_CANBERRA_LATENCY] = CA_PROP_CANBERRA_LATENCY,
+        [CA_ATOM_CANBERRA_MAX_PLAYING] = CA_PROP_CANBERRA_MAX_PLAYING,
+        [CA_ATOM_CANBERRA_MAX_VOICES] = CA_PROP_CANBERRA_MAX_VOICES,
+        [CA_ATOM_CANBERRA_MIN_INTERVAL] = CA_PROP_CANBERRA_MIN_INTERVAL,
+        [CA_ATOM_CANBERRA_PRIORITY] = CA_PROP_CANBERRA_PRIORITY,
+        [CA_ATOM_CANBERRA_REALTIME] = CA_PROP_CANBERRA_REALTIME,
+        [CA_ATOM_CANBERRA_VOICE_STEALING] = CA_PROP_CANBERRA_VOICE_STEALING,
+        [CA_ATOM_CANBERRA_VOLUME] = CA_PROP_CANBERRA_VOLUME,
+        [CA_ATOM_CANBERRA_XDG_THEME_NAME] = CA_PROP_CANBERRA_XDG_THEME_NAME,
+        [CA_ATOM_CANBERRA_XDG_THEME_OUTPUT_PROFILE] = CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE,
+        [CA_ATOM_EVENT_DESCRIPTION] = CA_PROP_EVENT_DESCRIPTION,
+        [CA_ATOM_EVENT_ID] = CA_PROP_EVENT_ID,
+        [CA_ATOM_EVENT_MOUSE_BUTTON] = CA_PROP_EVENT_MOUSE_BUTTON,
+        [CA_ATOM_EVENT_MOUSE_HPOS] = CA_PROP_EVENT_MOUSE_HPOS,
+        [CA_ATOM_EVENT_MOUSE_VPOS] = CA_PROP_EVENT_MOUSE_VPOS,
+        [CA_ATOM_EVENT_MOUSE_X] = CA_PROP_EVENT_MOUSE_X,
+        [CA_ATOM_EVENT_MOUSE_Y] = CA_PROP_EVENT_MOUSE_Y,
+        [CA_ATOM_MEDIA_ARTIST] = CA_PROP_MEDIA_ARTIST,
+        [CA_ATOM_MEDIA_FILENAME] = CA_PROP_MEDIA_FILENAME,
+        [CA_ATOM_MEDIA_ICON] = CA_PROP_MEDIA_ICON,
+        [CA_ATOM_MEDIA_ICON_NAME] = CA_PROP_MEDIA_ICON_NAME,
+        [CA_ATOM_MEDIA_LANGUAGE] = CA_PROP_MEDIA_LANGUAGE,
+        [CA_ATOM_MEDIA_NAME] = CA_PROP_MEDIA_NAME,
+        [CA_ATOM_MEDIA_ROLE] = CA_PROP_MEDIA_ROLE,
+        [CA_ATOM_MEDIA_TITLE] = CA_PROP_MEDIA_TITLE,
+        [CA_ATOM_WINDOW_DESKTOP] = CA_PROP_WINDOW_DESKTOP,
+        [CA_ATOM_WINDOW_HEIGHT] = CA_PROP_WINDOW_HEIGHT,
+        [CA_ATOM_WINDOW_HPOS] = CA_PROP_WINDOW_HPOS,
+        [CA_ATOM_WINDOW_ICON] = CA_PROP_WINDOW_ICON,
+        [CA_ATOM_WINDOW_ICON_NAME] = CA_PROP_WINDOW_ICON_NAME,
+        [CA_ATOM_WINDOW_ID] = CA_PROP_WINDOW_ID,
+        [CA_ATOM_WINDOW_NAME] = CA_PROP_WINDOW_NAME,
+        [CA_ATOM_WINDOW_VPOS] = CA_PROP_WINDOW_VPOS,
+        [CA_ATOM_WINDOW_WIDTH] = CA_PROP_WINDOW_WIDTH,
+        [CA_ATOM_WINDOW_X] = CA_PROP_WINDOW_X,
+        [CA_ATOM_WINDOW_X11_DISPLAY] = CA_PROP_WINDOW_X11_DISPLAY,
+        [CA_ATOM_WINDOW_X11_MONITOR] = CA_PROP_WINDOW_X11_MONITOR,
+        [CA_ATOM_WINDOW_X11_SCREEN] = CA_PROP_WINDOW_X11_SCREEN,
+        [CA_ATOM_WINDOW_X11_XID] = CA_PROP_WINDOW_X11_XID,
+        [CA_ATOM_WINDOW_Y] = CA_PROP_WINDOW_Y,
+};
+
 static unsigned calc_hash(const char *c) {
         unsigned hash = 0;
 
@@ -40,6 +101,21 @@ static unsigned calc_hash(const char *c) {
         return hash;
 }
 
+static int atom_compare(const void *key, const void *entry) {
+        return strcmp(key, *(const char* const*) entry);
+}
+
+ca_atom_t ca_atom_from_string(const char *key) {
+        const char * const *e;
+
+        ca_return_val_if_fail(key, CA_ATOM_INVALID);
+
+        if (!(e = bsearch(key, atom_names, CA_ELEMENTSOF(atom_names), sizeof(atom_names[0]), atom_compare)))
+                return CA_ATOM_INVALID;
+
+        return (ca_atom_t) (e - atom_names);
+}
+
 /**
  * ca_proplist_create:
  * @p: A pointer where to fill in a pointer for the new property list.
@@ -60,43 +136,178 @@ int ca_proplist_create(ca_proplist **_p) {
                 return CA_ERROR_OOM;
         }
 
+        p->n_ref = 1;
+
         *_p = p;
 
         return CA_SUCCESS;
 }
 
-static int _unset(ca_proplist *p, const char *key) {
-        ca_prop *prop, *nprop;
-        unsigned i;
+static void *arena_alloc(ca_proplist *p, size_t size) {
+        ca_arena_block *b;
+        void *r;
 
-        ca_return_val_if_fail(p, CA_ERROR_INVALID);
-        ca_return_val_if_fail(key, CA_ERROR_INVALID);
+        size = CA_ALIGN(size);
+
+        if (!(b = p->arena) || b->used + size > b->size) {
+                size_t n;
+
+                n = b ? b->size * 2 : ARENA_BLOCK_SIZE;
+                while (n < size)
+                        n *= 2;
+
+                if (!(b = ca_malloc(CA_ALIGN(sizeof(ca_arena_block)) + n)))
+                        return NULL;
+
+                b->size = n;
+                b->used = 0;
+                b->next = p->arena;
+                p->arena = b;
+        }
+
+        r = (char*) b + CA_ALIGN(sizeof(ca_arena_block)) + b->used;
+        b->used += size;
+        p->allocated += size;
+
+        return r;
+}
+
+static void arena_free(ca_arena_block *b) {
+
+        while (b) {
+                ca_arena_block *n = b->next;
+                ca_free(b);
+                b = n;
+        }
+}
+
+static size_t prop_size(ca_atom_t atom, const char *key, size_t nbytes) {
+        return CA_ALIGN(CA_ALIGN(sizeof(ca_prop)) + nbytes + (atom == CA_ATOM_INVALID ? strlen(key) + 1 : 0));
+}
 
-        i = calc_hash(key) % N_HASHTABLE;
+/* Allocates a new property from the arena and fills in the data */
+static ca_prop *prop_new(ca_proplist *p, const char *key, ca_atom_t atom, const void *data, size_t nbytes) {
+        ca_prop *prop;
+
+        if (!(prop = arena_alloc(p, prop_size(atom, key, nbytes))))
+                return NULL;
 
-        nprop = NULL;
-        for (prop = p->prop_hashtable[i]; prop; nprop = prop, prop = prop->next_in_slot)
-                if (strcmp(prop->key, key) == 0)
+        prop->nbytes = nbytes;
+        prop->atom = atom;
+        memcpy(CA_PROP_DATA(prop), data, nbytes);
+
+        /* Well-known keys are not copied, custom keys are stored right
+         * after the data */
+        if (atom != CA_ATOM_INVALID)
+                prop->key = atom_names[atom];
+        else {
+                char *k = (char*) CA_PROP_DATA(prop) + nbytes;
+                strcpy(k, key);
+                prop->key = k;
+        }
+
+        return prop;
+}
+
+static ca_prop **find_slot(ca_proplist *p, const char *key, ca_atom_t atom) {
+        ca_prop **prop;
+
+        if (atom != CA_ATOM_INVALID)
+                return &p->atoms[atom];
+
+        for (prop = &p->prop_hashtable[calc_hash(key) % N_HASHTABLE]; *prop; prop = &(*prop)->next_in_slot)
+                if (strcmp((*prop)->key, key) == 0)
                         break;
 
-        if (prop) {
-                if (nprop)
-                        nprop->next_in_slot = prop->next_in_slot;
-                else
-                        p->prop_hashtable[i] = prop->next_in_slot;
+        return prop;
+}
+
+static void link_prop(ca_proplist *p, ca_prop *prop) {
+
+        if (prop->atom != CA_ATOM_INVALID) {
+                ca_assert(!p->atoms[prop->atom]);
+                prop->next_in_slot = NULL;
+                p->atoms[prop->atom] = prop;
+        } else {
+                unsigned h = calc_hash(prop->key) % N_HASHTABLE;
+                prop->next_in_slot = p->prop_hashtable[h];
+                p->prop_hashtable[h] = prop;
+        }
+
+        prop->prev_item = NULL;
+        if ((prop->next_item = p->first_item))
+                prop->next_item->prev_item = prop;
+        p->first_item = prop;
+}
+
+static void unlink_prop(ca_proplist *p, ca_prop **slot) {
+        ca_prop *prop = *slot;
+
+        *slot = prop->next_in_slot;
+
+        if (prop->prev_item)
+                prop->prev_item->next_item = prop->next_item;
+        else
+                p->first_item = prop->next_item;
+
+        if (prop->next_item)
+                prop->next_item->prev_item = prop->prev_item;
 
-                if (prop->prev_item)
-                        prop->prev_item->next_item = prop->next_item;
-                else
-                        p->first_item = prop->next_item;
+        /* The memory is only given back when the list is compacted or
+         * destroyed */
+        p->wasted += prop_size(prop->atom, prop->key, prop->nbytes);
+}
+
+/* Copies all live properties into a fresh arena if most of the
+ * current one is unused. Only matters for long-lived lists that are
+ * changed a lot, such as the context properties. */
+static void compact(ca_proplist *p) {
+        ca_proplist n;
+        ca_prop *prop, *last;
+
+        if (p->wasted < ARENA_COMPACT_MIN || p->wasted * 2 < p->allocated)
+                return;
+
+        memset(&n, 0, sizeof(n));
 
-                if (prop->next_item)
-                        prop->next_item->prev_item = prop->prev_item;
+        for (last = p->first_item; last && last->next_item; last = last->next_item)
+                ;
+
+        /* Go backwards to keep the order */
+        for (prop = last; prop; prop = prop->prev_item) {
+                ca_prop *np;
+
+                /* If we cannot allocate we just keep the old arena */
+                if (!(np = prop_new(&n, prop->key, prop->atom, CA_PROP_DATA(prop), prop->nbytes))) {
+                        arena_free(n.arena);
+                        return;
+                }
 
-                ca_free(prop->key);
-                ca_free(prop);
+                link_prop(&n, np);
         }
 
+        arena_free(p->arena);
+
+        memcpy(p->atoms, n.atoms, sizeof(n.atoms));
+        memcpy(p->prop_hashtable, n.prop_hashtable, sizeof(n.prop_hashtable));
+        p->first_item = n.first_item;
+        p->arena = n.arena;
+        p->allocated = n.allocated;
+        p->wasted = 0;
+}
+
+static int set_unlocked(ca_proplist *p, const char *key, ca_atom_t atom, const void *data, size_t nbytes) {
+        ca_prop *prop, **slot;
+
+        if (!(prop = prop_new(p, key, atom, data, nbytes)))
+                return CA_ERROR_OOM;
+
+        if (*(slot = find_slot(p, key, atom)))
+                unlink_prop(p, slot);
+
+        link_prop(p, prop);
+        compact(p);
+
         return CA_SUCCESS;
 }
 
@@ -135,36 +346,27 @@ int ca_proplist_sets(ca_proplist *p, const char *key, const char *value) {
 
 int ca_proplist_setf(ca_proplist *p, const char *key, const char *format, ...) {
         int ret;
-        char *k;
-        ca_prop *prop;
-        size_t size = 100;
-        unsigned h;
+        char buf[256], *v = buf;
+        size_t size = sizeof(buf);
 
         ca_return_val_if_fail(p, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!p->frozen, CA_ERROR_STATE);
         ca_return_val_if_fail(key, CA_ERROR_INVALID);
         ca_return_val_if_fail(format, CA_ERROR_INVALID);
 
-        if (!(k = ca_strdup(key)))
-                return CA_ERROR_OOM;
-
+        /* Short values are formatted on the stack */
         for (;;) {
                 va_list ap;
                 int r;
 
-                if (!(prop = ca_malloc(CA_ALIGN(sizeof(ca_prop)) + size))) {
-                        ca_free(k);
-                        return CA_ERROR_OOM;
-                }
-
-
                 va_start(ap, format);
-                r = vsnprintf(CA_PROP_DATA(prop), size, format, ap);
+                r = vsnprintf(v, size, format, ap);
                 va_end(ap);
 
-                ((char*) CA_PROP_DATA(prop))[size-1] = 0;
+                v[size-1] = 0;
 
                 if (r > -1 && (size_t) r < size) {
-                        prop->nbytes = (size_t) r+1;
+                        size = (size_t) r+1;
                         break;
                 }
 
@@ -173,33 +375,20 @@ int ca_proplist_setf(ca_proplist *p, const char *key, const char *format, ...) {
                 else           /* glibc 2.0 */
                         size *= 2;
 
-                ca_free(prop);
-        }
-
-        prop->key = k;
-
-        ca_mutex_lock(p->mutex);
+                if (v != buf)
+                        ca_free(v);
 
-        if ((ret = _unset(p, key)) < 0) {
-                ca_free(prop);
-                ca_free(k);
-                goto finish;
+                if (!(v = ca_malloc(size)))
+                        return CA_ERROR_OOM;
         }
 
-        h = calc_hash(key) % N_HASHTABLE;
-
-        prop->next_in_slot = p->prop_hashtable[h];
-        p->prop_hashtable[h] = prop;
-
-        prop->prev_item = NULL;
-        if ((prop->next_item = p->first_item))
-                prop->next_item->prev_item = prop;
-        p->first_item = prop;
-
-finish:
-
+        ca_mutex_lock(p->mutex);
+        ret = set_unlocked(p, key, ca_atom_from_string(key), v, size);
         ca_mutex_unlock(p->mutex);
 
+        if (v != buf)
+                ca_free(v);
+
         return ret;
 }
 
@@ -217,76 +406,169 @@ finish:
 
 int ca_proplist_set(ca_proplist *p, const char *key, const void *data, size_t nbytes) {
         int ret;
-        char *k;
-        ca_prop *prop;
-        unsigned h;
+        ca_atom_t atom;
 
         ca_return_val_if_fail(p, CA_ERROR_INVALID);
+        ca_return_val_if_fail(!p->frozen, CA_ERROR_STATE);
         ca_return_val_if_fail(key, CA_ERROR_INVALID);
         ca_return_val_if_fail(!nbytes || data, CA_ERROR_INVALID);
 
-        if (!(k = ca_strdup(key)))
-                return CA_ERROR_OOM;
+        atom = ca_atom_from_string(key);
 
-        if (!(prop = ca_malloc(CA_ALIGN(sizeof(ca_prop)) + nbytes))) {
-                ca_free(k);
-                return CA_ERROR_OOM;
-        }
+        ca_mutex_lock(p->mutex);
+        ret = set_unlocked(p, key, atom, data, nbytes);
+        ca_mutex_unlock(p->mutex);
 
-        prop->key = k;
-        prop->nbytes = nbytes;
-        memcpy(CA_PROP_DATA(prop), data, nbytes);
+        return ret;
+}
 
-        ca_mutex_lock(p->mutex);
+/* Not exported, not self-locking */
+ca_prop* ca_proplist_get_unlocked(ca_proplist *p, const char *key) {
 
-        if ((ret = _unset(p, key)) < 0) {
-                ca_free(prop);
-                ca_free(k);
-                goto finish;
-        }
+        ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(key, NULL);
 
-        h = calc_hash(key) % N_HASHTABLE;
+        return *find_slot(p, key, ca_atom_from_string(key));
+}
 
-        prop->next_in_slot = p->prop_hashtable[h];
-        p->prop_hashtable[h] = prop;
+/* Not exported, not self-locking */
+const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
+        ca_prop *prop;
 
-        prop->prev_item = NULL;
-        if ((prop->next_item = p->first_item))
-                prop->next_item->prev_item = prop;
-        p->first_item = prop;
+        ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(key, NULL);
+
+        if (!(prop = ca_proplist_get_unlocked(p, key)))
+                return NULL;
 
-finish:
+        if (!memchr(CA_PROP_DATA(prop), 0, prop->nbytes))
+                return NULL;
 
-        ca_mutex_unlock(p->mutex);
+        return CA_PROP_DATA(prop);
+}
 
-        return ret;
+/* Not exported, not self-locking */
+ca_prop* ca_proplist_get_atom_unlocked(ca_proplist *p, ca_atom_t atom) {
+
+        ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(atom > CA_ATOM_INVALID && atom < _CA_ATOM_MAX, NULL);
+
+        return p->atoms[atom];
 }
 
 /* Not exported, not self-locking */
-ca_prop* ca_proplist_get_unlocked(ca_proplist *p, const char *key) {
+const char* ca_proplist_gets_atom_unlocked(ca_proplist *p, ca_atom_t atom) {
         ca_prop *prop;
-        unsigned i;
 
         ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(atom > CA_ATOM_INVALID && atom < _CA_ATOM_MAX, NULL);
+
+        if (!(prop = p->atoms[atom]))
+                return NULL;
+
+        if (!memchr(CA_PROP_DATA(prop), 0, prop->nbytes))
+                return NULL;
+
+        return CA_PROP_DATA(prop);
+}
+
+/* Not exported */
+void ca_proplist_freeze(ca_proplist *p) {
+        ca_return_if_fail(p);
+
+        /* Called by the owner before the list is shared, hence no
+         * locking needed */
+        p->frozen = TRUE;
+}
+
+/* Not exported */
+ca_proplist* ca_proplist_ref(ca_proplist *p) {
+        ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(p->frozen, NULL);
+
+        ca_mutex_lock(p->mutex);
+        ca_assert(p->n_ref >= 1);
+        p->n_ref++;
+        ca_mutex_unlock(p->mutex);
+
+        return p;
+}
+
+/* Not exported */
+void ca_propview_init(ca_propview *v) {
+        ca_return_if_fail(v);
+
+        v->n_layers = 0;
+}
+
+/* Not exported */
+void ca_propview_add(ca_propview *v, ca_proplist *p) {
+        ca_return_if_fail(v);
+        ca_return_if_fail(p);
+        ca_return_if_fail(v->n_layers < CA_PROPVIEW_MAX);
+
+        v->layers[v->n_layers++] = p;
+}
+
+/* Not exported */
+ca_prop* ca_propview_get(const ca_propview *v, const char *key) {
+        ca_atom_t atom;
+        unsigned i;
+
+        ca_return_val_if_fail(v, NULL);
         ca_return_val_if_fail(key, NULL);
 
-        i = calc_hash(key) % N_HASHTABLE;
+        /* Resolve the key only once for all layers */
+        atom = ca_atom_from_string(key);
 
-        for (prop = p->prop_hashtable[i]; prop; prop = prop->next_in_slot)
-                if (strcmp(prop->key, key) == 0)
+        for (i = 0; i < v->n_layers; i++) {
+                ca_prop *prop;
+
+                if ((prop = *find_slot(v->layers[i], key, atom)))
                         return prop;
+        }
 
         return NULL;
 }
 
-/* Not exported, not self-locking */
-const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
+/* Not exported */
+const char* ca_propview_gets(const ca_propview *v, const char *key) {
         ca_prop *prop;
 
-        ca_return_val_if_fail(p, NULL);
+        ca_return_val_if_fail(v, NULL);
         ca_return_val_if_fail(key, NULL);
 
-        if (!(prop = ca_proplist_get_unlocked(p, key)))
+        if (!(prop = ca_propview_get(v, key)))
+                return NULL;
+
+        if (!memchr(CA_PROP_DATA(prop), 0, prop->nbytes))
+                return NULL;
+
+        return CA_PROP_DATA(prop);
+}
+
+/* Not exported */
+ca_prop* ca_propview_get_atom(const ca_propview *v, ca_atom_t atom) {
+        unsigned i;
+
+        ca_return_val_if_fail(v, NULL);
+        ca_return_val_if_fail(atom > CA_ATOM_INVALID && atom < _CA_ATOM_MAX, NULL);
+
+        for (i = 0; i < v->n_layers; i++)
+                if (v->layers[i]->atoms[atom])
+                        return v->layers[i]->atoms[atom];
+
+        return NULL;
+}
+
+/* Not exported */
+const char* ca_propview_gets_atom(const ca_propview *v, ca_atom_t atom) {
+        ca_prop *prop;
+
+        ca_return_val_if_fail(v, NULL);
+        ca_return_val_if_fail(atom > CA_ATOM_INVALID && atom < _CA_ATOM_MAX, NULL);
+
+        if (!(prop = ca_propview_get_atom(v, atom)))
                 return NULL;
 
         if (!memchr(CA_PROP_DATA(prop), 0, prop->nbytes))
@@ -295,6 +577,14 @@ const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
         return CA_PROP_DATA(prop);
 }
 
+/* Not exported */
+ca_bool_t ca_propview_contains(const ca_propview *v, const char *key) {
+        ca_return_val_if_fail(v, FALSE);
+        ca_return_val_if_fail(key, FALSE);
+
+        return !!ca_propview_get(v, key);
+}
+
 /**
  * ca_proplist_destroy:
  * @p: The property list to destroy
@@ -305,16 +595,21 @@ const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key) {
  */
 
 int ca_proplist_destroy(ca_proplist *p) {
-        ca_prop *prop, *nprop;
-
         ca_return_val_if_fail(p, CA_ERROR_INVALID);
 
-        for (prop = p->first_item; prop; prop = nprop) {
-                nprop = prop->next_item;
-                ca_free(prop->key);
-                ca_free(prop);
+        if (p->frozen) {
+                unsigned n;
+
+                ca_mutex_lock(p->mutex);
+                ca_assert(p->n_ref >= 1);
+                n = --p->n_ref;
+                ca_mutex_unlock(p->mutex);
+
+                if (n > 0)
+                        return CA_SUCCESS;
         }
 
+        arena_free(p->arena);
         ca_mutex_free(p->mutex);
 
         ca_free(p);
@@ -329,13 +624,20 @@ static int merge_into(ca_proplist *a, ca_proplist *b) {
         ca_return_val_if_fail(a, CA_ERROR_INVALID);
         ca_return_val_if_fail(b, CA_ERROR_INVALID);
 
-        ca_mutex_lock(b->mutex);
+        ca_return_val_if_fail(!a->frozen, CA_ERROR_STATE);
+
+        /* Snapshots can be read without locking */
+        if (!b->frozen)
+                ca_mutex_lock(b->mutex);
+        ca_mutex_lock(a->mutex);
 
         for (prop = b->first_item; prop; prop = prop->next_item)
-                if ((ret = ca_proplist_set(a, prop->key, CA_PROP_DATA(prop), prop->nbytes)) < 0)
+                if ((ret = set_unlocked(a, prop->key, prop->atom, CA_PROP_DATA(prop), prop->nbytes)) < 0)
                         break;
 
-        ca_mutex_unlock(b->mutex);
+        ca_mutex_unlock(a->mutex);
+        if (!b->frozen)
+                ca_mutex_unlock(b->mutex);
 
         return ret;
 }
@@ -361,12 +663,35 @@ int ca_proplist_merge(ca_proplist **_a, ca_proplist *b, ca_proplist *c) {
         return CA_SUCCESS;
 }
 
+/* Not exported */
+int ca_proplist_copy(ca_proplist **_a, ca_proplist *b) {
+        ca_proplist *a;
+        int ret;
+
+        ca_return_val_if_fail(_a, CA_ERROR_INVALID);
+        ca_return_val_if_fail(b, CA_ERROR_INVALID);
+
+        if ((ret = ca_proplist_create(&a)) < 0)
+                return ret;
+
+        if ((ret = merge_into(a, b)) < 0) {
+                ca_proplist_destroy(a);
+                return ret;
+        }
+
+        *_a = a;
+        return CA_SUCCESS;
+}
+
 ca_bool_t ca_proplist_contains(ca_proplist *p, const char *key) {
         ca_bool_t b;
 
         ca_return_val_if_fail(p, FALSE);
         ca_return_val_if_fail(key, FALSE);
 
+        if (p->frozen)
+                return !!ca_proplist_get_unlocked(p, key);
+
         ca_mutex_lock(p->mutex);
         b = !!ca_proplist_get_unlocked(p, key);
         ca_mutex_unlock(p->mutex);
@@ -30,28 +30,140 @@
 
 #define N_HASHTABLE 31
 
+/* The well-known properties from canberra.h. These are stored and
+ * looked up by index instead of by name. Sorted by name. */
+typedef enum ca_atom {
+        CA_ATOM_INVALID = -1,
+        CA_ATOM_APPLICATION_ICON,
+        CA_ATOM_APPLICATION_ICON_NAME,
+        CA_ATOM_APPLICATION_ID,
+        CA_ATOM_APPLICATION_LANGUAGE,
+        CA_ATOM_APPLICATION_NAME,
+        CA_ATOM_APPLICATION_PROCESS_BINARY,
+        CA_ATOM_APPLICATION_PROCESS_HOST,
+        CA_ATOM_APPLICATION_PROCESS_ID,
+        CA_ATOM_APPLICATION_PROCESS_USER,
+        CA_ATOM_APPLICATION_VERSION,
+        CA_ATOM_CANBERRA_CACHE_CONTROL,
+        CA_ATOM_CANBERRA_ENABLE,
+        CA_ATOM_CANBERRA_FORCE_CHANNEL,
+        CA_ATOM_CANBERRA_LATENCY,
+        CA_ATOM_CANBERRA_MAX_PLAYING,
+        CA_ATOM_CANBERRA_MAX_VOICES,
+        CA_ATOM_CANBERRA_MIN_INTERVAL,
+        CA_ATOM_CANBERRA_PRIORITY,
+        CA_ATOM_CANBERRA_REALTIME,
+        CA_ATOM_CANBERRA_VOICE_STEALING,
+        CA_ATOM_CANBERRA_VOLUME,
+        CA_ATOM_CANBERRA_XDG_THEME_NAME,
+        CA_ATOM_CANBERRA_XDG_THEME_OUTPUT_PROFILE,
+        CA_ATOM_EVENT_DESCRIPTION,
+        CA_ATOM_EVENT_ID,
+        CA_ATOM_EVENT_MOUSE_BUTTON,
+        CA_ATOM_EVENT_MOUSE_HPOS,
+        CA_ATOM_EVENT_MOUSE_VPOS,
+        CA_ATOM_EVENT_MOUSE_X,
+        CA_ATOM_EVENT_MOUSE_Y,
+        CA_ATOM_MEDIA_ARTIST,
+        CA_ATOM_MEDIA_FILENAME,
+        CA_ATOM_MEDIA_ICON,
+        CA_ATOM_MEDIA_ICON_NAME,
+        CA_ATOM_MEDIA_LANGUAGE,
+        CA_ATOM_MEDIA_NAME,
+        CA_ATOM_MEDIA_ROLE,
+        CA_ATOM_MEDIA_TITLE,
+        CA_ATOM_WINDOW_DESKTOP,
+        CA_ATOM_WINDOW_HEIGHT,
+        CA_ATOM_WINDOW_HPOS,
+        CA_ATOM_WINDOW_ICON,
+        CA_ATOM_WINDOW_ICON_NAME,
+        CA_ATOM_WINDOW_ID,
+        CA_ATOM_WINDOW_NAME,
+        CA_ATOM_WINDOW_VPOS,
+        CA_ATOM_WINDOW_WIDTH,
+        CA_ATOM_WINDOW_X,
+        CA_ATOM_WINDOW_X11_DISPLAY,
+        CA_ATOM_WINDOW_X11_MONITOR,
+        CA_ATOM_WINDOW_X11_SCREEN,
+        CA_ATOM_WINDOW_X11_XID,
+        CA_ATOM_WINDOW_Y,
+        _CA_ATOM_MAX
+} ca_atom_t;
+
 typedef struct ca_prop {
-        char *key;
+        const char *key;
         size_t nbytes;
+        ca_atom_t atom;
         struct ca_prop *next_in_slot, *next_item, *prev_item;
 } ca_prop;
 
 #define CA_PROP_DATA(p) ((void*) ((char*) (p) + CA_ALIGN(sizeof(ca_prop))))
 
+/* All properties of a list are allocated from a list of blocks that
+ * are only freed when the list is destroyed or compacted */
+typedef struct ca_arena_block {
+        struct ca_arena_block *next;
+        size_t size, used;
+} ca_arena_block;
+
 struct ca_proplist {
         ca_mutex *mutex;
 
+        /* Frozen lists are immutable and may be read without taking
+         * the mutex. Only frozen lists are reference counted, the
+         * mutex then protects n_ref only. */
+        ca_bool_t frozen;
+        unsigned n_ref;
+
+        ca_prop *atoms[_CA_ATOM_MAX];
         ca_prop *prop_hashtable[N_HASHTABLE];
         ca_prop *first_item;
+
+        ca_arena_block *arena;
+        size_t allocated, wasted;
 };
 
+ca_atom_t ca_atom_from_string(const char *key);
+
 int ca_proplist_merge(ca_proplist **_a, ca_proplist *b, ca_proplist *c);
+int ca_proplist_copy(ca_proplist **_a, ca_proplist *b);
 ca_bool_t ca_proplist_contains(ca_proplist *p, const char *key);
 
 /* Both of the following two functions are not locked! Need manual locking! */
 ca_prop* ca_proplist_get_unlocked(ca_proplist *p, const char *key);
 const char* ca_proplist_gets_unlocked(ca_proplist *p, const char *key);
 
+/* Same as above, for well-known properties. Not locked either! */
+ca_prop* ca_proplist_get_atom_unlocked(ca_proplist *p, ca_atom_t atom);
+const char* ca_proplist_gets_atom_unlocked(ca_proplist *p, ca_atom_t atom);
+
+/* Turns a list into an immutable snapshot. References are dropped
+ * with ca_proplist_destroy() */
+void ca_proplist_freeze(ca_proplist *p);
+ca_proplist* ca_proplist_ref(ca_proplist *p);
+
+/* A read-only view on a stack of property lists, such as the play
+ * properties on top of the context properties. Keys are resolved by
+ * walking the layers from the top, nothing is copied and no locks are
+ * taken. Layers that are not frozen must not be modified while the
+ * view is in use. */
+#define CA_PROPVIEW_MAX 4
+
+typedef struct ca_propview {
+        ca_proplist *layers[CA_PROPVIEW_MAX];
+        unsigned n_layers;
+} ca_propview;
+
+/* Layers are added from the top down */
+void ca_propview_init(ca_propview *v);
+void ca_propview_add(ca_propview *v, ca_proplist *p);
+
+ca_prop* ca_propview_get(const ca_propview *v, const char *key);
+const char* ca_propview_gets(const ca_propview *v, const char *key);
+ca_prop* ca_propview_get_atom(const ca_propview *v, ca_atom_t atom);
+const char* ca_propview_gets_atom(const ca_propview *v, ca_atom_t atom);
+ca_bool_t ca_propview_contains(const ca_propview *v, const char *key);
+
 int ca_proplist_merge_ap(ca_proplist *p, va_list ap);
 int ca_proplist_from_ap(ca_proplist **_p, va_list ap);
 
@@ -45,6 +45,8 @@
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
 #include "malloc.h"
+#include "id-table.h"
+#include "realtime.h"
 
 enum outstanding_type {
         OUTSTANDING_SAMPLE,
@@ -58,6 +60,7 @@ struct outstanding {
         ca_context *context;
         uint32_t id;
         uint32_t sink_input;
+        ca_id_link by_id, by_sink_input;
         pa_stream *stream;
         pa_operation *drain_operation;
         ca_finish_callback_t callback;
@@ -75,12 +78,33 @@ struct private {
         ca_bool_t subscribed;
         ca_bool_t reconnect;
 
+        /* Whether the mainloop thread has asked for real-time
+         * scheduling already. Protected by the mainloop lock. */
+        ca_bool_t realtime;
+
+        /* The context properties as we pass them to the server,
+         * converted once in driver_open() and driver_change_props()
+         * and protected by the mainloop lock */
+        pa_proplist *proplist;
+
         ca_mutex *outstanding_mutex;
         CA_LLIST_HEAD(struct outstanding, outstanding);
+
+        /* Indexes into the list above, by the user's id and by the
+         * sink input the sound is played on */
+        ca_id_table outstanding_by_id;
+        ca_id_table outstanding_by_sink_input;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
+/* Newer servers pick the volume of samples themselves */
+#if defined(PA_MAJOR) && ((PA_MAJOR > 0) || (PA_MAJOR == 0 && PA_MINOR > 9) || (PA_MAJOR == 0 && PA_MINOR == 9 && PA_MICRO >= 15))
+#define PLAY_VOLUME_DEFAULT ((pa_volume_t) -1)
+#else
+#define PLAY_VOLUME_DEFAULT PA_VOLUME_NORM
+#endif
+
 static void context_state_cb(pa_context *pc, void *userdata);
 static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t, uint32_t idx, void *userdata);
 
@@ -113,24 +137,86 @@ static void outstanding_free(struct outstanding *o) {
         ca_free(o);
 }
 
-static int convert_proplist(pa_proplist **_l, ca_proplist *c) {
+/* Both need the outstanding mutex. The sink input is known by the
+ * time a sound is added and doesn't change afterwards. */
+static void outstanding_link(struct private *p, struct outstanding *o) {
+        ca_assert(p);
+        ca_assert(o);
+
+        CA_LLIST_PREPEND(struct outstanding, p->outstanding, o);
+        ca_id_table_put(&p->outstanding_by_id, &o->by_id, o->id);
+
+        if (o->sink_input != PA_INVALID_INDEX)
+                ca_id_table_put(&p->outstanding_by_sink_input, &o->by_sink_input, o->sink_input);
+}
+
+static void outstanding_unlink(struct private *p, struct outstanding *o) {
+        ca_assert(p);
+        ca_assert(o);
+
+        CA_LLIST_REMOVE(struct outstanding, p->outstanding, o);
+        ca_id_table_remove(&p->outstanding_by_id, &o->by_id);
+
+        if (o->sink_input != PA_INVALID_INDEX)
+                ca_id_table_remove(&p->outstanding_by_sink_input, &o->by_sink_input);
+}
+
+struct prefix {
+        const char *prefix;
+        size_t length;
+};
+
+#define PREFIX(s) { (s), sizeof(s) - 1 }
+
+/* Properties that are not passed on to the server when playing and
+ * when uploading a sample, respectively */
+static const struct prefix strip_play[] = {
+        PREFIX("canberra."),
+        { NULL, 0 }
+};
+
+static const struct prefix strip_upload[] = {
+        PREFIX("canberra."),
+        PREFIX("event.mouse."),
+        PREFIX("window."),
+        { NULL, 0 }
+};
+
+static ca_bool_t has_prefix(const char *key, const struct prefix *strip) {
+
+        for (; strip->prefix; strip++)
+                if (strncmp(key, strip->prefix, strip->length) == 0)
+                        return TRUE;
+
+        return FALSE;
+}
+
+static int convert_proplist(pa_proplist **_l, ca_proplist *c, const struct prefix *strip) {
         pa_proplist *l;
         ca_prop *i;
 
         ca_return_val_if_fail(_l, CA_ERROR_INVALID);
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(strip, CA_ERROR_INVALID);
 
         if (!(l = pa_proplist_new()))
                 return CA_ERROR_OOM;
 
         ca_mutex_lock(c->mutex);
 
-        for (i = c->first_item; i; i = i->next_item)
+        for (i = c->first_item; i; i = i->next_item) {
+
+                /* Filter right away instead of removing the keys
+                 * again later */
+                if (has_prefix(i->key, strip))
+                        continue;
+
                 if (pa_proplist_set(l, i->key, CA_PROP_DATA(i), i->nbytes) < 0) {
                         ca_mutex_unlock(c->mutex);
                         pa_proplist_free(l);
                         return CA_ERROR_INVALID;
                 }
+        }
 
         ca_mutex_unlock(c->mutex);
 
@@ -139,16 +225,79 @@ static int convert_proplist(pa_proplist **_l, ca_proplist *c) {
         return CA_SUCCESS;
 }
 
-static pa_proplist *strip_prefix(pa_proplist *l, const char *prefix) {
-        const char *key;
-        void *state = NULL;
-        ca_assert(l);
+static int convert_context_proplist(pa_proplist **_l, ca_proplist *c) {
+        pa_proplist *l;
+        int ret;
+
+        if ((ret = convert_proplist(&l, c, strip_play)) < 0)
+                return ret;
+
+        if (!pa_proplist_contains(l, PA_PROP_APPLICATION_NAME)) {
+                pa_proplist_sets(l, PA_PROP_APPLICATION_NAME, "libcanberra");
+                pa_proplist_sets(l, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
+
+                if (!pa_proplist_contains(l, PA_PROP_APPLICATION_ID))
+                        pa_proplist_sets(l, PA_PROP_APPLICATION_ID, "org.freedesktop.libcanberra");
 
-        while ((key = pa_proplist_iterate(l, &state)))
-                if (strncmp(key, prefix, strlen(prefix)) == 0)
-                        pa_proplist_unset(l, key);
+        }
+
+        *_l = l;
 
-        return l;
+        return CA_SUCCESS;
+}
+
+/* The canberra.* properties are handled by us and never make it into
+ * the pa_proplist, hence read them from the original list. Pass NULL
+ * for what you are not interested in. */
+static int parse_canberra_props(
+                ca_proplist *c,
+                pa_volume_t *v,
+                ca_bool_t *volume_set,
+                ca_cache_control_t *cache_control,
+                pa_channel_position_t *position) {
+
+        const char *t;
+        int ret = CA_SUCCESS;
+
+        ca_mutex_lock(c->mutex);
+
+        if (v && (t = ca_proplist_gets_atom_unlocked(c, CA_ATOM_CANBERRA_VOLUME))) {
+                char *e = NULL;
+                double dvol;
+
+                errno = 0;
+                dvol = strtod(t, &e);
+                if (errno != 0 || !e || *e) {
+                        ret = CA_ERROR_INVALID;
+                        goto finish;
+                }
+
+                *v = pa_sw_volume_from_dB(dvol);
+                *volume_set = TRUE;
+        }
+
+        if (cache_control && (t = ca_proplist_gets_atom_unlocked(c, CA_ATOM_CANBERRA_CACHE_CONTROL)))
+                if (ca_parse_cache_control(cache_control, t) < 0) {
+                        ret = CA_ERROR_INVALID;
+                        goto finish;
+                }
+
+        if (position && (t = ca_proplist_gets_atom_unlocked(c, CA_ATOM_CANBERRA_FORCE_CHANNEL))) {
+                pa_channel_map m;
+
+                if (!pa_channel_map_parse(&m, t) ||
+                    m.channels != 1) {
+                        ret = CA_ERROR_INVALID;
+                        goto finish;
+                }
+
+                *position = m.map[0];
+        }
+
+finish:
+        ca_mutex_unlock(c->mutex);
+
+        return ret;
 }
 
 static void add_common(pa_proplist *l) {
@@ -216,7 +365,6 @@ static int translate_error(int error) {
 }
 
 static int context_connect(ca_context *c, ca_bool_t nofail) {
-        pa_proplist *l;
         struct private *p;
         int ret;
 
@@ -224,30 +372,13 @@ static int context_connect(ca_context *c, ca_bool_t nofail) {
         ca_return_val_if_fail(p = c->private, CA_ERROR_STATE);
         ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
         ca_return_val_if_fail(!p->context, CA_ERROR_STATE);
+        ca_return_val_if_fail(p->proplist, CA_ERROR_STATE);
 
         /* If this immediate attempt fails, don't try to reconnect. */
         p->reconnect = FALSE;
 
-        if ((ret = convert_proplist(&l, c->props)) < 0)
-                return ret;
-
-        strip_prefix(l, "canberra.");
-
-        if (!pa_proplist_contains(l, PA_PROP_APPLICATION_NAME)) {
-                pa_proplist_sets(l, PA_PROP_APPLICATION_NAME, "libcanberra");
-                pa_proplist_sets(l, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
-
-                if (!pa_proplist_contains(l, PA_PROP_APPLICATION_ID))
-                        pa_proplist_sets(l, PA_PROP_APPLICATION_ID, "org.freedesktop.libcanberra");
-
-        }
-
-        if (!(p->context = pa_context_new_with_proplist(pa_threaded_mainloop_get_api(p->mainloop), NULL, l))) {
-                pa_proplist_free(l);
+        if (!(p->context = pa_context_new_with_proplist(pa_threaded_mainloop_get_api(p->mainloop), NULL, p->proplist)))
                 return CA_ERROR_OOM;
-        }
-
-        pa_proplist_free(l);
 
         pa_context_set_state_callback(p->context, context_state_cb, c);
         pa_context_set_subscribe_callback(p->context, context_subscribe_cb, c);
@@ -292,7 +423,7 @@ static void context_state_cb(pa_context *pc, void *userdata) {
                 while ((out = p->outstanding)) {
 
                         outstanding_disconnect(out);
-                        CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                        outstanding_unlink(p, out);
 
                         ca_mutex_unlock(p->outstanding_mutex);
 
@@ -330,7 +461,8 @@ static void context_state_cb(pa_context *pc, void *userdata) {
 }
 
 static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t, uint32_t idx, void *userdata) {
-        struct outstanding *out, *n;
+        struct outstanding *out;
+        ca_id_link *k, *nk;
         CA_LLIST_HEAD(struct outstanding, l);
         ca_context *c = userdata;
         struct private *p;
@@ -347,14 +479,15 @@ static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t,
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = n) {
-                n = out->next;
+        for (k = ca_id_table_first(&p->outstanding_by_sink_input, idx); k; k = nk) {
+                nk = ca_id_table_next(k);
+                out = CA_ID_TABLE_ENTRY(k, struct outstanding, by_sink_input);
 
-                if (!out->clean_up || out->type != OUTSTANDING_SAMPLE || out->sink_input != idx)
+                if (!out->clean_up || out->type != OUTSTANDING_SAMPLE)
                         continue;
 
                 outstanding_disconnect(out);
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
 
                 CA_LLIST_PREPEND(struct outstanding, l, out);
         }
@@ -389,11 +522,22 @@ int driver_open(ca_context *c) {
                 return CA_ERROR_OOM;
         }
 
+        if (ca_id_table_init(&p->outstanding_by_id) < 0 ||
+            ca_id_table_init(&p->outstanding_by_sink_input) < 0) {
+                driver_destroy(c);
+                return CA_ERROR_OOM;
+        }
+
         if (!(p->mainloop = pa_threaded_mainloop_new())) {
                 driver_destroy(c);
                 return CA_ERROR_OOM;
         }
 
+        if ((ret = convert_context_proplist(&p->proplist, c->props)) < 0) {
+                driver_destroy(c);
+                return ret;
+        }
+
         /* The initial connection is without NOFAIL, since we want to have
          * this call fail cleanly if we cannot connect. */
         if ((ret = context_connect(c, FALSE)) != CA_SUCCESS) {
@@ -459,7 +603,7 @@ int driver_destroy(ca_context *c) {
 
         while (p->outstanding) {
                 struct outstanding *out = p->outstanding;
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
 
                 if (out->callback)
                         out->callback(c, out->id, CA_ERROR_DESTROYED, out->userdata);
@@ -470,12 +614,18 @@ int driver_destroy(ca_context *c) {
         if (p->mainloop)
                 pa_threaded_mainloop_free(p->mainloop);
 
+        if (p->proplist)
+                pa_proplist_free(p->proplist);
+
         if (p->theme)
                 ca_theme_data_free(p->theme);
 
         if (p->outstanding_mutex)
                 ca_mutex_free(p->outstanding_mutex);
 
+        ca_id_table_done(&p->outstanding_by_id);
+        ca_id_table_done(&p->outstanding_by_sink_input);
+
         ca_free(p);
 
         c->private = NULL;
@@ -497,7 +647,7 @@ int driver_change_device(ca_context *c, const char *device) {
 int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged) {
         struct private *p;
         pa_operation *o;
-        pa_proplist *l;
+        pa_proplist *l, *merged_l;
         int ret = CA_SUCCESS;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
@@ -509,20 +659,28 @@ int driver_change_props(ca_context *c, ca_proplist *changed, ca_proplist *merged
 
         ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
 
+        if ((ret = convert_proplist(&l, changed, strip_play)) < 0)
+                return ret;
+
+        if ((ret = convert_context_proplist(&merged_l, merged)) < 0) {
+                pa_proplist_free(l);
+                return ret;
+        }
+
         pa_threaded_mainloop_lock(p->mainloop);
 
+        /* Keep the full list around for reconnecting */
+        pa_proplist_free(p->proplist);
+        p->proplist = merged_l;
+
         if (!p->context) {
                 pa_threaded_mainloop_unlock(p->mainloop);
+                pa_proplist_free(l);
                 return CA_ERROR_STATE; /* can be silently ignored */
         }
 
-        if ((ret = convert_proplist(&l, changed)) < 0)
-                return ret;
-
-        strip_prefix(l, "canberra.");
-
-        /* We start these asynchronously and don't care about the return
-         * value */
+        /* We only send what changed. We start these asynchronously
+         * and don't care about the return value */
 
         if (!(o = pa_context_proplist_update(p->context, PA_UPDATE_REPLACE, l, NULL, NULL)))
                 ret = translate_error(pa_context_errno(p->context));
@@ -552,6 +710,13 @@ static int subscribe(ca_context *c) {
 
         pa_threaded_mainloop_lock(p->mainloop);
 
+        /* Check again, now that we hold the lock, another play might
+         * have raced us */
+        if (p->subscribed) {
+                pa_threaded_mainloop_unlock(p->mainloop);
+                return CA_SUCCESS;
+        }
+
         if (!p->context) {
                 pa_threaded_mainloop_unlock(p->mainloop);
                 return CA_ERROR_STATE;
@@ -565,10 +730,10 @@ static int subscribe(ca_context *c) {
         else
                 pa_operation_unref(o);
 
-        pa_threaded_mainloop_unlock(p->mainloop);
-
         p->subscribed = TRUE;
 
+        pa_threaded_mainloop_unlock(p->mainloop);
+
         return ret;
 }
 
@@ -620,7 +785,7 @@ static void stream_state_cb(pa_stream *s, void *userdata) {
                 if (out->clean_up) {
                         ca_mutex_lock(p->outstanding_mutex);
                         outstanding_disconnect(out);
-                        CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                        outstanding_unlink(p, out);
                         ca_mutex_unlock(p->outstanding_mutex);
 
                         if (out->callback)
@@ -654,7 +819,7 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
         if (out->clean_up) {
                 ca_mutex_lock(p->outstanding_mutex);
                 outstanding_disconnect(out);
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 ca_mutex_unlock(p->outstanding_mutex);
 
                 if (out->callback)
@@ -676,6 +841,10 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
         pa_threaded_mainloop_signal(p->mainloop, FALSE);
 }
 
+static void realtime_cb(pa_mainloop_api *api, void *userdata) {
+        ca_realtime_request();
+}
+
 static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
         struct outstanding *out = userdata;
         struct private *p;
@@ -759,7 +928,7 @@ finish:
         if (out->clean_up) {
                 ca_mutex_lock(p->outstanding_mutex);
                 outstanding_disconnect(out);
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 ca_mutex_unlock(p->outstanding_mutex);
 
                 if (out->callback)
@@ -824,13 +993,9 @@ static ca_bool_t convert_channel_map(ca_sound_file *f, pa_channel_map *cm) {
 int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_callback_t cb, void *userdata) {
         struct private *p;
         pa_proplist *l = NULL;
-        const char *n, *vol, *ct, *channel;
+        const char *n;
         char *name = NULL;
-#if defined(PA_MAJOR) && ((PA_MAJOR > 0) || (PA_MAJOR == 0 && PA_MINOR > 9) || (PA_MAJOR == 0 && PA_MINOR == 9 && PA_MICRO >= 15))
-        pa_volume_t v = (pa_volume_t) -1;
-#else
-        pa_volume_t v = PA_VOLUME_NORM;
-#endif
+        pa_volume_t v = PLAY_VOLUME_DEFAULT;
         ca_bool_t volume_set = FALSE;
         pa_cvolume cvol;
         pa_sample_spec ss;
@@ -838,6 +1003,9 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         pa_channel_position_t position = PA_CHANNEL_POSITION_INVALID;
         ca_bool_t cm_good;
         ca_cache_control_t cache_control = CA_CACHE_CONTROL_NEVER;
+        uint32_t latency;
+        ca_bool_t realtime;
+        pa_stream_flags_t flags;
         struct outstanding *out = NULL;
         int try = 3;
         int ret;
@@ -866,56 +1034,33 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         out->callback = cb;
         out->userdata = userdata;
 
-        if ((ret = convert_proplist(&l, proplist)) < 0)
+        if ((ret = parse_canberra_props(proplist, &v, &volume_set, &cache_control, &position)) < 0)
                 goto finish_unlocked;
 
-        if ((n = pa_proplist_gets(l, CA_PROP_EVENT_ID)))
-                if (!(name = ca_strdup(n))) {
-                        ret = CA_ERROR_OOM;
-                        goto finish_unlocked;
-                }
-
-        if ((vol = pa_proplist_gets(l, CA_PROP_CANBERRA_VOLUME))) {
-                char *e = NULL;
-                double dvol;
+        if ((ret = ca_get_latency(c, proplist, &latency)) < 0)
+                goto finish_unlocked;
 
-                errno = 0;
-                dvol = strtod(vol, &e);
-                if (errno != 0 || !e || *e) {
-                        ret = CA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
+        if ((ret = ca_get_realtime(c, proplist, &realtime)) < 0)
+                goto finish_unlocked;
 
-                v = pa_sw_volume_from_dB(dvol);
-                volume_set = TRUE;
+        /* We cannot remap cached samples, so let's fail when cacheing
+         * shall be used */
+        if (position != PA_CHANNEL_POSITION_INVALID && cache_control != CA_CACHE_CONTROL_NEVER) {
+                ret = CA_ERROR_NOTSUPPORTED;
+                goto finish_unlocked;
         }
 
-        if ((ct = pa_proplist_gets(l, CA_PROP_CANBERRA_CACHE_CONTROL)))
-                if ((ret = ca_parse_cache_control(&cache_control, ct)) < 0) {
-                        ret = CA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-        if ((channel = pa_proplist_gets(l, CA_PROP_CANBERRA_FORCE_CHANNEL))) {
-                pa_channel_map t;
-
-                if (!pa_channel_map_parse(&t, channel) ||
-                    t.channels != 1) {
-                        ret = CA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-                position = t.map[0];
+        /* Only the per-play properties are converted here, the server
+         * already knows the context properties */
+        if ((ret = convert_proplist(&l, proplist, strip_play)) < 0)
+                goto finish_unlocked;
 
-                /* We cannot remap cached samples, so let's fail when cacheing
-                 * shall be used */
-                if (cache_control != CA_CACHE_CONTROL_NEVER) {
-                        ret = CA_ERROR_NOTSUPPORTED;
+        if ((n = pa_proplist_gets(l, CA_PROP_EVENT_ID)))
+                if (!(name = ca_strdup(n))) {
+                        ret = CA_ERROR_OOM;
                         goto finish_unlocked;
                 }
-        }
 
-        strip_prefix(l, "canberra.");
         add_common(l);
 
         if ((ret = subscribe(c)) < 0)
@@ -1025,6 +1170,13 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
                 goto finish_locked;
         }
 
+        /* Only streams are fed from our side, samples are played by
+         * the server alone */
+        if (realtime && !p->realtime) {
+                pa_mainloop_api_once(pa_threaded_mainloop_get_api(p->mainloop), realtime_cb, NULL);
+                p->realtime = TRUE;
+        }
+
         if (!(out->stream = pa_stream_new_with_proplist(p->context, NULL, &ss, cm_good ? &cm : NULL, l))) {
                 ret = translate_error(pa_context_errno(p->context));
                 goto finish_locked;
@@ -1036,22 +1188,32 @@ int driver_play(ca_context *c, uint32_t id, ca_proplist *proplist, ca_finish_cal
         if (volume_set)
                 pa_cvolume_set(&cvol, ss.channels, v);
 
-        /* Make sure we get the longest latency possible, to minimize CPU
-         * consumption */
+        /* Unless asked otherwise make sure we get the longest latency
+         * possible, to minimize CPU consumption */
         ba.maxlength = (uint32_t) -1;
         ba.tlength = (uint32_t) -1;
         ba.prebuf = (uint32_t) -1;
         ba.minreq = (uint32_t) -1;
         ba.fragsize = (uint32_t) -1;
 
-        if (pa_stream_connect_playback(out->stream, c->device, &ba,
+        flags =
 #ifdef PA_STREAM_FAIL_ON_SUSPEND
-                                       PA_STREAM_FAIL_ON_SUSPEND
+                PA_STREAM_FAIL_ON_SUSPEND
 #else
-                                       0
+                0
 #endif
-                                       | (position != PA_CHANNEL_POSITION_INVALID ? PA_STREAM_NO_REMIX_CHANNELS : 0)
-                                       , volume_set ? &cvol : NULL, NULL) < 0) {
+                | (position != PA_CHANNEL_POSITION_INVALID ? PA_STREAM_NO_REMIX_CHANNELS : 0);
+
+        if (latency != CA_LATENCY_DEFAULT && latency != CA_LATENCY_POWERSAVE) {
+                /* Ask the server to size the whole pipeline down to the
+                 * sink for this latency, and start playback as soon as
+                 * that much is buffered */
+                ba.tlength = (uint32_t) pa_usec_to_bytes((pa_usec_t) latency, &ss);
+                ba.prebuf = ba.tlength;
+                flags |= PA_STREAM_ADJUST_LATENCY;
+        }
+
+        if (pa_stream_connect_playback(out->stream, c->device, &ba, flags, volume_set ? &cvol : NULL, NULL) < 0) {
                 ret = translate_error(pa_context_errno(p->context));
                 goto finish_locked;
         }
@@ -1094,7 +1256,7 @@ finish_locked:
                 out->clean_up = TRUE;
 
                 ca_mutex_lock(p->outstanding_mutex);
-                CA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+                outstanding_link(p, out);
                 ca_mutex_unlock(p->outstanding_mutex);
         } else
                 outstanding_free(out);
@@ -1116,11 +1278,183 @@ finish_unlocked:
         return ret;
 }
 
+struct sample_job {
+        struct outstanding *out;
+        pa_proplist *l;
+        const char *name;
+        pa_volume_t v;
+        pa_operation *o;
+};
+
+int driver_play_many(ca_context *c, ca_play_request *r, unsigned n) {
+        struct private *p;
+        struct sample_job *jobs;
+        ca_bool_t *fallback;
+        unsigned i, n_samples = 0;
+        int ret = CA_SUCCESS;
+
+        ca_return_val_if_fail(c, CA_ERROR_INVALID);
+        ca_return_val_if_fail(r || n <= 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(c->private, CA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        ca_return_val_if_fail(p->mainloop, CA_ERROR_STATE);
+
+        if (n <= 0)
+                return CA_SUCCESS;
+
+        jobs = ca_new0(struct sample_job, n);
+        fallback = ca_new0(ca_bool_t, n);
+
+        if (!jobs || !fallback) {
+                ca_free(jobs);
+                ca_free(fallback);
+                return ca_play_many_each(c, r, n, driver_play);
+        }
+
+        /* Figure out which requests can be played from the sample
+         * cache, everything else takes the normal path below */
+        for (i = 0; i < n; i++) {
+                struct sample_job *j = jobs + i;
+                ca_cache_control_t cache_control = CA_CACHE_CONTROL_NEVER;
+                pa_channel_position_t position = PA_CHANNEL_POSITION_INVALID;
+                ca_bool_t volume_set = FALSE;
+
+                if (r[i].error < 0)
+                        continue;
+
+                fallback[i] = TRUE;
+                j->v = PLAY_VOLUME_DEFAULT;
+
+                if (parse_canberra_props(r[i].proplist, &j->v, &volume_set, &cache_control, &position) < 0 ||
+                    cache_control == CA_CACHE_CONTROL_NEVER ||
+                    position != PA_CHANNEL_POSITION_INVALID)
+                        continue;
+
+                if (convert_proplist(&j->l, r[i].proplist, strip_play) < 0)
+                        continue;
+
+                if (!(j->name = pa_proplist_gets(j->l, CA_PROP_EVENT_ID)) ||
+                    !(j->out = ca_new0(struct outstanding, 1))) {
+                        pa_proplist_free(j->l);
+                        j->l = NULL;
+                        continue;
+                }
+
+                j->out->type = OUTSTANDING_SAMPLE;
+                j->out->context = c;
+                j->out->sink_input = PA_INVALID_INDEX;
+                j->out->id = r[i].id;
+                j->out->callback = r[i].callback;
+                j->out->userdata = r[i].userdata;
+
+                add_common(j->l);
+
+                fallback[i] = FALSE;
+                n_samples++;
+        }
+
+        if (n_samples > 0 && subscribe(c) == CA_SUCCESS) {
+
+                /* Issue all play requests first and only then wait
+                 * for the replies, so that we pay for only one round
+                 * trip to the server */
+                pa_threaded_mainloop_lock(p->mainloop);
+
+                for (i = 0; i < n; i++) {
+                        struct sample_job *j = jobs + i;
+
+                        if (!j->out || !p->context)
+                                continue;
+
+                        if (!(j->o = pa_context_play_sample_with_proplist(p->context, j->name, c->device, j->v, j->l, play_sample_cb, j->out)))
+                                j->out->error = translate_error(pa_context_errno(p->context));
+                }
+
+                for (i = 0; i < n; i++) {
+                        struct sample_job *j = jobs + i;
+                        ca_bool_t canceled = FALSE;
+
+                        if (!j->out)
+                                continue;
+
+                        if (j->o) {
+                                for (;;) {
+                                        pa_operation_state_t state = pa_operation_get_state(j->o);
+
+                                        if (state == PA_OPERATION_DONE)
+                                                break;
+                                        else if (state == PA_OPERATION_CANCELED) {
+                                                canceled = TRUE;
+                                                break;
+                                        }
+
+                                        pa_threaded_mainloop_wait(p->mainloop);
+                                }
+
+                                pa_operation_unref(j->o);
+                                j->o = NULL;
+
+                        } else if (j->out->error == CA_SUCCESS)
+                                /* We had no connection to issue it on */
+                                canceled = TRUE;
+
+                        if (canceled || !p->context)
+                                r[i].error = CA_ERROR_DISCONNECTED;
+                        else if (j->out->error == CA_ERROR_NOTFOUND)
+                                /* Not in the cache, we need to play it directly */
+                                fallback[i] = TRUE;
+                        else
+                                r[i].error = j->out->error;
+
+                        /* We keep the outstanding struct around to clean up later if the sound din't finish yet*/
+                        if (r[i].error == CA_SUCCESS && !fallback[i] && !j->out->finished) {
+                                j->out->clean_up = TRUE;
+
+                                ca_mutex_lock(p->outstanding_mutex);
+                                outstanding_link(p, j->out);
+                                ca_mutex_unlock(p->outstanding_mutex);
+                        } else
+                                outstanding_free(j->out);
+
+                        j->out = NULL;
+                }
+
+                pa_threaded_mainloop_unlock(p->mainloop);
+        }
+
+        for (i = 0; i < n; i++) {
+                struct sample_job *j = jobs + i;
+
+                /* Only left over if we failed to subscribe */
+                if (j->out) {
+                        outstanding_free(j->out);
+                        fallback[i] = TRUE;
+                }
+
+                if (j->l)
+                        pa_proplist_free(j->l);
+
+                if (fallback[i])
+                        r[i].error = driver_play(c, r[i].id, r[i].proplist, r[i].callback, r[i].userdata);
+
+                if (ret == CA_SUCCESS && r[i].error < 0)
+                        ret = r[i].error;
+        }
+
+        ca_free(jobs);
+        ca_free(fallback);
+
+        return ret;
+}
+
 int driver_cancel(ca_context *c, uint32_t id) {
         struct private *p;
         pa_operation *o;
         int ret = CA_SUCCESS;
-        struct outstanding *out, *n;
+        struct outstanding *out;
+        ca_id_link *l, *n;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -1141,12 +1475,12 @@ int driver_cancel(ca_context *c, uint32_t id) {
         /* We start these asynchronously and don't care about the return
          * value */
 
-        for (out = p->outstanding; out; out = n) {
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = n) {
                 int ret2 = CA_SUCCESS;
-                n = out->next;
+                n = ca_id_table_next(l);
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
                 if (out->type == OUTSTANDING_UPLOAD ||
-                    out->id != id ||
                     out->sink_input == PA_INVALID_INDEX)
                         continue;
 
@@ -1166,7 +1500,7 @@ int driver_cancel(ca_context *c, uint32_t id) {
                         out->callback(c, out->id, CA_ERROR_CANCELED, out->userdata);
 
                 outstanding_disconnect(out);
-                CA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 outstanding_free(out);
         }
 
@@ -1180,11 +1514,11 @@ int driver_cancel(ca_context *c, uint32_t id) {
 int driver_cache(ca_context *c, ca_proplist *proplist) {
         struct private *p;
         pa_proplist *l = NULL;
-        const char *n, *ct;
         pa_sample_spec ss;
         pa_channel_map cm;
         ca_bool_t cm_good;
         ca_cache_control_t cache_control = CA_CACHE_CONTROL_PERMANENT;
+        pa_channel_position_t position = PA_CHANNEL_POSITION_INVALID;
         struct outstanding *out;
         int ret;
         char *sp;
@@ -1206,33 +1540,27 @@ int driver_cache(ca_context *c, ca_proplist *proplist) {
         out->context = c;
         out->sink_input = PA_INVALID_INDEX;
 
-        if ((ret = convert_proplist(&l, proplist)) < 0)
+        if ((ret = parse_canberra_props(proplist, NULL, NULL, &cache_control, &position)) < 0)
                 goto finish_unlocked;
 
-        if (!(n = pa_proplist_gets(l, CA_PROP_EVENT_ID))) {
+        if (cache_control != CA_CACHE_CONTROL_PERMANENT) {
                 ret = CA_ERROR_INVALID;
                 goto finish_unlocked;
         }
 
-        if ((ct = pa_proplist_gets(l, CA_PROP_CANBERRA_CACHE_CONTROL)))
-                if ((ret = ca_parse_cache_control(&cache_control, ct)) < 0) {
-                        ret = CA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-        if (cache_control != CA_CACHE_CONTROL_PERMANENT) {
-                ret = CA_ERROR_INVALID;
+        if (position != PA_CHANNEL_POSITION_INVALID) {
+                ret = CA_ERROR_NOTSUPPORTED;
                 goto finish_unlocked;
         }
 
-        if ((ct = pa_proplist_gets(l, CA_PROP_CANBERRA_FORCE_CHANNEL))) {
-                ret = CA_ERROR_NOTSUPPORTED;
+        if ((ret = convert_proplist(&l, proplist, strip_upload)) < 0)
+                goto finish_unlocked;
+
+        if (!pa_proplist_contains(l, CA_PROP_EVENT_ID)) {
+                ret = CA_ERROR_INVALID;
                 goto finish_unlocked;
         }
 
-        strip_prefix(l, "canberra.");
-        strip_prefix(l, "event.mouse.");
-        strip_prefix(l, "window.");
         add_common(l);
 
         /* Let's stream the sample directly */
@@ -1316,6 +1644,7 @@ finish_unlocked:
 int driver_playing(ca_context *c, uint32_t id, int *playing) {
         struct private *p;
         struct outstanding *out;
+        ca_id_link *l;
 
         ca_return_val_if_fail(c, CA_ERROR_INVALID);
         ca_return_val_if_fail(c->private, CA_ERROR_STATE);
@@ -1327,10 +1656,10 @@ int driver_playing(ca_context *c, uint32_t id, int *playing) {
 
         ca_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (l = ca_id_table_first(&p->outstanding_by_id, id); l; l = ca_id_table_next(l)) {
+                out = CA_ID_TABLE_ENTRY(l, struct outstanding, by_id);
 
                 if (out->type == OUTSTANDING_UPLOAD ||
-                    out->id != id ||
                     out->sink_input == PA_INVALID_INDEX)
                         continue;
 
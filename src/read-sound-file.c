@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#include <sys/stat.h>
 #include <errno.h>
 
 #include "read-sound-file.h"
@@ -41,12 +42,50 @@ struct ca_sound_file {
         unsigned nchannels;
         unsigned rate;
         ca_sample_type_t type;
+
+        ca_sound_file_info info;
 };
 
+static void fill_info(ca_sound_file *f, const struct stat *st) {
+        const ca_channel_position_t *m;
+
+        f->info.type = f->type;
+        f->info.nchannels = f->nchannels;
+        f->info.rate = f->rate;
+
+        if (f->wav) {
+                f->info.container = CA_SOUND_FILE_CONTAINER_WAV;
+                f->info.data_offset = ca_wav_get_data_offset(f->wav);
+                f->info.data_size = ca_wav_get_size(f->wav);
+                m = ca_wav_get_channel_map(f->wav);
+        } else {
+                f->info.container = CA_SOUND_FILE_CONTAINER_VORBIS;
+                f->info.data_size = ca_vorbis_get_size(f->vorbis);
+                m = ca_vorbis_get_channel_map(f->vorbis);
+        }
+
+        if (m && f->nchannels <= _CA_CHANNEL_POSITION_MAX) {
+                memcpy(f->info.channel_map, m, sizeof(ca_channel_position_t) * f->nchannels);
+                f->info.has_channel_map = 1;
+        }
+
+        /* If we couldn't stat the file we cannot tell when it changed,
+         * hence we don't hand out the information at all */
+        if (!st) {
+                f->info.container = CA_SOUND_FILE_CONTAINER_INVALID;
+                return;
+        }
+
+        f->info.file_size = st->st_size;
+        f->info.file_mtime = st->st_mtime;
+}
+
 int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
         FILE *file;
         ca_sound_file *f;
         int ret;
+        struct stat st;
+        ca_bool_t have_st;
 
         ca_return_val_if_fail(_f, CA_ERROR_INVALID);
         ca_return_val_if_fail(fn, CA_ERROR_INVALID);
@@ -64,10 +103,13 @@ int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
                 goto fail;
         }
 
+        have_st = fstat(fileno(file), &st) >= 0;
+
         if ((ret = ca_wav_open(&f->wav, file)) == CA_SUCCESS) {
                 f->nchannels = ca_wav_get_nchannels(f->wav);
                 f->rate = ca_wav_get_rate(f->wav);
                 f->type = ca_wav_get_sample_type(f->wav);
+                fill_info(f, have_st ? &st : NULL);
                 *_f = f;
                 return CA_SUCCESS;
         }
@@ -83,6 +125,7 @@ int ca_sound_file_open(ca_sound_file **_f, const char *fn) {
                         f->nchannels = ca_vorbis_get_nchannels(f->vorbis);
                         f->rate = ca_vorbis_get_rate(f->vorbis);
                         f->type = CA_SAMPLE_S16NE;
+                        fill_info(f, have_st ? &st : NULL);
                         *_f = f;
                         return CA_SUCCESS;
                 }
@@ -96,6 +139,79 @@ fail:
         return ret;
 }
 
+int ca_sound_file_open_with_info(ca_sound_file **_f, const char *fn, const ca_sound_file_info *i) {
+        FILE *file = NULL;
+        ca_sound_file *f;
+        struct stat st;
+        int ret;
+
+        ca_return_val_if_fail(_f, CA_ERROR_INVALID);
+        ca_return_val_if_fail(fn, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i->container > CA_SOUND_FILE_CONTAINER_INVALID && i->container < _CA_SOUND_FILE_CONTAINER_MAX, CA_ERROR_INVALID);
+
+        if (!(f = ca_new0(ca_sound_file, 1)))
+                return CA_ERROR_OOM;
+
+        if (!(f->filename = ca_strdup(fn))) {
+                ret = CA_ERROR_OOM;
+                goto fail;
+        }
+
+        if (!(file = fopen(fn, "r"))) {
+                ret = errno == ENOENT ? CA_ERROR_NOTFOUND : CA_ERROR_SYSTEM;
+                goto fail;
+        }
+
+        if (fstat(fileno(file), &st) < 0) {
+                ret = CA_ERROR_SYSTEM;
+                goto fail;
+        }
+
+        /* Did the file change since the information was collected? */
+        if (st.st_size != i->file_size || st.st_mtime != i->file_mtime) {
+                ret = CA_ERROR_CORRUPT;
+                goto fail;
+        }
+
+        if (i->container == CA_SOUND_FILE_CONTAINER_WAV)
+                ret = ca_wav_open_with_info(&f->wav, file, i);
+        else
+                ret = ca_vorbis_open_with_info(&f->vorbis, file, i);
+
+        if (ret < 0)
+                goto fail;
+
+        f->nchannels = i->nchannels;
+        f->rate = i->rate;
+        f->type = i->type;
+        f->info = *i;
+
+        *_f = f;
+        return CA_SUCCESS;
+
+fail:
+
+        if (file)
+                fclose(file);
+
+        ca_free(f->filename);
+        ca_free(f);
+
+        return ret;
+}
+
+int ca_sound_file_get_info(ca_sound_file *f, ca_sound_file_info *i) {
+        ca_return_val_if_fail(f, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i, CA_ERROR_INVALID);
+
+        if (f->info.container == CA_SOUND_FILE_CONTAINER_INVALID)
+                return CA_ERROR_NOTAVAILABLE;
+
+        *i = f->info;
+        return CA_SUCCESS;
+}
+
 void ca_sound_file_close(ca_sound_file *f) {
         ca_assert(f);
 
@@ -126,10 +242,7 @@ ca_sample_type_t ca_sound_file_get_sample_type(ca_sound_file *f) {
 const ca_channel_position_t* ca_sound_file_get_channel_map(ca_sound_file *f) {
         ca_assert(f);
 
-        if (f->wav)
-                return ca_wav_get_channel_map(f->wav);
-        else
-                return ca_vorbis_get_channel_map(f->vorbis);
+        return f->info.has_channel_map ? f->info.channel_map : NULL;
 }
 
 int ca_sound_file_read_int16(ca_sound_file *f, int16_t *d, size_t *n) {
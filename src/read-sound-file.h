@@ -25,6 +25,7 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include <time.h>
 
 typedef enum ca_sample_type {
         CA_SAMPLE_S16NE,
@@ -55,9 +56,34 @@ typedef enum ca_channel_position {
         _CA_CHANNEL_POSITION_MAX
 } ca_channel_position_t;
 
+typedef enum ca_sound_file_container {
+        CA_SOUND_FILE_CONTAINER_INVALID,
+        CA_SOUND_FILE_CONTAINER_WAV,
+        CA_SOUND_FILE_CONTAINER_VORBIS,
+        _CA_SOUND_FILE_CONTAINER_MAX
+} ca_sound_file_container_t;
+
+/* Everything we learn about a file when probing it, so that it can be
+ * opened again later on without parsing the headers. The file size
+ * and modification time are used to detect that the file changed. */
+typedef struct ca_sound_file_info {
+        ca_sound_file_container_t container;
+        ca_sample_type_t type;
+        unsigned nchannels;
+        unsigned rate;
+        int has_channel_map;
+        ca_channel_position_t channel_map[_CA_CHANNEL_POSITION_MAX];
+        off_t data_offset;
+        off_t data_size;
+        off_t file_size;
+        time_t file_mtime;
+} ca_sound_file_info;
+
 typedef struct ca_sound_file ca_sound_file;
 
 int ca_sound_file_open(ca_sound_file **f, const char *fn);
+int ca_sound_file_open_with_info(ca_sound_file **f, const char *fn, const ca_sound_file_info *i);
+int ca_sound_file_get_info(ca_sound_file *f, ca_sound_file_info *i);
 void ca_sound_file_close(ca_sound_file *f);
 
 unsigned ca_sound_file_get_nchannels(ca_sound_file *f);
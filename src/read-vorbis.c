@@ -68,6 +68,24 @@ static int convert_error(int or) {
         }
 }
 
+static size_t read_func(void *ptr, size_t size, size_t nmemb, void *datasource) {
+        return fread(ptr, size, nmemb, datasource);
+}
+
+static int close_func(void *datasource) {
+        return fclose(datasource);
+}
+
+/* Without a seek function libvorbisfile treats the file as a stream
+ * and reads only the headers instead of scanning the whole file for
+ * the total length. */
+static const ov_callbacks stream_callbacks = {
+        .read_func = read_func,
+        .seek_func = NULL,
+        .close_func = close_func,
+        .tell_func = NULL
+};
+
 int ca_vorbis_open(ca_vorbis **_v, FILE *f)  {
         int ret, or;
         ca_vorbis *v;
@@ -108,6 +126,39 @@ fail:
         return ret;
 }
 
+int ca_vorbis_open_with_info(ca_vorbis **_v, FILE *f, const ca_sound_file_info *i)  {
+        int ret, or;
+        ca_vorbis *v;
+
+        ca_return_val_if_fail(_v, CA_ERROR_INVALID);
+        ca_return_val_if_fail(f, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i->container == CA_SOUND_FILE_CONTAINER_VORBIS, CA_ERROR_INVALID);
+
+        if (i->data_size < 0)
+                return CA_ERROR_CORRUPT;
+
+        if (!(v = ca_new0(ca_vorbis, 1)))
+                return CA_ERROR_OOM;
+
+        if ((or = ov_open_callbacks(f, &v->ovf, NULL, 0, stream_callbacks)) < 0) {
+                ret = convert_error(or);
+                goto fail;
+        }
+
+        /* The length is known already, no need for ov_pcm_total() */
+        v->size = i->data_size;
+
+        *_v = v;
+
+        return CA_SUCCESS;
+
+fail:
+
+        ca_free(v);
+        return ret;
+}
+
 void ca_vorbis_close(ca_vorbis *v) {
         ca_assert(v);
 
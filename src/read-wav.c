@@ -79,6 +79,7 @@ struct ca_wav {
         FILE *file;
 
         off_t data_size;
+        off_t data_offset;
         unsigned nchannels;
         unsigned rate;
         unsigned depth;
@@ -231,6 +232,11 @@ int ca_wav_open(ca_wav **_w, FILE *f)  {
                 goto fail;
         }
 
+        if ((w->data_offset = ftello(f)) < 0) {
+                ret = CA_ERROR_SYSTEM;
+                goto fail;
+        }
+
         *_w = w;
 
         return CA_SUCCESS;
@@ -251,6 +257,40 @@ fail:
         return ret;
 }
 
+int ca_wav_open_with_info(ca_wav **_w, FILE *f, const ca_sound_file_info *i) {
+        ca_wav *w;
+
+        ca_return_val_if_fail(_w, CA_ERROR_INVALID);
+        ca_return_val_if_fail(f, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i->container == CA_SOUND_FILE_CONTAINER_WAV, CA_ERROR_INVALID);
+        ca_return_val_if_fail(i->nchannels > 0 && i->rate > 0, CA_ERROR_INVALID);
+
+        if (i->data_offset <= 0 || i->data_size < 0 || i->data_size >= (off_t) FILE_SIZE_MAX)
+                return CA_ERROR_CORRUPT;
+
+        if (!(w = ca_new0(ca_wav, 1)))
+                return CA_ERROR_OOM;
+
+        w->file = f;
+        w->nchannels = i->nchannels;
+        w->rate = i->rate;
+        w->depth = i->type == CA_SAMPLE_U8 ? 8 : 16;
+        w->data_size = i->data_size;
+        w->data_offset = i->data_offset;
+
+        /* The headers have been parsed before, go directly to the
+         * PCM data */
+        if (fseeko(f, i->data_offset, SEEK_SET) < 0) {
+                ca_free(w);
+                return CA_ERROR_SYSTEM;
+        }
+
+        *_w = w;
+
+        return CA_SUCCESS;
+}
+
 void ca_wav_close(ca_wav *w) {
         ca_assert(w);
 
@@ -364,3 +404,9 @@ off_t ca_wav_get_size(ca_wav *v) {
 
         return v->data_size;
 }
+
+off_t ca_wav_get_data_offset(ca_wav *v) {
+        ca_return_val_if_fail(v, (off_t) -1);
+
+        return v->data_offset;
+}
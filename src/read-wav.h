@@ -30,6 +30,7 @@
 typedef struct ca_wav ca_wav;
 
 int ca_wav_open(ca_wav **v, FILE *f);
+int ca_wav_open_with_info(ca_wav **v, FILE *f, const ca_sound_file_info *i);
 void ca_wav_close(ca_wav *f);
 
 unsigned ca_wav_get_nchannels(ca_wav *f);
@@ -41,5 +42,6 @@ int ca_wav_read_u8(ca_wav *f, uint8_t *d, size_t *n);
 int ca_wav_read_s16le(ca_wav *f, int16_t *d, size_t *n);
 
 off_t ca_wav_get_size(ca_wav *f);
+off_t ca_wav_get_data_offset(ca_wav *f);
 
 #endif
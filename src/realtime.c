@@ -0,0 +1,500 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_DBUS
+#include <dbus/dbus.h>
+#endif
+
+#include "canberra.h"
+#include "realtime.h"
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+#include "llist.h"
+
+/* We only feed the audio device, so we stay below the sound server,
+ * which usually runs at 5 */
+#define REALTIME_PRIORITY 3
+
+/* RealtimeKit only deals with kernel thread ids, which are Linux
+ * specific */
+#if defined(HAVE_DBUS) && defined(__linux__)
+#define USE_RTKIT 1
+#endif
+
+/* Picks the SCHED_FIFO priority we may use. Unprivileged processes may
+ * only go as high as RLIMIT_RTPRIO, and not at all if that is 0. */
+static int fifo_param(int *policy, struct sched_param *param) {
+#ifdef SCHED_FIFO
+        struct rlimit rl;
+        int priority = REALTIME_PRIORITY;
+
+        if (getuid() != 0) {
+#ifdef RLIMIT_RTPRIO
+                if (getrlimit(RLIMIT_RTPRIO, &rl) < 0)
+                        return CA_ERROR_SYSTEM;
+
+                if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (rlim_t) priority)
+                        priority = (int) rl.rlim_cur;
+
+                if (priority <= 0)
+                        return CA_ERROR_ACCESS;
+#else
+                return CA_ERROR_ACCESS;
+#endif
+        }
+
+        *policy = SCHED_FIFO;
+
+#ifdef SCHED_RESET_ON_FORK
+        /* Children of the application should not inherit this */
+        *policy |= SCHED_RESET_ON_FORK;
+#endif
+
+        memset(param, 0, sizeof(*param));
+        param->sched_priority = priority;
+
+        return CA_SUCCESS;
+#else
+        return CA_ERROR_NOTSUPPORTED;
+#endif
+}
+
+static int set_fifo(void) {
+        struct sched_param param;
+        int policy, ret;
+
+        if ((ret = fifo_param(&policy, &param)) < 0)
+                return ret;
+
+        if (pthread_setschedparam(pthread_self(), policy, &param) != 0)
+                return CA_ERROR_ACCESS;
+
+        return CA_SUCCESS;
+}
+
+#ifdef USE_RTKIT
+
+#define RTKIT_SERVICE_NAME "org.freedesktop.RealtimeKit1"
+#define RTKIT_OBJECT_PATH "/org/freedesktop/RealtimeKit1"
+
+/* How long we wait for RealtimeKit to answer. We do that in a helper
+ * thread, so this only bounds how long that thread hangs around. */
+#define RTKIT_TIMEOUT_MSEC (5*1000)
+
+#define RTKIT_STACK_SIZE (64*1024)
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+static ca_mutex *mutex = NULL;
+
+/* Once RealtimeKit turned out to be unavailable we don't bother it
+ * again */
+static ca_bool_t rtkit_failed = FALSE;
+
+/* Requests that haven't been answered yet. A thread that doesn't need
+ * real-time scheduling anymore by the time RealtimeKit answers is
+ * dropped back right away. */
+struct rtkit_pending {
+        CA_LLIST_FIELDS(struct rtkit_pending);
+        pid_t tid;
+        ca_bool_t cancelled;
+};
+
+static CA_LLIST_HEAD(struct rtkit_pending, pending) = NULL;
+
+static void allocate_mutex_once(void) {
+        mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        if (pthread_once(&once, allocate_mutex_once) != 0)
+                return CA_ERROR_OOM;
+
+        if (!mutex)
+                return CA_ERROR_OOM;
+
+        return 0;
+}
+
+static int translate_error(const char *name) {
+
+        if (ca_streq(name, DBUS_ERROR_NO_MEMORY))
+                return CA_ERROR_OOM;
+        if (ca_streq(name, DBUS_ERROR_SERVICE_UNKNOWN) ||
+            ca_streq(name, DBUS_ERROR_NAME_HAS_NO_OWNER))
+                return CA_ERROR_NOTAVAILABLE;
+        if (ca_streq(name, DBUS_ERROR_INVALID_ARGS) ||
+            ca_streq(name, DBUS_ERROR_UNKNOWN_METHOD))
+                return CA_ERROR_NOTSUPPORTED;
+        if (ca_streq(name, DBUS_ERROR_ACCESS_DENIED) ||
+            ca_streq(name, DBUS_ERROR_AUTH_FAILED))
+                return CA_ERROR_ACCESS;
+
+        return CA_ERROR_IO;
+}
+
+static int rtkit_call(DBusConnection *connection, DBusMessage *m, DBusMessage **_reply) {
+        DBusMessage *reply;
+        DBusError error;
+        int ret;
+
+        dbus_error_init(&error);
+
+        if (!(reply = dbus_connection_send_with_reply_and_block(connection, m, RTKIT_TIMEOUT_MSEC, &error))) {
+                ret = translate_error(error.name);
+                dbus_error_free(&error);
+                return ret;
+        }
+
+        if (dbus_set_error_from_message(&error, reply)) {
+                ret = translate_error(error.name);
+                dbus_error_free(&error);
+                dbus_message_unref(reply);
+                return ret;
+        }
+
+        *_reply = reply;
+        return CA_SUCCESS;
+}
+
+static int rtkit_get_int_property(DBusConnection *connection, const char *property, long long *value) {
+        const char *interface = RTKIT_SERVICE_NAME;
+        DBusMessage *m, *reply = NULL;
+        DBusMessageIter iter, sub;
+        int ret, type;
+
+        if (!(m = dbus_message_new_method_call(RTKIT_SERVICE_NAME, RTKIT_OBJECT_PATH, "org.freedesktop.DBus.Properties", "Get")))
+                return CA_ERROR_OOM;
+
+        if (!dbus_message_append_args(m,
+                                      DBUS_TYPE_STRING, &interface,
+                                      DBUS_TYPE_STRING, &property,
+                                      DBUS_TYPE_INVALID)) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+        }
+
+        if ((ret = rtkit_call(connection, m, &reply)) < 0)
+                goto finish;
+
+        ret = CA_ERROR_IO;
+
+        if (!dbus_message_iter_init(reply, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+                goto finish;
+
+        dbus_message_iter_recurse(&iter, &sub);
+        type = dbus_message_iter_get_arg_type(&sub);
+
+        if (type == DBUS_TYPE_INT32) {
+                dbus_int32_t i;
+
+                dbus_message_iter_get_basic(&sub, &i);
+                *value = (long long) i;
+                ret = CA_SUCCESS;
+
+        } else if (type == DBUS_TYPE_INT64) {
+                dbus_int64_t i;
+
+                dbus_message_iter_get_basic(&sub, &i);
+                *value = (long long) i;
+                ret = CA_SUCCESS;
+        }
+
+finish:
+
+        if (reply)
+                dbus_message_unref(reply);
+
+        dbus_message_unref(m);
+
+        return ret;
+}
+
+static int rtkit_make_realtime(DBusConnection *connection, pid_t tid, int priority) {
+        dbus_uint64_t u64 = (dbus_uint64_t) tid;
+        dbus_uint32_t u32 = (dbus_uint32_t) priority;
+        DBusMessage *m, *reply = NULL;
+        int ret;
+
+        if (!(m = dbus_message_new_method_call(RTKIT_SERVICE_NAME, RTKIT_OBJECT_PATH, RTKIT_SERVICE_NAME, "MakeThreadRealtime")))
+                return CA_ERROR_OOM;
+
+        if (!dbus_message_append_args(m,
+                                      DBUS_TYPE_UINT64, &u64,
+                                      DBUS_TYPE_UINT32, &u32,
+                                      DBUS_TYPE_INVALID)) {
+                ret = CA_ERROR_OOM;
+                goto finish;
+        }
+
+        ret = rtkit_call(connection, m, &reply);
+
+finish:
+
+        if (reply)
+                dbus_message_unref(reply);
+
+        dbus_message_unref(m);
+
+        return ret;
+}
+
+static int rtkit_request(pid_t tid) {
+        DBusConnection *connection;
+        DBusError error;
+        struct rlimit rl;
+        long long max_priority, rttime;
+        int ret;
+
+        dbus_error_init(&error);
+
+        if (!(connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error))) {
+                dbus_error_free(&error);
+                return CA_ERROR_NOTAVAILABLE;
+        }
+
+        dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+        if ((ret = rtkit_get_int_property(connection, "MaxRealtimePriority", &max_priority)) < 0)
+                goto finish;
+
+        if ((ret = rtkit_get_int_property(connection, "RTTimeUSecMax", &rttime)) < 0)
+                goto finish;
+
+        if (max_priority <= 0) {
+                ret = CA_ERROR_ACCESS;
+                goto finish;
+        }
+
+        /* RealtimeKit refuses to help unless we promise not to hog the
+         * CPU for longer than it allows */
+        if (getrlimit(RLIMIT_RTTIME, &rl) < 0) {
+                ret = CA_ERROR_SYSTEM;
+                goto finish;
+        }
+
+        if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (rlim_t) rttime) {
+                rl.rlim_cur = (rlim_t) rttime;
+
+                if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < rl.rlim_cur)
+                        rl.rlim_cur = rl.rlim_max;
+                else
+                        rl.rlim_max = rl.rlim_cur;
+
+                if (setrlimit(RLIMIT_RTTIME, &rl) < 0) {
+                        ret = CA_ERROR_SYSTEM;
+                        goto finish;
+                }
+        }
+
+        ret = rtkit_make_realtime(connection, tid, (int) CA_MIN((long long) REALTIME_PRIORITY, max_priority));
+
+finish:
+
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+
+        return ret;
+}
+
+/* Needs the mutex */
+static struct rtkit_pending *pending_find(pid_t tid) {
+        struct rtkit_pending *r;
+
+        for (r = pending; r; r = r->next)
+                if (r->tid == tid)
+                        return r;
+
+        return NULL;
+}
+
+static void* rtkit_thread_func(void *userdata) {
+        struct rtkit_pending *r = userdata;
+        int ret;
+
+        ret = rtkit_request(r->tid);
+
+        ca_mutex_lock(mutex);
+
+        /* Only give up for good if RealtimeKit is missing or refuses
+         * us in general. Other failures, for example because the thread
+         * went away in the meantime, don't mean it won't help the next
+         * one. */
+        if (ret == CA_ERROR_NOTAVAILABLE || ret == CA_ERROR_NOTSUPPORTED || ret == CA_ERROR_ACCESS)
+                rtkit_failed = TRUE;
+
+        if (ret >= 0 && r->cancelled) {
+                struct sched_param param;
+
+                memset(&param, 0, sizeof(param));
+                sched_setscheduler(r->tid, SCHED_OTHER, &param);
+
+        } else if (ret < 0 && !r->cancelled) {
+                struct sched_param param;
+                int policy;
+
+                /* Without RealtimeKit we try on our own, which works
+                 * if RLIMIT_RTPRIO allows it */
+                if (fifo_param(&policy, &param) >= 0)
+                        sched_setscheduler(r->tid, policy, &param);
+        }
+
+        CA_LLIST_REMOVE(struct rtkit_pending, pending, r);
+
+        ca_mutex_unlock(mutex);
+
+        ca_free(r);
+
+        return NULL;
+}
+
+/* Returns CA_SUCCESS if the request is on its way. The helper thread
+ * then falls back to SCHED_FIFO itself if RealtimeKit says no. */
+static int rtkit_start(void) {
+        struct rtkit_pending *r;
+        pthread_attr_t attr;
+        pthread_t thread;
+        size_t stack_size;
+        pid_t tid;
+        int ret;
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        if (!dbus_threads_init_default())
+                return CA_ERROR_OOM;
+
+        tid = (pid_t) syscall(SYS_gettid);
+
+        ca_mutex_lock(mutex);
+
+        if (rtkit_failed) {
+                ret = CA_ERROR_NOTAVAILABLE;
+                goto finish;
+        }
+
+        /* Already asked, and not answered yet */
+        if ((r = pending_find(tid))) {
+                r->cancelled = FALSE;
+                ret = CA_SUCCESS;
+                goto finish;
+        }
+
+        ret = CA_ERROR_OOM;
+
+        if (!(r = ca_new0(struct rtkit_pending, 1)))
+                goto finish;
+
+        r->tid = tid;
+
+        if (pthread_attr_init(&attr) != 0) {
+                ca_free(r);
+                goto finish;
+        }
+
+        stack_size = RTKIT_STACK_SIZE;
+#ifdef PTHREAD_STACK_MIN
+        stack_size = CA_MAX(stack_size, (size_t) PTHREAD_STACK_MIN);
+#endif
+
+        pthread_attr_setstacksize(&attr, stack_size);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if (pthread_create(&thread, &attr, rtkit_thread_func, r) == 0) {
+                CA_LLIST_PREPEND(struct rtkit_pending, pending, r);
+                ret = CA_SUCCESS;
+        } else
+                ca_free(r);
+
+        pthread_attr_destroy(&attr);
+
+finish:
+        ca_mutex_unlock(mutex);
+
+        return ret;
+}
+
+static void rtkit_cancel(void) {
+        struct rtkit_pending *r;
+
+        if (allocate_mutex() < 0)
+                return;
+
+        ca_mutex_lock(mutex);
+
+        if ((r = pending_find((pid_t) syscall(SYS_gettid))))
+                r->cancelled = TRUE;
+
+        ca_mutex_unlock(mutex);
+}
+
+#endif
+
+void ca_realtime_request(void) {
+
+#ifdef USE_RTKIT
+        /* RealtimeKit comes first, since it keeps a runaway thread
+         * from hogging the CPU. Asking it means a few D-Bus round
+         * trips, hence we do that in the background. */
+        if (rtkit_start() >= 0)
+                return;
+#endif
+
+        /* No RealtimeKit, so try on our own, which is a single system
+         * call that doesn't block */
+        set_fifo();
+}
+
+void ca_realtime_drop(void) {
+        struct sched_param param;
+
+#ifdef USE_RTKIT
+        rtkit_cancel();
+#endif
+
+        /* Giving up real-time scheduling is always allowed */
+        memset(&param, 0, sizeof(param));
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
@@ -0,0 +1,36 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef foocanberrarealtimehfoo
+#define foocanberrarealtimehfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+/* Asks for real-time scheduling of the calling thread, first from
+ * RealtimeKit, then directly with SCHED_FIFO if RLIMIT_RTPRIO allows
+ * it. This happens in the background, the calling thread is never
+ * blocked and simply stays at normal priority if both fail. */
+void ca_realtime_request(void);
+
+/* Returns the calling thread to normal scheduling, including when
+ * RealtimeKit only answers a request made earlier later on. */
+void ca_realtime_drop(void);
+
+#endif
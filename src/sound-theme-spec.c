@@ -26,19 +26,51 @@
 
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <locale.h>
+#include <string.h>
 
 #include "sound-theme-spec.h"
 #include "malloc.h"
 #include "llist.h"
 #include "cache.h"
+#include "mutex.h"
 
 #define DEFAULT_THEME "freedesktop"
 #define FALLBACK_THEME "freedesktop"
 #define DEFAULT_OUTPUT_PROFILE "stereo"
 #define N_THEME_DIR_MAX 8
 
+/* Where ca_resolve_sound() stores what it found. Not part of the API,
+ * only lookup_sound() looks at these. */
+#define RESOLVED_FILENAME "canberra.resolved.filename"
+#define RESOLVED_INFO "canberra.resolved.info"
+
+/* This part is not portable due to pthread_once usage, should be abstracted
+ * when we port this to platforms that do not have POSIX threading */
+
+/* Protects the references to the theme data, and the pointers through
+ * which the contexts refer to theme data. Never held while accessing
+ * the file system. */
+static ca_mutex *theme_mutex = NULL;
+
+static void allocate_mutex_once(void) {
+        theme_mutex = ca_mutex_new();
+}
+
+static int allocate_mutex(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        if (pthread_once(&once, allocate_mutex_once) != 0)
+                return CA_ERROR_OOM;
+
+        if (!theme_mutex)
+                return CA_ERROR_OOM;
+
+        return 0;
+}
+
 typedef struct ca_data_dir ca_data_dir;
 
 struct ca_data_dir {
@@ -49,6 +81,10 @@ struct ca_data_dir {
         char *output_profile;
 };
 
+/* Theme data is not changed anymore once it has been loaded, so
+ * lookups may use it without holding a lock. They take a reference
+ * however, since the context might switch to another theme in the
+ * meantime. */
 struct ca_theme_data {
         char *name;
 
@@ -57,6 +93,9 @@ struct ca_theme_data {
 
         unsigned n_theme_dir;
         ca_bool_t loaded_fallback_theme;
+
+        /* Protected by theme_mutex */
+        unsigned n_ref;
 };
 
 int ca_get_data_home(char **e) {
@@ -378,20 +417,51 @@ static int load_theme_dir(ca_theme_data *t, const char *name) {
         return CA_ERROR_NOTFOUND;
 }
 
-static int load_theme_data(ca_theme_data **_t, const char *name) {
-        ca_theme_data *t;
+static void theme_data_free(ca_theme_data *t) {
+        ca_assert(t);
+
+        while (t->data_dirs) {
+                ca_data_dir *d = t->data_dirs;
+
+                CA_LLIST_REMOVE(ca_data_dir, t->data_dirs, d);
+
+                ca_free(d->theme_name);
+                ca_free(d->dir_name);
+                ca_free(d->output_profile);
+                ca_free(d);
+        }
+
+        ca_free(t->name);
+        ca_free(t);
+}
+
+/* Returns a reference to the data of the theme in *_r. If *_t is not
+ * that theme yet, the theme is loaded and replaces it. */
+static int load_theme_data(ca_theme_data **_t, const char *name, ca_theme_data **_r) {
+        ca_theme_data *t, *old;
         int ret;
 
         ca_return_val_if_fail(_t, CA_ERROR_INVALID);
         ca_return_val_if_fail(name, CA_ERROR_INVALID);
+        ca_return_val_if_fail(_r, CA_ERROR_INVALID);
+
+        ca_mutex_lock(theme_mutex);
+
+        if ((t = *_t) && ca_streq(t->name, name)) {
+                t->n_ref++;
+                ca_mutex_unlock(theme_mutex);
+
+                *_r = t;
+                return CA_SUCCESS;
+        }
 
-        if (*_t)
-                if (ca_streq((*_t)->name, name))
-                        return CA_SUCCESS;
+        ca_mutex_unlock(theme_mutex);
 
         if (!(t = ca_new0(ca_theme_data, 1)))
                 return CA_ERROR_OOM;
 
+        t->n_ref = 1;
+
         if (!(t->name = ca_strdup(name))) {
                 ret = CA_ERROR_OOM;
                 goto fail;
@@ -404,17 +474,24 @@ static int load_theme_data(ca_theme_data **_t, const char *name) {
         if (!t->loaded_fallback_theme)
                 load_theme_dir(t, FALLBACK_THEME);
 
-        if (*_t)
-                ca_theme_data_free(*_t);
-
+        /* If another lookup loaded a theme in the meantime we replace
+         * it anyway, the latest one is as good as any */
+        ca_mutex_lock(theme_mutex);
+        old = *_t;
         *_t = t;
+        t->n_ref++;
+        ca_mutex_unlock(theme_mutex);
+
+        if (old)
+                ca_theme_data_free(old);
+
+        *_r = t;
 
         return CA_SUCCESS;
 
 fail:
 
-        if (t)
-                ca_theme_data_free(t);
+        theme_data_free(t);
 
         return ret;
 }
@@ -731,6 +808,7 @@ static int find_sound_for_theme(
                 const char *locale,
                 const char *profile) {
 
+        ca_theme_data *d;
         int ret;
 
         ca_return_val_if_fail(f, CA_ERROR_INVALID);
@@ -741,28 +819,37 @@ static int find_sound_for_theme(
         ca_return_val_if_fail(locale, CA_ERROR_INVALID);
         ca_return_val_if_fail(profile, CA_ERROR_INVALID);
 
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
         /* First, try in the theme itself, and if that fails the fallback theme */
-        if ((ret = load_theme_data(t, theme)) == CA_ERROR_NOTFOUND)
+        if ((ret = load_theme_data(t, theme, &d)) == CA_ERROR_NOTFOUND)
                 if (!ca_streq(theme, FALLBACK_THEME))
-                        ret = load_theme_data(t, FALLBACK_THEME);
+                        ret = load_theme_data(t, FALLBACK_THEME, &d);
+
+        if (ret == CA_SUCCESS) {
+                ret = find_sound_in_theme(f, sfopen, sound_path, d, name, locale, profile);
+                ca_theme_data_free(d);
 
-        if (ret == CA_SUCCESS)
-                if ((ret = find_sound_in_theme(f, sfopen, sound_path, *t, name, locale, profile)) != CA_ERROR_NOTFOUND)
+                if (ret != CA_ERROR_NOTFOUND)
                         return ret;
+        }
 
         /* Then, fall back to "unthemed" files */
         return find_sound_in_theme(f, sfopen, sound_path, NULL, name, locale, profile);
 }
 
-int ca_lookup_sound_with_callback(
+static int lookup_sound(
                 ca_sound_file **f,
                 ca_sound_file_open_callback_t sfopen,
+                ca_sound_file_open_info_callback_t sfopen_info,
                 char **sound_path,
                 ca_theme_data **t,
                 ca_proplist *cp,
                 ca_proplist *sp) {
         int ret = CA_ERROR_INVALID;
         const char *name, *fname;
+        ca_propview v;
 
         ca_return_val_if_fail(f, CA_ERROR_INVALID);
         ca_return_val_if_fail(t, CA_ERROR_INVALID);
@@ -775,29 +862,67 @@ int ca_lookup_sound_with_callback(
         if (sound_path)
                 *sound_path = NULL;
 
-        ca_mutex_lock(cp->mutex);
-        ca_mutex_lock(sp->mutex);
+        /* Looked up in advance by ca_resolve_sound(). If the file went
+         * away in the meantime we look for it again. */
+        if ((fname = ca_proplist_gets_unlocked(sp, RESOLVED_FILENAME))) {
+                ca_prop *i;
+
+                if (sound_path && !(*sound_path = ca_strdup(fname)))
+                        return CA_ERROR_OOM;
+
+                ret = CA_ERROR_CORRUPT;
+
+                if (sfopen_info &&
+                    (i = ca_proplist_get_unlocked(sp, RESOLVED_INFO)) &&
+                    i->nbytes == sizeof(ca_sound_file_info)) {
+                        ca_sound_file_info info;
 
-        if ((name = ca_proplist_gets_unlocked(sp, CA_PROP_EVENT_ID))) {
+                        memcpy(&info, CA_PROP_DATA(i), sizeof(info));
+                        ret = sfopen_info(f, fname, &info);
+                }
+
+                /* The file changed since we looked at it */
+                if (ret == CA_ERROR_CORRUPT)
+                        ret = sfopen(f, fname);
+
+                if (ret != CA_ERROR_NOTFOUND) {
+                        if (ret < 0 && sound_path) {
+                                ca_free(*sound_path);
+                                *sound_path = NULL;
+                        }
+
+                        return ret;
+                }
+
+                if (sound_path) {
+                        ca_free(*sound_path);
+                        *sound_path = NULL;
+                }
+        }
+
+        /* The play properties override the context properties */
+        ca_propview_init(&v);
+        ca_propview_add(&v, sp);
+        ca_propview_add(&v, cp);
+
+        if ((name = ca_proplist_gets_atom_unlocked(sp, CA_ATOM_EVENT_ID))) {
                 const char *theme, *locale, *profile;
 
-                if (!(theme = ca_proplist_gets_unlocked(sp, CA_PROP_CANBERRA_XDG_THEME_NAME)))
-                        if (!(theme = ca_proplist_gets_unlocked(cp, CA_PROP_CANBERRA_XDG_THEME_NAME)))
-                                theme = DEFAULT_THEME;
+                if (!(theme = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_XDG_THEME_NAME)))
+                        theme = DEFAULT_THEME;
 
-                if (!(locale = ca_proplist_gets_unlocked(sp, CA_PROP_MEDIA_LANGUAGE)))
-                        if (!(locale = ca_proplist_gets_unlocked(sp, CA_PROP_APPLICATION_LANGUAGE)))
-                                if (!(locale = ca_proplist_gets_unlocked(cp, CA_PROP_MEDIA_LANGUAGE)))
-                                        if (!(locale = ca_proplist_gets_unlocked(cp, CA_PROP_APPLICATION_LANGUAGE)))
+                if (!(locale = ca_proplist_gets_atom_unlocked(sp, CA_ATOM_MEDIA_LANGUAGE)))
+                        if (!(locale = ca_proplist_gets_atom_unlocked(sp, CA_ATOM_APPLICATION_LANGUAGE)))
+                                if (!(locale = ca_proplist_gets_atom_unlocked(cp, CA_ATOM_MEDIA_LANGUAGE)))
+                                        if (!(locale = ca_proplist_gets_atom_unlocked(cp, CA_ATOM_APPLICATION_LANGUAGE)))
                                                 if (!(locale = setlocale(LC_MESSAGES, NULL)))
                                                         locale = "C";
 
-                if (!(profile = ca_proplist_gets_unlocked(sp, CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
-                        if (!(profile = ca_proplist_gets_unlocked(cp, CA_PROP_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
-                                profile = DEFAULT_OUTPUT_PROFILE;
+                if (!(profile = ca_propview_gets_atom(&v, CA_ATOM_CANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+                        profile = DEFAULT_OUTPUT_PROFILE;
 
 #ifdef HAVE_CACHE
-                if ((ret = ca_cache_lookup_sound(f, sfopen, sound_path, theme, name, locale, profile)) >= 0) {
+                if ((ret = ca_cache_lookup_sound(f, sfopen, sfopen_info, sound_path, theme, name, locale, profile)) >= 0) {
 
                         /* This entry is available in the cache, let's transform
                          * negative cache entries to CA_ERROR_NOTFOUND */
@@ -813,12 +938,18 @@ int ca_lookup_sound_with_callback(
                          * corrupt, or it was out-of-date. In all cases try to
                          * find the entry manually. */
 
-                        if ((ret = find_sound_for_theme(f, sfopen, sound_path ? sound_path : &spath, t, theme, name, locale, profile)) >= 0)
-                                /* Ok, we found it. Let's update the cache */
-                                ca_cache_store_sound(theme, name, locale, profile, sound_path ? *sound_path : spath);
-                        else if (ret == CA_ERROR_NOTFOUND)
+                        if ((ret = find_sound_for_theme(f, sfopen, sound_path ? sound_path : &spath, t, theme, name, locale, profile)) >= 0) {
+                                ca_sound_file_info info;
+
+                                /* Ok, we found it. Let's update the cache. If
+                                 * we can open the file again without probing
+                                 * it, store what we learned about it, too. */
+                                ca_cache_store_sound(theme, name, locale, profile, sound_path ? *sound_path : spath,
+                                                     sfopen_info && ca_sound_file_get_info(*f, &info) >= 0 ? &info : NULL);
+
+                        } else if (ret == CA_ERROR_NOTFOUND)
                                 /* Doesn't seem to be around, let's create a negative cache entry */
-                                ca_cache_store_sound(theme, name, locale, profile, NULL);
+                                ca_cache_store_sound(theme, name, locale, profile, NULL, NULL);
 
                         ca_free(spath);
                 }
@@ -829,13 +960,10 @@ int ca_lookup_sound_with_callback(
         }
 
         if (ret == CA_ERROR_NOTFOUND || !name) {
-                if ((fname = ca_proplist_gets_unlocked(sp, CA_PROP_MEDIA_FILENAME)))
+                if ((fname = ca_proplist_gets_atom_unlocked(sp, CA_ATOM_MEDIA_FILENAME)))
                         ret = sfopen(f, fname);
         }
 
-        ca_mutex_unlock(cp->mutex);
-        ca_mutex_unlock(sp->mutex);
-
         return ret;
 }
 
@@ -846,23 +974,88 @@ int ca_lookup_sound(
                 ca_proplist *cp,
                 ca_proplist *sp) {
 
-        return ca_lookup_sound_with_callback(f, ca_sound_file_open, sound_path, t, cp, sp);
+        return lookup_sound(f, ca_sound_file_open, ca_sound_file_open_with_info, sound_path, t, cp, sp);
 }
 
-void ca_theme_data_free(ca_theme_data *t) {
-        ca_assert(t);
+int ca_lookup_sound_with_callback(
+                ca_sound_file **f,
+                ca_sound_file_open_callback_t sfopen,
+                char **sound_path,
+                ca_theme_data **t,
+                ca_proplist *cp,
+                ca_proplist *sp) {
 
-        while (t->data_dirs) {
-                ca_data_dir *d = t->data_dirs;
+        /* We don't know what kind of object sfopen returns, hence we
+         * cannot use stored format information for it */
+        return lookup_sound(f, sfopen, NULL, sound_path, t, cp, sp);
+}
 
-                CA_LLIST_REMOVE(ca_data_dir, t->data_dirs, d);
+int ca_resolve_sound(ca_proplist **_r, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp) {
+        ca_sound_file *f = NULL;
+        ca_sound_file_info info;
+        ca_proplist *r = NULL;
+        char *path = NULL;
+        int ret;
 
-                ca_free(d->theme_name);
-                ca_free(d->dir_name);
-                ca_free(d->output_profile);
-                ca_free(d);
+        ca_return_val_if_fail(_r, CA_ERROR_INVALID);
+        ca_return_val_if_fail(t, CA_ERROR_INVALID);
+        ca_return_val_if_fail(cp, CA_ERROR_INVALID);
+        ca_return_val_if_fail(sp, CA_ERROR_INVALID);
+
+        *_r = NULL;
+
+        /* A plain file name needs no lookup */
+        if (!ca_proplist_gets_atom_unlocked(sp, CA_ATOM_EVENT_ID))
+                return CA_SUCCESS;
+
+        if ((ret = ca_lookup_sound(&f, &path, t, cp, sp)) < 0)
+                return ret;
+
+        /* The event sound wasn't found, but the file name is used */
+        if (!path) {
+                ret = CA_SUCCESS;
+                goto finish;
         }
 
-        ca_free(t->name);
-        ca_free(t);
+        if ((ret = ca_proplist_copy(&r, sp)) < 0)
+                goto finish;
+
+        if ((ret = ca_proplist_sets(r, RESOLVED_FILENAME, path)) < 0)
+                goto finish;
+
+        if (ca_sound_file_get_info(f, &info) >= 0)
+                if ((ret = ca_proplist_set(r, RESOLVED_INFO, &info, sizeof(info))) < 0)
+                        goto finish;
+
+        ca_proplist_freeze(r);
+        *_r = r;
+        r = NULL;
+
+        ret = CA_SUCCESS;
+
+finish:
+
+        if (r)
+                ca_assert_se(ca_proplist_destroy(r) == CA_SUCCESS);
+
+        ca_sound_file_close(f);
+        ca_free(path);
+
+        return ret;
+}
+
+/* Drops a reference */
+void ca_theme_data_free(ca_theme_data *t) {
+        ca_bool_t last;
+
+        ca_assert(t);
+
+        /* Theme data is only created after the mutex */
+        ca_mutex_lock(theme_mutex);
+        ca_assert(t->n_ref >= 1);
+        last = --t->n_ref <= 0;
+        ca_mutex_unlock(theme_mutex);
+
+        if (last)
+                theme_data_free(t);
 }
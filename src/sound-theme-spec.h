@@ -29,11 +29,18 @@
 typedef struct ca_theme_data ca_theme_data;
 
 typedef int (*ca_sound_file_open_callback_t)(ca_sound_file **f, const char *fn);
+typedef int (*ca_sound_file_open_info_callback_t)(ca_sound_file **f, const char *fn, const ca_sound_file_info *i);
 
 int ca_lookup_sound(ca_sound_file **f, char **sound_path, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
 int ca_lookup_sound_with_callback(ca_sound_file **f, ca_sound_file_open_callback_t sfopen, char **sound_path, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
 void ca_theme_data_free(ca_theme_data *t);
 
+/* Looks up the sound for sp once. On success *r is a frozen copy of
+ * sp that remembers the file that was found, so that ca_lookup_sound()
+ * doesn't need to look for it again, or NULL if there was nothing to
+ * look up. */
+int ca_resolve_sound(ca_proplist **r, ca_theme_data **t, ca_proplist *cp, ca_proplist *sp);
+
 int ca_get_data_home(char **e);
 const char *ca_get_data_dirs(void);
 
@@ -38,6 +38,7 @@ static void callback(ca_context *c, uint32_t id, int error, void *userdata) {
 int main(int argc, char *argv[]) {
         ca_context *c;
         ca_proplist *p;
+        ca_event *e;
         int ret;
 
         setlocale(LC_ALL, "");
@@ -86,6 +87,20 @@ int main(int argc, char *argv[]) {
                               NULL);
         fprintf(stderr, "play (by filename): %s\n", ca_strerror(ret));
 
+        /* Now prepare a sound event that is triggered often */
+        ca_proplist_create(&p);
+        ca_proplist_sets(p, CA_PROP_EVENT_ID, "button-pressed");
+        ca_proplist_sets(p, CA_PROP_MEDIA_NAME, "Button pressed");
+        ret = ca_event_new(&e, c, p);
+        ca_proplist_destroy(p);
+        fprintf(stderr, "event_new: %s\n", ca_strerror(ret));
+
+        if (ret == CA_SUCCESS) {
+                ret = ca_event_play(e, 3, NULL, NULL);
+                fprintf(stderr, "event_play: %s\n", ca_strerror(ret));
+                ca_event_destroy(e);
+        }
+
         fprintf(stderr, "Sleep half a second ...\n");
         usleep(500000);
 
@@ -0,0 +1,295 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include <dbus/dbus.h>
+
+#include "realtime.h"
+
+/* Plays RealtimeKit on the system bus and checks what
+ * ca_realtime_request() and ca_realtime_drop() make of its answers. We
+ * must be able to take its name, so run this on a private bus, e.g.:
+ *
+ *   dbus-run-session -- sh -c 'DBUS_SYSTEM_BUS_ADDRESS=$DBUS_SESSION_BUS_ADDRESS ./test-realtime'
+ *
+ * The scheduling policy is only checked where we may actually change
+ * it, i.e. as root or with RLIMIT_RTPRIO set. */
+
+#define SERVICE_NAME "org.freedesktop.RealtimeKit1"
+#define MAX_PRIORITY 2
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0
+#endif
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static int refuse = 0;
+static unsigned n_requests = 0;
+static pid_t last_tid = 0;
+static unsigned last_priority = 0;
+static int granted = 0;
+
+static int failed = 0;
+
+#define check(expr)                                                     \
+        do {                                                            \
+                if (!(expr)) {                                          \
+                        fprintf(stderr, "%s:%u: check failed: %s\n",    \
+                                __FILE__, __LINE__, #expr);             \
+                        failed = 1;                                     \
+                }                                                       \
+        } while (0)
+
+static DBusMessage *get_property(DBusMessage *m) {
+        const char *interface, *property;
+        DBusMessageIter iter, sub;
+        DBusMessage *reply;
+
+        if (!dbus_message_get_args(m, NULL,
+                                   DBUS_TYPE_STRING, &interface,
+                                   DBUS_TYPE_STRING, &property,
+                                   DBUS_TYPE_INVALID))
+                return dbus_message_new_error(m, DBUS_ERROR_INVALID_ARGS, "Bad arguments");
+
+        reply = dbus_message_new_method_return(m);
+        dbus_message_iter_init_append(reply, &iter);
+
+        /* The real RealtimeKit answers with int32 for one and int64
+         * for the other */
+        if (strcmp(property, "MaxRealtimePriority") == 0) {
+                dbus_int32_t i = MAX_PRIORITY;
+
+                dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "i", &sub);
+                dbus_message_iter_append_basic(&sub, DBUS_TYPE_INT32, &i);
+        } else {
+                dbus_int64_t i = 200000;
+
+                dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "x", &sub);
+                dbus_message_iter_append_basic(&sub, DBUS_TYPE_INT64, &i);
+        }
+
+        dbus_message_iter_close_container(&iter, &sub);
+
+        return reply;
+}
+
+static DBusMessage *make_realtime(DBusMessage *m) {
+        dbus_uint64_t tid;
+        dbus_uint32_t priority;
+        struct sched_param param;
+        DBusMessage *reply;
+
+        if (!dbus_message_get_args(m, NULL,
+                                   DBUS_TYPE_UINT64, &tid,
+                                   DBUS_TYPE_UINT32, &priority,
+                                   DBUS_TYPE_INVALID))
+                return dbus_message_new_error(m, DBUS_ERROR_INVALID_ARGS, "Bad arguments");
+
+        /* Answer late, so that the caller has a chance to change its
+         * mind in the meantime */
+        usleep(100000);
+
+        pthread_mutex_lock(&mutex);
+
+        n_requests++;
+        last_tid = (pid_t) tid;
+        last_priority = priority;
+
+        if (refuse)
+                reply = dbus_message_new_error(m, DBUS_ERROR_ACCESS_DENIED, "Go away");
+        else {
+                memset(&param, 0, sizeof(param));
+                param.sched_priority = (int) priority;
+                granted = sched_setscheduler((pid_t) tid, SCHED_FIFO, &param) == 0;
+
+                reply = dbus_message_new_method_return(m);
+        }
+
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        return reply;
+}
+
+static void *service_func(void *userdata) {
+        DBusConnection *connection = userdata;
+
+        while (dbus_connection_read_write(connection, -1)) {
+                DBusMessage *m, *reply;
+
+                while ((m = dbus_connection_pop_message(connection))) {
+                        reply = NULL;
+
+                        if (dbus_message_is_method_call(m, "org.freedesktop.DBus.Properties", "Get"))
+                                reply = get_property(m);
+                        else if (dbus_message_is_method_call(m, SERVICE_NAME, "MakeThreadRealtime"))
+                                reply = make_realtime(m);
+
+                        if (reply) {
+                                dbus_connection_send(connection, reply, NULL);
+                                dbus_message_unref(reply);
+                        }
+
+                        dbus_message_unref(m);
+                }
+        }
+
+        return NULL;
+}
+
+/* Waits until the service saw request number n, and a bit longer so
+ * that our helper thread is done with the answer too */
+static int wait_for_request(unsigned n) {
+        struct timespec ts;
+        int ret = 0;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 5;
+
+        pthread_mutex_lock(&mutex);
+
+        while (n_requests < n && ret == 0)
+                ret = pthread_cond_timedwait(&cond, &mutex, &ts);
+
+        pthread_mutex_unlock(&mutex);
+
+        usleep(200000);
+
+        return n_requests >= n;
+}
+
+static int may_fifo(void) {
+        struct rlimit rl;
+
+        if (getuid() == 0)
+                return 1;
+
+        return getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur > 0;
+}
+
+static int is_fifo(void) {
+        return (sched_getscheduler(0) & ~SCHED_RESET_ON_FORK) == SCHED_FIFO;
+}
+
+static void *test_func(void *userdata) {
+        pid_t tid = (pid_t) syscall(SYS_gettid);
+
+        /* RealtimeKit is asked first, for the calling thread, with our
+         * priority clamped to what it allows */
+        ca_realtime_request();
+        check(wait_for_request(1));
+        check(last_tid == tid);
+        check(last_priority == MAX_PRIORITY);
+
+        if (granted) {
+                check(is_fifo());
+
+                ca_realtime_drop();
+                check(!is_fifo());
+        }
+
+        /* Dropping before RealtimeKit answered must undo what it does
+         * once it answers */
+        ca_realtime_request();
+        ca_realtime_drop();
+        check(wait_for_request(2));
+
+        if (granted)
+                check(!is_fifo());
+
+        /* Once RealtimeKit refused, we try SCHED_FIFO on our own */
+        pthread_mutex_lock(&mutex);
+        refuse = 1;
+        pthread_mutex_unlock(&mutex);
+
+        ca_realtime_request();
+        check(wait_for_request(3));
+
+        if (may_fifo())
+                check(is_fifo());
+
+        ca_realtime_drop();
+        check(!is_fifo());
+
+        /* ... and don't bother RealtimeKit again */
+        ca_realtime_request();
+        usleep(300000);
+        check(n_requests == 3);
+
+        if (may_fifo())
+                check(is_fifo());
+
+        ca_realtime_drop();
+
+        return NULL;
+}
+
+int main(int argc, char *argv[]) {
+        DBusConnection *connection;
+        DBusError error;
+        pthread_t service, test;
+
+        dbus_error_init(&error);
+
+        if (!dbus_threads_init_default())
+                return 1;
+
+        if (!(connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error))) {
+                fprintf(stderr, "Cannot connect to the system bus, skipping: %s\n", error.message);
+                dbus_error_free(&error);
+                return 77;
+        }
+
+        dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+        if (dbus_bus_request_name(connection, SERVICE_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+                fprintf(stderr, "Cannot take the name of RealtimeKit, skipping. Run this on a private bus.\n");
+                dbus_error_free(&error);
+                return 77;
+        }
+
+        if (pthread_create(&service, NULL, service_func, connection) != 0)
+                return 1;
+
+        if (pthread_create(&test, NULL, test_func, NULL) != 0)
+                return 1;
+
+        pthread_join(test, NULL);
+
+        fprintf(stderr, "%s\n", failed ? "FAIL" : "PASS");
+
+        return failed;
+}
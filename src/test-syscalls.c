@@ -0,0 +1,259 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+#include "canberra.h"
+#include "sound-theme-spec.h"
+
+/* Counts the system calls the calling thread makes while it plays the
+ * same event sound again and again on an open context. Once the sound
+ * is in the cache, none should be left besides what the backend does
+ * to actually play it. We use the null backend, and a file opener that
+ * doesn't touch the file system, for the lookup a real backend
+ * does. */
+
+#define EVENT_ID "test-event"
+#define N_WARMUP 20
+#define N_PLAYS 1000
+
+#ifdef __linux__
+
+static char root[] = "/tmp/test-syscalls-XXXXXX";
+
+#ifdef HAVE_CACHE
+static int dummy;
+
+/* Pretends that the sound is in the user's data dir and nothing else
+ * is anywhere */
+static int sfopen(ca_sound_file **f, const char *fn) {
+        const char *e;
+
+        if (!(e = strrchr(fn, '/')) || strcmp(e, "/" EVENT_ID ".oga") != 0)
+                return CA_ERROR_NOTFOUND;
+
+        *f = (ca_sound_file*) &dummy;
+        return CA_SUCCESS;
+}
+#endif
+
+/* Lets the tracer know where we are. What raise() itself costs is
+ * taken into account by the tracer. */
+static void mark(void) {
+        raise(SIGUSR2);
+}
+
+static int play(ca_context *c, ca_proplist *p, ca_theme_data **t) {
+        int ret;
+
+        if ((ret = ca_context_play(c, 1, CA_PROP_EVENT_ID, EVENT_ID, NULL)) < 0)
+                return ret;
+
+#ifdef HAVE_CACHE
+        {
+                ca_sound_file *f;
+
+                /* This is what the real backends do first. Without the
+                 * cache it walks the theme every time. */
+                if ((ret = ca_lookup_sound_with_callback(&f, sfopen, NULL, t, p, p)) < 0)
+                        return ret;
+        }
+#endif
+
+        return CA_SUCCESS;
+}
+
+static int child(void) {
+        ca_context *c;
+        ca_proplist *p;
+        ca_theme_data *t = NULL;
+        char data[sizeof(root) + 16], cache[sizeof(root) + 16];
+        unsigned i;
+        int ret;
+
+        snprintf(data, sizeof(data), "%s/data", root);
+        snprintf(cache, sizeof(cache), "%s/cache", root);
+
+        if (mkdir(data, 0700) < 0 || mkdir(cache, 0700) < 0)
+                return 1;
+
+        setenv("XDG_DATA_HOME", data, 1);
+        setenv("XDG_DATA_DIRS", data, 1);
+        setenv("XDG_CACHE_HOME", cache, 1);
+
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+                return 1;
+
+        raise(SIGSTOP);
+
+        if ((ret = ca_context_create(&c)) < 0 ||
+            (ret = ca_context_set_driver(c, "null")) < 0 ||
+            (ret = ca_context_open(c)) < 0) {
+                fprintf(stderr, "Cannot use the null backend, skipping: %s\n", ca_strerror(ret));
+                return 77;
+        }
+
+        ca_proplist_create(&p);
+        ca_proplist_sets(p, CA_PROP_EVENT_ID, EVENT_ID);
+
+        /* Look the sound up and give the cache time to write it out */
+        for (i = 0; i < N_WARMUP; i++) {
+                if ((ret = play(c, p, &t)) < 0) {
+                        fprintf(stderr, "Failed to play: %s\n", ca_strerror(ret));
+                        return 1;
+                }
+
+                usleep(100000);
+        }
+
+        /* Once without and once with the plays in between */
+        mark();
+        mark();
+
+        mark();
+
+        for (i = 0; i < N_PLAYS; i++)
+                play(c, p, &t);
+
+        mark();
+
+        if (t)
+                ca_theme_data_free(t);
+
+        ca_proplist_destroy(p);
+        ca_context_destroy(c);
+
+        return 0;
+}
+
+static int remove_func(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+        remove(path);
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n_marks = 0, counts[4] = { 0, 0, 0, 0 };
+        int status, sig, options, ret = 1;
+        int in_syscall = 0;
+        pid_t pid;
+
+        if (!mkdtemp(root))
+                return 1;
+
+        if ((pid = fork()) < 0)
+                goto finish;
+
+        if (pid == 0)
+                _exit(child());
+
+        if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+                fprintf(stderr, "Cannot trace, skipping.\n");
+                ret = 77;
+                goto finish;
+        }
+
+        options = PTRACE_O_TRACESYSGOOD;
+#ifdef PTRACE_O_EXITKILL
+        options |= PTRACE_O_EXITKILL;
+#endif
+
+        if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*) (long) options) < 0) {
+                fprintf(stderr, "Cannot trace, skipping.\n");
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                ret = 77;
+                goto finish;
+        }
+
+        sig = 0;
+
+        for (;;) {
+                if (ptrace(PTRACE_SYSCALL, pid, NULL, (void*) (long) sig) < 0)
+                        break;
+
+                if (waitpid(pid, &status, 0) < 0)
+                        break;
+
+                if (WIFEXITED(status) || WIFSIGNALED(status))
+                        break;
+
+                sig = 0;
+
+                if (WSTOPSIG(status) == (SIGTRAP|0x80)) {
+                        /* Stops come in pairs, we count the entries */
+                        if (!in_syscall && n_marks > 0 && n_marks < 4)
+                                counts[n_marks]++;
+
+                        in_syscall = !in_syscall;
+
+                } else if (WSTOPSIG(status) == SIGUSR2)
+                        n_marks++;
+                else
+                        sig = WSTOPSIG(status);
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 77) {
+                ret = 77;
+                goto finish;
+        }
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || n_marks != 4) {
+                fprintf(stderr, "Child failed.\n");
+                goto finish;
+        }
+
+        /* counts[1] is what a mark costs, counts[3] is that plus the
+         * plays */
+        fprintf(stderr, "%u plays: %i system calls\n", N_PLAYS, (int) counts[3] - (int) counts[1]);
+
+        ret = counts[3] != counts[1];
+        fprintf(stderr, "%s\n", ret ? "FAIL" : "PASS");
+
+finish:
+        nftw(root, remove_func, 16, FTW_DEPTH|FTW_PHYS);
+
+        return ret;
+}
+
+#else
+
+int main(int argc, char *argv[]) {
+        fprintf(stderr, "Only implemented for Linux, skipping.\n");
+        return 77;
+}
+
+#endif
@@ -0,0 +1,362 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "voices.h"
+#include "malloc.h"
+#include "macro.h"
+#include "mutex.h"
+#include "llist.h"
+#include "id-table.h"
+
+enum stealing {
+        STEAL_LOWEST_PRIORITY,
+        STEAL_OLDEST,
+        STEAL_REFUSE
+};
+
+struct voice {
+        CA_LLIST_FIELDS(struct voice);
+        /* Keyed by the id the sound was started with */
+        ca_id_link by_id;
+        ca_voices *voices;
+        uint32_t id, driver_id;
+        int priority;
+        ca_bool_t stolen;
+        /* The driver has not been asked to play the sound yet, so it
+         * cannot be canceled. If the driver finishes it before we are
+         * told it has been started, finished is set and the voice is
+         * freed by ca_voices_started(). */
+        ca_bool_t pending, finished;
+        ca_finish_callback_t callback;
+        void *userdata;
+};
+
+struct ca_voices {
+        ca_mutex *mutex;
+
+        /* Oldest first */
+        CA_LLIST_HEAD(struct voice, voices);
+        struct voice *voices_tail;
+        unsigned n_voices;
+        ca_id_table by_id;
+
+        uint32_t next_id;
+};
+
+int ca_voices_new(ca_voices **_s) {
+        ca_voices *s;
+
+        ca_return_val_if_fail(_s, CA_ERROR_INVALID);
+
+        if (!(s = ca_new0(ca_voices, 1)))
+                return CA_ERROR_OOM;
+
+        if (!(s->mutex = ca_mutex_new())) {
+                ca_free(s);
+                return CA_ERROR_OOM;
+        }
+
+        if (ca_id_table_init(&s->by_id) < 0) {
+                ca_mutex_free(s->mutex);
+                ca_free(s);
+                return CA_ERROR_OOM;
+        }
+
+        *_s = s;
+        return CA_SUCCESS;
+}
+
+void ca_voices_free(ca_voices *s) {
+        struct voice *v;
+
+        ca_assert(s);
+
+        while ((v = s->voices)) {
+                CA_LLIST_REMOVE(struct voice, s->voices, v);
+                ca_free(v);
+        }
+
+        ca_id_table_done(&s->by_id);
+        ca_mutex_free(s->mutex);
+        ca_free(s);
+}
+
+static void remove_unlocked(ca_voices *s, struct voice *v) {
+
+        if (s->voices_tail == v)
+                s->voices_tail = v->prev;
+
+        CA_LLIST_REMOVE(struct voice, s->voices, v);
+        ca_id_table_remove(&s->by_id, &v->by_id);
+
+        if (!v->stolen)
+                s->n_voices--;
+}
+
+static void finish_cb(ca_context *c, uint32_t id, int error_code, void *userdata) {
+        struct voice *v = userdata;
+        ca_voices *s = v->voices;
+        ca_finish_callback_t callback;
+        void *data;
+        ca_bool_t pending;
+
+        callback = v->callback;
+        data = v->userdata;
+        id = v->id;
+
+        ca_mutex_lock(s->mutex);
+        remove_unlocked(s, v);
+
+        if ((pending = v->pending))
+                v->finished = TRUE;
+
+        ca_mutex_unlock(s->mutex);
+
+        if (!pending)
+                ca_free(v);
+
+        if (callback)
+                callback(c, id, error_code, data);
+}
+
+static int parse_int(const char *t, long *l) {
+        char *e = NULL;
+
+        errno = 0;
+        *l = strtol(t, &e, 10);
+
+        if (errno != 0 || !e || *e || e == t || *l < INT_MIN || *l > INT_MAX)
+                return CA_ERROR_INVALID;
+
+        return CA_SUCCESS;
+}
+
+static int parse_props(const ca_propview *pv, unsigned *max_voices, int *priority, enum stealing *stealing) {
+        const char *t;
+        long l;
+
+        *max_voices = 0;
+        *priority = 0;
+        *stealing = STEAL_LOWEST_PRIORITY;
+
+        if ((t = ca_propview_gets_atom(pv, CA_ATOM_CANBERRA_MAX_VOICES))) {
+                if (parse_int(t, &l) < 0 || l < 0)
+                        return CA_ERROR_INVALID;
+
+                *max_voices = (unsigned) l;
+        }
+
+        if ((t = ca_propview_gets_atom(pv, CA_ATOM_CANBERRA_PRIORITY))) {
+                if (parse_int(t, &l) < 0)
+                        return CA_ERROR_INVALID;
+
+                *priority = (int) l;
+        }
+
+        if ((t = ca_propview_gets_atom(pv, CA_ATOM_CANBERRA_VOICE_STEALING))) {
+                if (ca_streq(t, "lowest-priority"))
+                        *stealing = STEAL_LOWEST_PRIORITY;
+                else if (ca_streq(t, "oldest"))
+                        *stealing = STEAL_OLDEST;
+                else if (ca_streq(t, "refuse"))
+                        *stealing = STEAL_REFUSE;
+                else
+                        return CA_ERROR_INVALID;
+        }
+
+        return CA_SUCCESS;
+}
+
+/* Picks the sound that has to make room for a new one with the
+ * specified priority. Call with the mutex held. */
+static struct voice* find_victim_unlocked(ca_voices *s, int priority, enum stealing stealing) {
+        struct voice *v, *victim = NULL;
+
+        for (v = s->voices; v; v = v->next) {
+
+                /* Canceling a sound the driver doesn't know yet would
+                 * not free anything */
+                if (v->stolen || v->pending)
+                        continue;
+
+                if (stealing == STEAL_OLDEST)
+                        return v;
+
+                /* Among equals we take the oldest one */
+                if (!victim || v->priority < victim->priority)
+                        victim = v;
+        }
+
+        if (victim && victim->priority > priority)
+                return NULL;
+
+        return victim;
+}
+
+int ca_voices_start(ca_voices *s, const ca_propview *pv, uint32_t *id, ca_finish_callback_t *cb, void **userdata, ca_bool_t *steal, uint32_t *victim) {
+        struct voice *v, *stolen = NULL;
+        unsigned max_voices;
+        enum stealing stealing;
+        int priority, ret;
+
+        ca_return_val_if_fail(s, CA_ERROR_INVALID);
+        ca_return_val_if_fail(pv, CA_ERROR_INVALID);
+        ca_return_val_if_fail(id, CA_ERROR_INVALID);
+        ca_return_val_if_fail(cb, CA_ERROR_INVALID);
+        ca_return_val_if_fail(userdata, CA_ERROR_INVALID);
+        ca_return_val_if_fail(steal, CA_ERROR_INVALID);
+        ca_return_val_if_fail(victim, CA_ERROR_INVALID);
+
+        *steal = FALSE;
+
+        if ((ret = parse_props(pv, &max_voices, &priority, &stealing)) < 0)
+                return ret;
+
+        if (!(v = ca_new0(struct voice, 1)))
+                return CA_ERROR_OOM;
+
+        v->voices = s;
+        v->id = *id;
+        v->pending = TRUE;
+        v->priority = priority;
+        v->callback = *cb;
+        v->userdata = *userdata;
+
+        ca_mutex_lock(s->mutex);
+
+        if (max_voices > 0 && s->n_voices >= max_voices) {
+
+                if (stealing == STEAL_REFUSE ||
+                    !(stolen = find_victim_unlocked(s, priority, stealing))) {
+                        ca_mutex_unlock(s->mutex);
+                        ca_free(v);
+                        return CA_ERROR_SUPPRESSED;
+                }
+
+                /* The sound is removed from the list when the driver
+                 * tells us it has been canceled, until then it just
+                 * doesn't count anymore */
+                stolen->stolen = TRUE;
+                s->n_voices--;
+
+                *steal = TRUE;
+                *victim = stolen->driver_id;
+        }
+
+        v->driver_id = s->next_id++;
+
+        CA_LLIST_INSERT_AFTER(struct voice, s->voices, s->voices_tail, v);
+        s->voices_tail = v;
+        s->n_voices++;
+        ca_id_table_put(&s->by_id, &v->by_id, v->id);
+
+        ca_mutex_unlock(s->mutex);
+
+        *id = v->driver_id;
+        *cb = finish_cb;
+        *userdata = v;
+
+        return CA_SUCCESS;
+}
+
+void ca_voices_abort(ca_voices *s, uint32_t *id, ca_finish_callback_t *cb, void **userdata) {
+        struct voice *v;
+
+        ca_assert(s);
+        ca_assert(id);
+        ca_assert(cb);
+        ca_assert(userdata);
+        ca_assert(*cb == finish_cb);
+
+        v = *userdata;
+
+        ca_mutex_lock(s->mutex);
+        remove_unlocked(s, v);
+        ca_mutex_unlock(s->mutex);
+
+        *id = v->id;
+        *cb = v->callback;
+        *userdata = v->userdata;
+
+        ca_free(v);
+}
+
+void ca_voices_started(ca_voices *s, ca_finish_callback_t cb, void *userdata) {
+        struct voice *v = userdata;
+        ca_bool_t finished;
+
+        ca_assert(s);
+        ca_assert(cb == finish_cb);
+
+        ca_mutex_lock(s->mutex);
+
+        if (!(finished = v->finished))
+                v->pending = FALSE;
+
+        ca_mutex_unlock(s->mutex);
+
+        if (finished)
+                ca_free(v);
+}
+
+int ca_voices_lookup(ca_voices *s, uint32_t id, uint32_t *buf, unsigned n_buf, uint32_t **_ids, unsigned *_n) {
+        ca_id_link *l;
+        uint32_t *ids;
+        unsigned n = 0;
+
+        ca_return_val_if_fail(s, CA_ERROR_INVALID);
+        ca_return_val_if_fail(buf, CA_ERROR_INVALID);
+        ca_return_val_if_fail(n_buf > 0, CA_ERROR_INVALID);
+        ca_return_val_if_fail(_ids, CA_ERROR_INVALID);
+        ca_return_val_if_fail(_n, CA_ERROR_INVALID);
+
+        ca_mutex_lock(s->mutex);
+
+        for (l = ca_id_table_first(&s->by_id, id); l; l = ca_id_table_next(l))
+                n++;
+
+        if (n <= n_buf)
+                ids = buf;
+        else if (!(ids = ca_new(uint32_t, n))) {
+                ca_mutex_unlock(s->mutex);
+                return CA_ERROR_OOM;
+        }
+
+        n = 0;
+        for (l = ca_id_table_first(&s->by_id, id); l; l = ca_id_table_next(l))
+                ids[n++] = CA_ID_TABLE_ENTRY(l, struct voice, by_id)->driver_id;
+
+        ca_mutex_unlock(s->mutex);
+
+        *_ids = ids;
+        *_n = n;
+
+        return CA_SUCCESS;
+}
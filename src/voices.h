@@ -0,0 +1,59 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef foocanberravoiceshfoo
+#define foocanberravoiceshfoo
+
+/***
+  This file is part of libcanberra.
+
+  Copyright 2009 Lennart Poettering
+
+  libcanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libcanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libcanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "canberra.h"
+#include "proplist.h"
+
+/* Keeps track of the sounds that are playing on a context, to
+ * enforce CA_PROP_CANBERRA_MAX_VOICES. Every sound gets a unique id
+ * for the driver, so that a single one can be canceled when it has to
+ * make room for another. This happens for all sounds of the context,
+ * whether a limit was set or not, so that the driver never sees the
+ * ids of the caller. */
+typedef struct ca_voices ca_voices;
+
+int ca_voices_new(ca_voices **_s);
+void ca_voices_free(ca_voices *s);
+
+/* Registers a new sound. On success *id, *cb and *userdata are
+ * replaced by what has to be passed on to the driver. If another
+ * sound has to be stopped first, *steal is set and *victim is its
+ * driver id. Returns CA_ERROR_SUPPRESSED if there is no room. */
+int ca_voices_start(ca_voices *s, const ca_propview *v, uint32_t *id, ca_finish_callback_t *cb, void **userdata, ca_bool_t *steal, uint32_t *victim);
+
+/* Unregisters a sound the driver failed to start and gives back what
+ * was passed to ca_voices_start(). */
+void ca_voices_abort(ca_voices *s, uint32_t *id, ca_finish_callback_t *cb, void **userdata);
+
+/* Tells that the driver has accepted a sound, with what
+ * ca_voices_start() returned. Only from then on it may be stolen. */
+void ca_voices_started(ca_voices *s, ca_finish_callback_t cb, void *userdata);
+
+/* Returns the driver ids of all sounds that were started with id. They
+ * are stored in buf if there are no more than n_buf of them, and in
+ * memory that has to be freed with ca_free() otherwise. */
+int ca_voices_lookup(ca_voices *s, uint32_t id, uint32_t *buf, unsigned n_buf, uint32_t **ids, unsigned *n);
+
+#endif